@@ -0,0 +1,379 @@
+// bundle.c — packing a directory tree into a record stream and unpacking it
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "bundle.h"
+
+#define COPY_BUF 65536
+
+static int write_all(int fd, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int put_record(int fd, int kind, uint32_t mode, uint64_t size, const char *path, size_t path_len) {
+    unsigned char hdr[BUNDLE_HDR];
+    uint32_t m = htobe32(mode);
+    uint64_t s = htobe64(size);
+    uint16_t l = htobe16(path_len);
+    hdr[0] = kind;
+    memcpy(hdr + 1, &m, 4);
+    memcpy(hdr + 5, &s, 8);
+    memcpy(hdr + 13, &l, 2);
+    if (write_all(fd, hdr, BUNDLE_HDR) < 0) return -1;
+    return write_all(fd, path, path_len);
+}
+
+// Exactly size bytes of in; a file that shrank while being packed is an error
+static int copy_file(int out, int in, uint64_t size) {
+    while (size > 0) {
+        ssize_t n = sendfile(out, in, NULL, size < (1u << 30) ? size : (1u << 30));
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) break;
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return -1;
+        }
+        size -= n;
+    }
+    // No sendfile() between these two files: copy through a buffer
+    char buf[COPY_BUF];
+    while (size > 0) {
+        ssize_t n = read(in, buf, size < sizeof(buf) ? size : sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return -1;
+        }
+        if (write_all(out, buf, n) < 0) return -1;
+        size -= n;
+    }
+    return 0;
+}
+
+// Records for everything in the open directory dfd, whose path is path[0, len)
+static int pack_dir(int dfd, char *path, size_t len, int out, struct bundle_stats *st) {
+    DIR *d = fdopendir(dfd);
+    if (!d) {
+        close(dfd);
+        return -1;
+    }
+    int rc = 0;
+    struct dirent *e;
+    while (rc == 0 && (e = readdir(d))) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+        size_t n = strlen(e->d_name), plen = len + (len ? 1 : 0) + n;
+        if (plen >= BUNDLE_PATH_MAX) {
+            errno = ENAMETOOLONG;
+            rc = -1;
+            break;
+        }
+        if (len) path[len] = '/';
+        memcpy(path + plen - n, e->d_name, n + 1);
+
+        struct stat sb;
+        if (fstatat(dirfd(d), e->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+            rc = -1;
+        } else if (S_ISDIR(sb.st_mode)) {
+            int sub = openat(dirfd(d), e->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            rc = sub < 0 ? -1 : put_record(out, BUNDLE_DIR, sb.st_mode & 07777, 0, path, plen);
+            if (rc == 0) {
+                st->dirs++;
+                rc = pack_dir(sub, path, plen, out, st);
+            } else if (sub >= 0) {
+                close(sub);
+            }
+        } else if (S_ISREG(sb.st_mode)) {
+            int fd = openat(dirfd(d), e->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            rc = fd < 0 ? -1 : put_record(out, BUNDLE_FILE, sb.st_mode & 07777, sb.st_size, path, plen);
+            if (rc == 0) rc = copy_file(out, fd, sb.st_size);
+            if (fd >= 0) close(fd);
+            st->files++;
+            st->bytes += sb.st_size;
+        }
+        path[len] = '\0';
+    }
+    int saved = errno;
+    closedir(d);
+    errno = saved;
+    return rc;
+}
+
+int bundle_pack(const char *dir, int out_fd, struct bundle_stats *st) {
+    char path[BUNDLE_PATH_MAX] = "";
+    memset(st, 0, sizeof(*st));
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    return pack_dir(fd, path, 0, out_fd, st);
+}
+
+int bundle_stage(const char *dir, struct bundle_stats *st) {
+    const char *tmp = getenv("TMPDIR");
+    if (!tmp || !*tmp) tmp = "/tmp";
+    int fd = open(tmp, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        // No O_TMPFILE on this filesystem: make a name and drop it at once
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/bundle.XXXXXX", tmp) >= (int)sizeof(path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        fd = mkostemp(path, O_CLOEXEC);
+        if (fd < 0) return -1;
+        unlink(path);
+    }
+    if (bundle_pack(dir, fd, st) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+struct dir_fd {
+    char *path;
+    int fd;
+    unsigned long used;
+};
+
+struct bundle {
+    int root_fd;
+    uint64_t id;
+    struct dir_fd dirs[BUNDLE_DIR_FDS];
+    unsigned long tick;
+    unsigned char hdr[BUNDLE_HDR + BUNDLE_PATH_MAX];
+    size_t hdr_len;        // bytes of the next record header seen so far
+    int fd;                // part file being written, -1 between files
+    int dir;               // its directory, owned by the cache
+    char part[32];
+    char name[NAME_MAX + 1];
+    uint64_t left;
+    uint32_t mode;
+    struct bundle_stats st;
+};
+
+int make_dirs(const char *path) {
+    char buf[BUNDLE_PATH_MAX], *save;
+    if (strlen(path) >= sizeof(buf)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(buf, path);
+    int fd = open(buf[0] == '/' ? "/" : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (char *name = strtok_r(buf, "/", &save); fd >= 0 && name; name = strtok_r(NULL, "/", &save)) {
+        int next = -1;
+        if (mkdirat(fd, name, 0755) == 0 || errno == EEXIST)
+            next = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        close(fd);
+        fd = next;
+    }
+    if (fd < 0) return -1;
+    close(fd);
+    return 0;
+}
+
+// Paths from the stream stay under root: relative, with no empty, "." or ".." component
+static int valid_path(const char *p, size_t len) {
+    if (len == 0 || memchr(p, '\0', len)) return 0;
+    for (size_t i = 0; i <= len;) {
+        const char *c = p + i;
+        size_t n = 0;
+        while (i + n < len && c[n] != '/') n++;
+        if (n == 0 || (n == 1 && c[0] == '.') || (n == 2 && c[0] == '.' && c[1] == '.')) return 0;
+        i += n + 1;
+    }
+    return 1;
+}
+
+// Open directory path[0, len) under root, creating it and its parents, through
+// a small LRU cache so a tree of files costs about one openat() per directory
+static int dir_lookup(struct bundle *b, const char *path, size_t len, mode_t mode) {
+    if (len == 0) return b->root_fd;
+    for (int i = 0; i < BUNDLE_DIR_FDS; ++i) {
+        struct dir_fd *c = &b->dirs[i];
+        if (c->path && strlen(c->path) == len && memcmp(c->path, path, len) == 0) {
+            c->used = ++b->tick;
+            return c->fd;
+        }
+    }
+    const char *slash = memrchr(path, '/', len);
+    size_t plen = slash ? (size_t)(slash - path) : 0, n = len - (slash ? plen + 1 : 0);
+    int parent = dir_lookup(b, path, plen, 0755);
+    if (parent < 0) return -1;
+    char name[NAME_MAX + 1];
+    if (n > NAME_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(name, path + len - n, n);
+    name[n] = '\0';
+    if (mkdirat(parent, name, mode) < 0 && errno != EEXIST) return -1;
+    int fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    struct dir_fd *v = &b->dirs[0];
+    for (int i = 0; i < BUNDLE_DIR_FDS && v->path; ++i)
+        if (!b->dirs[i].path || b->dirs[i].used < v->used) v = &b->dirs[i];
+    char *copy = strndup(path, len);
+    if (!copy) {
+        close(fd);
+        return -1;
+    }
+    if (v->path) {
+        close(v->fd);
+        free(v->path);
+    }
+    v->path = copy;
+    v->fd = fd;
+    v->used = ++b->tick;
+    return fd;
+}
+
+struct bundle *bundle_open(const char *root, uint64_t id) {
+    if (make_dirs(root) < 0) return NULL;
+    struct bundle *b = calloc(1, sizeof(*b));
+    if (!b) return NULL;
+    b->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (b->root_fd < 0) {
+        free(b);
+        return NULL;
+    }
+    b->id = id;
+    b->fd = -1;
+    snprintf(b->part, sizeof(b->part), ".%016llx.part", (unsigned long long)id);
+    return b;
+}
+
+static int finish_file(struct bundle *b) {
+    int rc = fchmod(b->fd, b->mode & 0777);
+    if (close(b->fd) < 0) rc = -1;
+    b->fd = -1;
+    if (rc == 0) rc = renameat(b->dir, b->part, b->dir, b->name);
+    return rc;
+}
+
+static int start_record(struct bundle *b) {
+    uint32_t mode;
+    uint64_t size;
+    uint16_t len;
+    memcpy(&mode, b->hdr + 1, 4);
+    memcpy(&size, b->hdr + 5, 8);
+    memcpy(&len, b->hdr + 13, 2);
+    mode = be32toh(mode);
+    size = be64toh(size);
+    len = be16toh(len);
+    const char *path = (const char *)b->hdr + BUNDLE_HDR;
+    b->hdr_len = 0;
+    if (!valid_path(path, len)) goto bad;
+
+    if (b->hdr[0] == BUNDLE_DIR) {
+        b->st.dirs++;
+        return dir_lookup(b, path, len, (mode & 0777) | S_IRWXU) < 0 ? -1 : 0;
+    }
+    if (b->hdr[0] != BUNDLE_FILE) goto bad;
+    const char *slash = memrchr(path, '/', len);
+    size_t plen = slash ? (size_t)(slash - path) : 0, n = len - (slash ? plen + 1 : 0);
+    if (n > NAME_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((b->dir = dir_lookup(b, path, plen, 0755)) < 0) return -1;
+    memcpy(b->name, path + len - n, n);
+    b->name[n] = '\0';
+    b->fd = openat(b->dir, b->part, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (b->fd < 0) return -1;
+    b->mode = mode;
+    b->left = size;
+    b->st.files++;
+    b->st.bytes += size;
+    return size == 0 ? finish_file(b) : 0;
+bad:
+    errno = EPROTO;
+    return -1;
+}
+
+int bundle_write(struct bundle *b, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len > 0) {
+        if (b->left > 0) {
+            size_t n = len < b->left ? len : b->left;
+            if (write_all(b->fd, p, n) < 0) return -1;
+            b->left -= n;
+            p += n;
+            len -= n;
+            if (b->left == 0 && finish_file(b) < 0) return -1;
+            continue;
+        }
+        size_t need = BUNDLE_HDR;
+        if (b->hdr_len >= BUNDLE_HDR) {
+            uint16_t plen;
+            memcpy(&plen, b->hdr + 13, 2);
+            plen = be16toh(plen);
+            if (plen == 0 || plen >= BUNDLE_PATH_MAX) {
+                errno = EPROTO;
+                return -1;
+            }
+            need += plen;
+        }
+        size_t n = need - b->hdr_len < len ? need - b->hdr_len : len;
+        memcpy(b->hdr + b->hdr_len, p, n);
+        b->hdr_len += n;
+        p += n;
+        len -= n;
+        if (b->hdr_len == need && need > BUNDLE_HDR && start_record(b) < 0) return -1;
+    }
+    return 0;
+}
+
+static void bundle_free(struct bundle *b) {
+    if (b->fd >= 0) {
+        close(b->fd);
+        unlinkat(b->dir, b->part, 0);
+    }
+    for (int i = 0; i < BUNDLE_DIR_FDS; ++i) {
+        if (!b->dirs[i].path) continue;
+        close(b->dirs[i].fd);
+        free(b->dirs[i].path);
+    }
+    close(b->root_fd);
+    free(b);
+}
+
+int bundle_close(struct bundle *b, int sync, struct bundle_stats *st) {
+    int rc = 0;
+    if (b->fd >= 0 || b->hdr_len > 0) {
+        errno = EPROTO;
+        rc = -1;
+    }
+    if (rc == 0 && sync) rc = syncfs(b->root_fd);
+    if (st) *st = b->st;
+    int saved = errno;
+    bundle_free(b);
+    errno = saved;
+    return rc;
+}
+
+void bundle_abort(struct bundle *b) {
+    bundle_free(b);
+}
@@ -0,0 +1,60 @@
+// bundle.h — a directory tree as one byte stream, for directory transfers
+//
+// Every file and directory becomes a record, a fixed header and its path
+// relative to the top of the tree, followed by the file's bytes:
+//
+//   kind(1) mode(be32) size(be64) path_len(be16) <path> <size bytes>
+//
+// kind is BUNDLE_DIR (size 0) or BUNDLE_FILE, and a directory's record comes
+// before anything inside it. Records run back to back, so small files share
+// packets and a whole tree costs one handshake.
+
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUNDLE_HDR 15
+#define BUNDLE_DIR 'D'
+#define BUNDLE_FILE 'F'
+#define BUNDLE_PATH_MAX 4096
+#define BUNDLE_DIR_FDS 32    // directories kept open for openat() on the receiving side
+
+struct bundle_stats {
+    uint32_t files;
+    uint32_t dirs;
+    uint64_t bytes;          // file contents, headers not included
+};
+
+// Append the records for everything under dir to out_fd. Symlinks and special
+// files are skipped. Returns -1 with errno set on a read or write error.
+int bundle_pack(const char *dir, int out_fd, struct bundle_stats *st);
+
+// Pack dir into an unlinked file in $TMPDIR (default /tmp) and return its fd,
+// or -1 with errno set. The stream sits on disk rather than in memory, so a
+// tree may be larger than RAM as long as $TMPDIR has room for it.
+int bundle_stage(const char *dir, struct bundle_stats *st);
+
+struct bundle;
+
+// Unpack into the directory root, creating it and its parents. Each file is
+// written as a hidden part file next to its final name and renamed into place
+// once its last byte is in.
+struct bundle *bundle_open(const char *root, uint64_t id);
+
+// Feed the next len bytes of the stream, split anywhere. Returns -1 on a write
+// error, or with errno EPROTO on a malformed record or a path leaving root.
+int bundle_write(struct bundle *b, const void *data, size_t len);
+
+// The stream is complete: check it ended between records, sync the file
+// system when asked and free b. Returns -1 on error; b is freed either way.
+int bundle_close(struct bundle *b, int sync, struct bundle_stats *st);
+
+// Stop early: the file in progress is removed, finished ones stay.
+void bundle_abort(struct bundle *b);
+
+// mkdir -p, one mkdirat() per component
+int make_dirs(const char *path);
+
+#endif
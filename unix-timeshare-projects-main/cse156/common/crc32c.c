@@ -0,0 +1,138 @@
+// crc32c.c — CRC32C with SSE4.2 / ARMv8 CRC instructions and a sliced-table fallback
+
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HAVE_HW_X86 1
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define HAVE_HW_ARM 1
+#endif
+
+#define POLY 0x82F63B78u  // reflected Castagnoli polynomial
+
+static uint32_t table[8][256];
+static uint32_t (*impl)(uint32_t, const unsigned char *, size_t);
+static const char *impl_name = "sliced-table";
+
+static void build_tables(void) {
+    for (uint32_t n = 0; n < 256; ++n) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; ++k)
+            c = (c & 1) ? (c >> 1) ^ POLY : c >> 1;
+        table[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; ++n)
+        for (int k = 1; k < 8; ++k)
+            table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xFF];
+}
+
+static uint32_t crc_sliced(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len && ((uintptr_t)p & 7)) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xFF];
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        v = __builtin_bswap64(v);
+#endif
+        uint32_t lo = (uint32_t)v ^ crc, hi = (uint32_t)(v >> 32);
+        crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^
+              table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^
+              table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xFF];
+    return crc;
+}
+
+#ifdef HAVE_HW_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len && ((uintptr_t)p & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+#ifdef __x86_64__
+    uint64_t c = crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c;
+#endif
+    while (len >= 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        crc = _mm_crc32_u32(crc, v);
+        p += 4;
+        len -= 4;
+    }
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+#ifdef HAVE_HW_ARM
+__attribute__((target("+crc")))
+static uint32_t crc_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len && ((uintptr_t)p & 7)) {
+        crc = __crc32cb(crc, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
+#endif
+
+__attribute__((constructor))
+static void crc32c_init(void) {
+    build_tables();
+    impl = crc_sliced;
+#ifdef HAVE_HW_X86
+    if (__builtin_cpu_supports("sse4.2")) {
+        impl = crc_hw;
+        impl_name = "sse4.2";
+    }
+#endif
+#ifdef HAVE_HW_ARM
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        impl = crc_hw;
+        impl_name = "armv8-crc";
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    return ~impl(~crc, data, len);
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *data, size_t len) {
+    return ~crc_sliced(~crc, data, len);
+}
+
+const char *crc32c_impl(void) {
+    return impl_name;
+}
@@ -0,0 +1,20 @@
+// crc32c.h — CRC32C (Castagnoli) used for the packet trailer
+//
+// crc32c() follows the zlib convention: start with 0 and feed the previous
+// result back in to checksum data spread over several buffers.
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+// Portable slicing-by-8 path, always available (used by the benchmark)
+uint32_t crc32c_sw(uint32_t crc, const void *data, size_t len);
+
+// Name of the implementation crc32c() dispatches to
+const char *crc32c_impl(void);
+
+#endif
@@ -0,0 +1,104 @@
+// filehash.c — XXH64 leaves folded in file order
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+#include "filehash.h"
+
+#define FOLD_SEED 0x66617368ULL
+#define FINAL_SEED 0x66696c65ULL
+
+static uint64_t fold(uint64_t acc, uint64_t leaf) {
+    uint64_t pair[2] = { htole64(acc), htole64(leaf) };
+    return xxh64(pair, sizeof(pair), FOLD_SEED);
+}
+
+void file_hash_init(struct file_hash *h) {
+    xxh64_reset(&h->leaf, 0);
+    h->leaf_fill = 0;
+    h->fold = 0;
+    h->size = 0;
+}
+
+void file_hash_update(struct file_hash *h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    h->size += len;
+    while (len > 0) {
+        size_t n = FILE_HASH_LEAF - h->leaf_fill < len ? FILE_HASH_LEAF - h->leaf_fill : len;
+        xxh64_update(&h->leaf, p, n);
+        h->leaf_fill += n;
+        p += n;
+        len -= n;
+        if (h->leaf_fill == FILE_HASH_LEAF) {
+            h->fold = fold(h->fold, xxh64_digest(&h->leaf));
+            xxh64_reset(&h->leaf, 0);
+            h->leaf_fill = 0;
+        }
+    }
+}
+
+uint64_t file_hash_final(const struct file_hash *h) {
+    uint64_t acc = h->fold;
+    if (h->leaf_fill > 0) acc = fold(acc, xxh64_digest(&h->leaf));
+    uint64_t pair[2] = { htole64(acc), htole64(h->size) };
+    return xxh64(pair, sizeof(pair), FINAL_SEED);
+}
+
+void file_hash_resume(struct file_hash *h, uint64_t fold, uint64_t size) {
+    file_hash_init(h);
+    h->fold = fold;
+    h->size = size;
+}
+
+struct leaf_job {
+    pthread_t thread;
+    const unsigned char *data;
+    size_t len;
+    uint64_t *leaves;
+    size_t first, last;
+};
+
+static void *hash_leaves(void *arg) {
+    struct leaf_job *j = arg;
+    for (size_t i = j->first; i < j->last; ++i) {
+        size_t off = i * FILE_HASH_LEAF;
+        size_t n = j->len - off < FILE_HASH_LEAF ? j->len - off : FILE_HASH_LEAF;
+        j->leaves[i] = xxh64(j->data + off, n, 0);
+    }
+    return NULL;
+}
+
+uint64_t file_hash_mem(const void *data, size_t len, int nthreads) {
+    size_t nleaves = (len + FILE_HASH_LEAF - 1) / FILE_HASH_LEAF;
+    uint64_t *leaves = malloc(nleaves ? nleaves * sizeof(*leaves) : 1);
+    if (!leaves) {
+        // Out of memory: the streaming form needs none
+        struct file_hash h;
+        file_hash_init(&h);
+        file_hash_update(&h, data, len);
+        return file_hash_final(&h);
+    }
+    if (nthreads > (int)(nleaves / FILE_HASH_MIN_LEAVES)) nthreads = nleaves / FILE_HASH_MIN_LEAVES;
+    if (nthreads < 1) nthreads = 1;
+    struct leaf_job jobs[nthreads];
+    for (int t = 0; t < nthreads; ++t)
+        jobs[t] = (struct leaf_job){ .data = data, .len = len, .leaves = leaves,
+                                     .first = nleaves * t / nthreads, .last = nleaves * (t + 1) / nthreads };
+    // Thread 0's share runs here; a thread that fails to start does its share inline too
+    for (int t = 1; t < nthreads; ++t)
+        if (pthread_create(&jobs[t].thread, NULL, hash_leaves, &jobs[t]) != 0) {
+            hash_leaves(&jobs[t]);
+            jobs[t].thread = 0;
+        }
+    hash_leaves(&jobs[0]);
+    for (int t = 1; t < nthreads; ++t)
+        if (jobs[t].thread) pthread_join(jobs[t].thread, NULL);
+
+    uint64_t acc = 0;
+    for (size_t i = 0; i < nleaves; ++i) acc = fold(acc, leaves[i]);
+    free(leaves);
+    uint64_t pair[2] = { htole64(acc), htole64((uint64_t)len) };
+    return xxh64(pair, sizeof(pair), FINAL_SEED);
+}
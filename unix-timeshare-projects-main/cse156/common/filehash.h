@@ -0,0 +1,44 @@
+// filehash.h — end-to-end hash of a whole file, checked before it is renamed
+//
+// The file is cut into FILE_HASH_LEAF-byte leaves, each hashed with XXH64, and
+// the leaf hashes are folded in order into one 64-bit value that also covers
+// the file size. Leaves are independent, so the sender hashes them across
+// threads straight out of its mapping; a receiver feeds the bytes in as it
+// writes them and never reads the file back.
+
+#ifndef FILEHASH_H
+#define FILEHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "xxh64.h"
+
+#define FILE_HASH_LEAF 65536
+#define FILE_HASH_MIN_LEAVES 64  // fewer leaves than this per thread are not worth a thread
+
+struct file_hash {
+    struct xxh64_state leaf;
+    size_t leaf_fill;            // bytes of the current leaf seen so far
+    uint64_t fold;
+    uint64_t size;
+};
+
+void file_hash_init(struct file_hash *h);
+
+// The next len bytes of the file, split anywhere
+void file_hash_update(struct file_hash *h, const void *data, size_t len);
+
+// Hash of everything fed in so far; h can take more bytes afterwards
+uint64_t file_hash_final(const struct file_hash *h);
+
+// Pick a hash up again after size bytes, a whole number of leaves, from the
+// fold it had there. A receiver that keeps the fold per leaf can resume a file
+// without reading its prefix back.
+void file_hash_resume(struct file_hash *h, uint64_t fold, uint64_t size);
+
+// The same hash of len bytes in memory, leaves split across up to nthreads
+// threads
+uint64_t file_hash_mem(const void *data, size_t len, int nthreads);
+
+#endif
@@ -0,0 +1,125 @@
+// lz4.c — LZ4 block compression (greedy, 4 KiB hash table) and safe decompression
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4.h"
+
+#define HASH_LOG 12
+#define MIN_MATCH 4
+#define MF_LIMIT 12          // a match must start this far before the end
+#define LAST_LITERALS 5      // and the block always ends with this many literals
+#define MAX_OFFSET 65535
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+// Token nibble overflow: 255s and then the remainder
+static uint8_t *put_length(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+int lz4_compress(const void *src_, int n, void *dst_, int cap) {
+    const uint8_t *src = src_, *end = src + n, *ip = src, *anchor = src;
+    uint8_t *dst = dst_, *op = dst, *oend = dst + cap;
+    uint32_t table[1 << HASH_LOG];
+    memset(table, 0, sizeof(table));
+
+    if (n > MF_LIMIT) {
+        const uint8_t *mf_limit = end - MF_LIMIT, *match_limit = end - LAST_LITERALS;
+        while (ip < mf_limit) {
+            uint32_t seq = read32(ip), h = hash4(seq);
+            const uint8_t *ref = src + table[h];
+            table[h] = ip - src;
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *m = ip + MIN_MATCH, *r = ref + MIN_MATCH;
+            while (m < match_limit && *m == *r) {
+                m++;
+                r++;
+            }
+
+            size_t lit = ip - anchor, mlen = m - ip - MIN_MATCH;
+            if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1) return 0;
+            uint8_t *token = op++;
+            *token = (lit >= 15 ? 15 : lit) << 4 | (mlen >= 15 ? 15 : mlen);
+            if (lit >= 15) op = put_length(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+            uint16_t off = ip - ref;
+            *op++ = off & 0xff;
+            *op++ = off >> 8;
+            if (mlen >= 15) op = put_length(op, mlen - 15);
+            ip = anchor = m;
+        }
+    }
+
+    size_t lit = end - anchor;
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit) return 0;
+    *op++ = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15) op = put_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+int lz4_decompress(const void *src_, int n, void *dst_, int cap) {
+    const uint8_t *ip = src_, *iend = ip + n;
+    uint8_t *dst = dst_, *op = dst, *oend = dst + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break;  // the last sequence has no match
+
+        if (iend - ip < 2) return -1;
+        size_t off = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - dst)) return -1;
+        size_t mlen = token & 15;
+        if (mlen == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += MIN_MATCH;
+        if (mlen > (size_t)(oend - op)) return -1;
+        const uint8_t *ref = op - off;
+        for (size_t i = 0; i < mlen; ++i) op[i] = ref[i];  // may overlap
+        op += mlen;
+    }
+    return op - dst;
+}
@@ -0,0 +1,20 @@
+// lz4.h — LZ4 block format, compressor and bounds-checked decompressor
+//
+// Output is a plain LZ4 block (no frame header), readable by any LZ4 block
+// decoder. The compressor is the greedy single-probe variant: fast rather
+// than tight, meant to keep up with the sender.
+
+#ifndef LZ4_H
+#define LZ4_H
+
+// Worst case lz4_compress() output for n input bytes
+#define LZ4_BOUND(n) ((n) + (n) / 255 + 16)
+
+// Compress n bytes into dst; returns the block length, 0 if it needs more than cap bytes.
+int lz4_compress(const void *src, int n, void *dst, int cap);
+
+// Decompress a block of n bytes; returns the bytes produced, -1 on a malformed
+// block or one that would need more than cap bytes.
+int lz4_decompress(const void *src, int n, void *dst, int cap);
+
+#endif
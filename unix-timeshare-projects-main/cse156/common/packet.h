@@ -0,0 +1,94 @@
+// packet.h — versioned wire format shared by the lab3/lab4 clients and servers
+//
+//   | ver<<4 | type | seq (8) | len (4) | fingerprint (7) | payload | CRC32C (4) |
+//
+// The high nibble of the first byte carries the format version; receivers
+// drop anything that is not PKT_VERSION. Sequence numbers are 64-bit, so a
+// transfer never wraps them whatever its size or window. The trailer is the
+// CRC32C of every byte before it, in network byte order.
+
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <arpa/inet.h>
+
+#include "crc32c.h"
+
+#define PKT_VERSION 3
+#define PKT_HEADER 13
+#define TRAILER_SIZE 4
+
+#define PKT_TYPE_BYTE(type) ((unsigned char)((PKT_VERSION << 4) | (type)))
+#define PKT_VER(b) (((unsigned char)(b)) >> 4)
+#define PKT_TYPE(b) (((unsigned char)(b)) & 0x0F)
+
+static inline void pkt_put_header(unsigned char *pkt, int type, uint64_t seq, uint32_t len) {
+    uint64_t net_seq = htobe64(seq);
+    uint32_t net_len = htonl(len);
+    pkt[0] = PKT_TYPE_BYTE(type);
+    memcpy(pkt + 1, &net_seq, 8);
+    memcpy(pkt + 9, &net_len, 4);
+}
+
+// Every client packet carries the sender's fingerprint right after the
+// header; replies from the servers do not
+#define PKT_FINGERPRINT "faslam:"
+#define PKT_FP_LEN 7
+#define PKT_PREFIX (PKT_HEADER + PKT_FP_LEN)
+
+// Header and fingerprint; the body starts PKT_PREFIX bytes in
+static inline int pkt_put_prefix(unsigned char *pkt, int type, uint64_t seq, uint32_t len) {
+    pkt_put_header(pkt, type, seq, len);
+    memcpy(pkt + PKT_HEADER, PKT_FINGERPRINT, PKT_FP_LEN);
+    return PKT_PREFIX;
+}
+
+static inline uint64_t pkt_seq(const unsigned char *pkt) {
+    uint64_t net;
+    memcpy(&net, pkt + 1, 8);
+    return be64toh(net);
+}
+
+static inline uint32_t pkt_len(const unsigned char *pkt) {
+    uint32_t net;
+    memcpy(&net, pkt + 9, 4);
+    return ntohl(net);
+}
+
+static inline void pkt_put_trailer(unsigned char *trailer, uint32_t crc) {
+    uint32_t net = htonl(crc);
+    memcpy(trailer, &net, TRAILER_SIZE);
+}
+
+// Trailer over pkt[0..len) written right after it; returns the packet's
+// full length
+static inline int pkt_seal(unsigned char *pkt, int len) {
+    pkt_put_trailer(pkt + len, crc32c(0, pkt, len));
+    return len + TRAILER_SIZE;
+}
+
+// Path MTU probe (see pmtu.h): the servers answer any size of it with a
+// header-only reply carrying the same seq and, as 4 bytes of payload, the
+// size that arrived
+#define PKT_TYPE_PROBE 0x6
+#define PKT_PROBE_REPLY (PKT_HEADER + 4 + TRAILER_SIZE)
+
+static inline void pkt_put_probe_reply(unsigned char *reply, uint64_t seq, uint32_t size) {
+    uint32_t net = htonl(size);
+    pkt_put_header(reply, PKT_TYPE_PROBE, seq, 4);
+    memcpy(reply + PKT_HEADER, &net, 4);
+    pkt_seal(reply, PKT_HEADER + 4);
+}
+
+// Non-zero when pkt[0..len) carries our version and a matching trailer
+static inline int pkt_valid(const unsigned char *pkt, size_t len) {
+    if (len < 1 + TRAILER_SIZE || PKT_VER(pkt[0]) != PKT_VERSION) return 0;
+    uint32_t net;
+    memcpy(&net, pkt + len - TRAILER_SIZE, TRAILER_SIZE);
+    return ntohl(net) == crc32c(0, pkt, len - TRAILER_SIZE);
+}
+
+#endif
@@ -0,0 +1,97 @@
+// pktio.c — three-iovec sends, MSG_ZEROCOPY and its completions
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+
+#include "packet.h"
+#include "pktio.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void pkt_tx_init(struct pkt_tx *tx, int fd, const struct sockaddr_in *peer) {
+    int one = 1;
+    memset(tx, 0, sizeof(*tx));
+    tx->fd = fd;
+    if ((ntohl(peer->sin_addr.s_addr) >> 24) == IN_LOOPBACKNET) return;
+    tx->zerocopy = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+}
+
+ssize_t pkt_sendv(struct pkt_tx *tx, const struct sockaddr_in *to, const void *hdr, size_t hdr_len,
+                  const void *data, size_t data_len, const void *trailer, void *ctrl, size_t ctrl_len) {
+    struct iovec iov[3] = {
+        { .iov_base = (void *)hdr, .iov_len = hdr_len },
+        { .iov_base = (void *)data, .iov_len = data_len },
+        { .iov_base = (void *)trailer, .iov_len = trailer ? TRAILER_SIZE : 0 },
+    };
+    struct msghdr msg = {
+        .msg_name = (void *)to,
+        .msg_namelen = to ? sizeof(*to) : 0,
+        .msg_iov = iov,
+        .msg_iovlen = 3,
+        .msg_control = ctrl_len ? ctrl : NULL,
+        .msg_controllen = ctrl_len,
+    };
+    if (tx->zerocopy && data_len >= PKT_ZC_MIN) {
+        ssize_t n = sendmsg(tx->fd, &msg, MSG_ZEROCOPY);
+        if (n >= 0) {
+            tx->next_id++;
+            tx->zc_sends++;
+            return n;
+        }
+        // ENOBUFS: more pages are pinned than the socket may hold. Take what
+        // has completed and copy this one.
+        if (errno != ENOBUFS) return n;
+        pkt_tx_reap(tx);
+    }
+    return sendmsg(tx->fd, &msg, 0);
+}
+
+int pkt_tx_reap(struct pkt_tx *tx) {
+    int done = 0;
+    char ctrl[128];
+    for (;;) {
+        struct msghdr msg = { .msg_control = ctrl, .msg_controllen = sizeof(ctrl) };
+        if (recvmsg(tx->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return done;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level != SOL_IP || c->cmsg_type != IP_RECVERR) continue;
+            struct sock_extended_err ee;
+            memcpy(&ee, CMSG_DATA(c), sizeof(ee));
+            if (ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            // One notification covers the sends numbered ee_info to ee_data
+            uint32_t n = ee.ee_data - ee.ee_info + 1;
+            done += n;
+            if ((int32_t)(ee.ee_data + 1 - tx->done_id) > 0) tx->done_id = ee.ee_data + 1;
+            // The kernel copied after all, as it does on loopback or without
+            // scatter-gather: pinning only costs here, so stop asking for it
+            if (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                tx->zc_copied += n;
+                tx->zerocopy = 0;
+            }
+        }
+    }
+}
+
+void pkt_tx_flush(struct pkt_tx *tx) {
+    long long deadline = now_ms() + PKT_ZC_FLUSH_MS, left;
+    pkt_tx_reap(tx);
+    while (tx->done_id != tx->next_id && (left = deadline - now_ms()) > 0) {
+        // No events asked for: poll() still reports POLLERR for the error queue
+        struct pollfd pfd = { .fd = tx->fd, .events = 0 };
+        if (poll(&pfd, 1, left) > 0) pkt_tx_reap(tx);
+    }
+}
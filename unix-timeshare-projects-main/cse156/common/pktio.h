@@ -0,0 +1,53 @@
+// pktio.h — sending packets whose payload is never copied into a buffer
+//
+// A packet goes out as three iovecs: the header in a small per-slot buffer,
+// the payload where it already lies (the mmap'd input file, a compressed
+// frame) and the 4-byte trailer. Payloads of PKT_ZC_MIN bytes or more are sent
+// with MSG_ZEROCOPY, so not even the kernel copies them: it pins the pages and
+// reports on the socket's error queue once it is done with them. All three
+// iovecs must then stay untouched until pkt_tx_reap() has seen that send
+// complete. The payloads here are read-only mappings, or compressed frames
+// that are only reused once every flow has ACKed them, and a slot's header is
+// only rewritten after its packet is ACKed or after pkt_tx_flush(). A resend
+// of an ACKed packet may still be pinned then; if its bytes change it fails
+// its CRC, and the server already holds it.
+
+#ifndef PKTIO_H
+#define PKTIO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#define PKT_ZC_MIN 10240         // below this, pinning the pages costs more than the copy
+#define PKT_ZC_FLUSH_MS 100      // longest pkt_tx_flush() waits for the kernel
+
+struct pkt_tx {
+    int fd;
+    int zerocopy;                // MSG_ZEROCOPY still in use on fd
+    uint32_t next_id;            // the kernel numbers zerocopy sends from 0
+    uint32_t done_id;            // every send before this has completed
+    long zc_sends, zc_copied;    // sent zerocopy; of those, copied anyway
+};
+
+// Set up sends on fd to peer and turn MSG_ZEROCOPY on when the kernel offers
+// it. Never for a loopback peer: the kernel copies every zerocopy datagram
+// looped to a local socket anyway, late, and the receiver is charged more
+// for it, enough to overflow its buffer with a window of large packets.
+void pkt_tx_init(struct pkt_tx *tx, int fd, const struct sockaddr_in *peer);
+
+// hdr, data and trailer as one datagram to `to` (NULL on a connected socket),
+// with ctrl as ancillary data when ctrl_len is non-zero
+ssize_t pkt_sendv(struct pkt_tx *tx, const struct sockaddr_in *to, const void *hdr, size_t hdr_len,
+                  const void *data, size_t data_len, const void *trailer, void *ctrl, size_t ctrl_len);
+
+// Take the completions waiting on fd's error queue; returns how many sends
+// they covered. Call it whenever fd polls readable: completions wake poll()
+// and select() like data does.
+int pkt_tx_reap(struct pkt_tx *tx);
+
+// Wait, up to PKT_ZC_FLUSH_MS, until the kernel is done with every send
+void pkt_tx_flush(struct pkt_tx *tx);
+
+#endif
@@ -0,0 +1,101 @@
+// pmtu.c — DF probes, answered sizes and the search between them
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "packet.h"
+#include "pmtu.h"
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+int pmtu_set_df(int sockfd) {
+    int mode = IP_PMTUDISC_PROBE;
+    return setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode));
+}
+
+// Non-zero once a probe of size bytes is answered. A late answer to an
+// earlier try of the same size counts too.
+static int probe_size(int fd, const struct pmtu_probe *p, unsigned char *out, unsigned char *in, int size,
+                      uint32_t *id) {
+    uint32_t first = *id + 1;
+    for (int t = 0; t < PMTU_TRIES; ++t) {
+        p->build(out, size, ++*id, p->ctx);
+        if (send(fd, out, size, 0) < 0 && errno == EMSGSIZE) return 0;
+        long long deadline = now_ms() + (p->wait_ms > 0 ? p->wait_ms : PMTU_WAIT_MS), left;
+        while ((left = deadline - now_ms()) > 0) {
+            struct pollfd pfd = { .fd = fd, .events = POLLIN };
+            if (poll(&pfd, 1, left) <= 0) continue;
+            ssize_t n = recv(fd, in, p->max, MSG_DONTWAIT);
+            for (uint32_t k = first; n > 0 && k <= *id; ++k)
+                if (p->match(in, n, k, p->ctx)) return 1;
+        }
+    }
+    return 0;
+}
+
+int pmtu_discover(const struct pmtu_probe *p) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (const struct sockaddr *)&p->peer, sizeof(p->peer)) < 0 || pmtu_set_df(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    unsigned char *out = malloc(p->max), *in = malloc(p->max);
+    if (!out || !in) {
+        free(out);
+        free(in);
+        close(fd);
+        return -1;
+    }
+    memset(out, 0, p->max);
+
+    // The route's MTU is the most any probe can carry, and usually the answer
+    int hi = p->max, mtu;
+    socklen_t len = sizeof(mtu);
+    if (getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &len) == 0 && mtu - PMTU_IP_UDP < hi) hi = mtu - PMTU_IP_UDP;
+    if (hi < p->min) hi = p->min;
+
+    uint32_t id = 0;
+    int good = -1;
+    if (probe_size(fd, p, out, in, hi, &id)) {
+        good = hi;
+    } else if (hi > p->min && probe_size(fd, p, out, in, p->min, &id)) {
+        // Something between min and hi is lost on the way: a smaller link or
+        // a black hole that drops oversized datagrams without telling us
+        int lo = good = p->min;
+        while (hi - lo > PMTU_STEP) {
+            int mid = lo + (hi - lo) / 2;
+            if (probe_size(fd, p, out, in, mid, &id)) lo = good = mid;
+            else hi = mid;
+        }
+    }
+    free(out);
+    free(in);
+    close(fd);
+    if (good < 0) errno = ETIMEDOUT;
+    return good;
+}
+
+void pmtu_pkt_build(unsigned char *buf, int len, uint32_t id, void *ctx) {
+    const char *fingerprint = ctx;
+    int flen = strlen(fingerprint);
+    int pad = len - PKT_HEADER - flen - TRAILER_SIZE;
+    pkt_put_header(buf, PKT_TYPE_PROBE, id, pad);
+    memcpy(buf + PKT_HEADER, fingerprint, flen);
+    memset(buf + PKT_HEADER + flen, 0, pad);
+    pkt_seal(buf, len - TRAILER_SIZE);
+}
+
+int pmtu_pkt_match(const unsigned char *buf, int len, uint32_t id, void *ctx) {
+    (void)ctx;
+    return len == PKT_PROBE_REPLY && pkt_valid(buf, len) && PKT_TYPE(buf[0]) == PKT_TYPE_PROBE && pkt_seq(buf) == id;
+}
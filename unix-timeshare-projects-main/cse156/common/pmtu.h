@@ -0,0 +1,48 @@
+// pmtu.h — packetization-layer path MTU discovery for the lab clients
+//
+// Probes are datagrams of exactly the size being tried, sent with DF set
+// (IP_PMTUDISC_PROBE) from a socket of their own, so nothing fragments them
+// and their replies never mix with the transfer's. A size works once the peer
+// answers a probe of it. The search starts at the MTU of the route and
+// bisects down to the largest size that is answered, so the usual case costs
+// a single round trip.
+
+#ifndef PMTU_H
+#define PMTU_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define PMTU_IP_UDP 28           // IPv4 and UDP headers around every datagram
+#define PMTU_STEP 8              // the search stops this close to the answer
+#define PMTU_TRIES 3             // an unanswered size is tried again before it counts as too big
+#define PMTU_WAIT_MS 250         // per try, when the caller knows no RTT
+
+// Write a probe of exactly len bytes numbered id into buf
+typedef void (*pmtu_build_fn)(unsigned char *buf, int len, uint32_t id, void *ctx);
+// Non-zero when the datagram buf[0..len) answers probe id
+typedef int (*pmtu_match_fn)(const unsigned char *buf, int len, uint32_t id, void *ctx);
+
+struct pmtu_probe {
+    struct sockaddr_in peer;
+    int min, max;                // datagram sizes the caller can use
+    int wait_ms;                 // per try; 0 for PMTU_WAIT_MS
+    pmtu_build_fn build;
+    pmtu_match_fn match;
+    void *ctx;
+};
+
+// Largest datagram in [min, max] the peer answers, or -1 with errno set when
+// not even min gets an answer
+int pmtu_discover(const struct pmtu_probe *p);
+
+// Send with DF and never fragment locally; a datagram over the interface MTU
+// then fails with EMSGSIZE instead of going out in pieces
+int pmtu_set_df(int sockfd);
+
+// Probes and replies in the lab3/lab4 packet format (packet.h); ctx is the
+// fingerprint string the probe carries after its header
+void pmtu_pkt_build(unsigned char *buf, int len, uint32_t id, void *ctx);
+int pmtu_pkt_match(const unsigned char *buf, int len, uint32_t id, void *ctx);
+
+#endif
@@ -0,0 +1,41 @@
+// ring.h — page-backed memory for send windows
+//
+// A window of tens of thousands of packets is megabytes, too much for a
+// thread's stack. Rings of HUGE_PAGE or more try explicit huge pages first
+// and otherwise ask for transparent ones, so a large window costs a handful
+// of TLB entries instead of one per 4 KiB.
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+#define HUGE_PAGE (2UL << 20)
+
+static inline size_t ring_size(size_t bytes) {
+    return bytes >= HUGE_PAGE ? (bytes + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1) : bytes;
+}
+
+// Zeroed memory for bytes, or NULL with errno set
+static inline void *ring_alloc(size_t bytes) {
+    size_t size = ring_size(bytes ? bytes : 1);
+    void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (size >= HUGE_PAGE) p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+        if (size >= HUGE_PAGE) madvise(p, size, MADV_HUGEPAGE);
+#endif
+    }
+    return p;
+}
+
+static inline void ring_free(void *p, size_t bytes) {
+    if (p) munmap(p, ring_size(bytes ? bytes : 1));
+}
+
+#endif
@@ -0,0 +1,187 @@
+// trace.c — per-thread binary event rings, their CSV decoding and transfer summaries
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "trace.h"
+
+struct trace_ring {
+    struct trace_event ev[TRACE_RING];
+    int n;
+    struct trace_ring *next;
+};
+
+int trace_fd = -1;
+
+static __thread struct trace_ring *ring;
+static struct trace_ring *rings;  // every thread's ring, flushed at exit
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t clock_ns(clockid_t clk) {
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void ring_flush(struct trace_ring *r) {
+    const char *p = (const char *)r->ev;
+    size_t left = r->n * sizeof(struct trace_event);
+    while (left > 0) {
+        ssize_t w = write(trace_fd, p, left);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            perror("trace write");
+            break;
+        }
+        p += w;
+        left -= w;
+    }
+    r->n = 0;
+}
+
+// Threads still running when exit() is called may lose or repeat their last
+// few events; everything joined before then is complete.
+static void trace_close(void) {
+    pthread_mutex_lock(&rings_lock);
+    for (struct trace_ring *r = rings; r; r = r->next) ring_flush(r);
+    pthread_mutex_unlock(&rings_lock);
+    close(trace_fd);
+    trace_fd = -1;
+}
+
+int trace_open(const char *path, int format, int port) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    struct trace_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TRACE_MAGIC, 4);
+    h.version = TRACE_VERSION;
+    h.format = format;
+    h.port = port;
+    h.clock_offset_ns = (int64_t)(clock_ns(CLOCK_REALTIME) - clock_ns(CLOCK_MONOTONIC));
+    if (write(fd, &h, sizeof(h)) != sizeof(h)) {
+        close(fd);
+        return -1;
+    }
+    trace_fd = fd;
+    atexit(trace_close);
+    return 0;
+}
+
+void trace_event(int type, uint64_t seq, uint64_t base, uint64_t nextsn, uint64_t wend, const struct sockaddr_in *peer) {
+    struct trace_ring *r = ring;
+    if (!r) {
+        if (!(r = calloc(1, sizeof(*r)))) return;
+        pthread_mutex_lock(&rings_lock);
+        r->next = rings;
+        rings = r;
+        pthread_mutex_unlock(&rings_lock);
+        ring = r;
+    }
+    struct trace_event *e = &r->ev[r->n];
+    e->ns = clock_ns(CLOCK_MONOTONIC);
+    e->seq = seq;
+    e->base = base;
+    e->nextsn = nextsn;
+    e->wend = wend;
+    e->addr = peer ? peer->sin_addr.s_addr : 0;
+    e->port = peer ? ntohs(peer->sin_port) : 0;
+    e->type = type;
+    e->reserved = 0;
+    if (++r->n == TRACE_RING) ring_flush(r);
+}
+
+static const char *event_names[] = {
+    [TRACE_DATA] = "DATA",
+    [TRACE_ACK] = "ACK",
+    [TRACE_RETRANSMIT] = "RETRANSMIT",
+    [TRACE_DROP_DATA] = "DROP DATA",
+    [TRACE_DROP_ACK] = "DROP ACK",
+    [TRACE_DROP_META] = "DROP META",
+    [TRACE_DROP_PARITY] = "DROP PARITY",
+    [TRACE_DROP_SIG] = "DROP SIG",
+    [TRACE_FEC] = "FEC",
+    [TRACE_DROP_PROBE] = "DROP PROBE",
+};
+
+int trace_format(char *buf, size_t len, const struct trace_header *h, const struct trace_event *e) {
+    const char *name = e->type < sizeof(event_names) / sizeof(event_names[0]) && event_names[e->type]
+                           ? event_names[e->type] : "UNKNOWN";
+    uint64_t real = e->ns + h->clock_offset_ns;
+    time_t sec = real / 1000000000ULL;
+    struct tm tm;
+    char ts[64];
+    gmtime_r(&sec, &tm);
+    strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+    int ms = real % 1000000000ULL / 1000000;
+    char ip[INET_ADDRSTRLEN];
+    struct in_addr a = { .s_addr = e->addr };
+    inet_ntop(AF_INET, &a, ip, sizeof(ip));
+
+    switch (h->format) {
+    case TRACE_LAB3_CLIENT:
+        return snprintf(buf, len, "%s.%03dZ, %s, %llu, %llu, %llu, %llu", ts, ms, name, (unsigned long long)e->seq,
+                        (unsigned long long)e->base, (unsigned long long)e->nextsn, (unsigned long long)e->wend);
+    case TRACE_LAB3_SERVER:
+        return snprintf(buf, len, "%s.%03dZ, %s, %llu", ts, ms, name, (unsigned long long)e->seq);
+    case TRACE_LAB4_CLIENT:
+        return snprintf(buf, len, "%s.%03dZ, %d, %s, %d, %s, %llu, %llu, %llu, %llu", ts, ms, e->port, ip, e->port, name,
+                        (unsigned long long)e->seq, (unsigned long long)e->base, (unsigned long long)e->nextsn,
+                        (unsigned long long)e->wend);
+    case TRACE_LAB4_SERVER:
+        return snprintf(buf, len, "%s.%03dZ, %d, %s, %d, %s, %llu", ts, ms, h->port, ip, e->port, name,
+                        (unsigned long long)e->seq);
+    }
+    return -1;
+}
+
+// Four buckets per octave of microseconds: the octave, then the two bits
+// below its leading one
+static int rtt_bucket(uint64_t rtt_ns) {
+    uint64_t us = rtt_ns / 1000 ? rtt_ns / 1000 : 1;
+    int o = 63 - __builtin_clzll(us);
+    int sub = o >= 2 ? (us >> (o - 2)) & 3 : (us << (2 - o)) & 3;
+    int b = o * 4 + sub;
+    return b < TRACE_RTT_BUCKETS ? b : TRACE_RTT_BUCKETS - 1;
+}
+
+static double bucket_ms(int b) {
+    return (double)(((4ULL + b % 4) << (b / 4)) >> 2) / 1000;
+}
+
+void stats_rtt(struct xfer_stats *st, uint64_t rtt_ns) {
+    st->rtt[rtt_bucket(rtt_ns)]++;
+    st->rtt_n++;
+}
+
+void stats_ack(struct xfer_stats *st, int inflight) {
+    st->occupancy += inflight;
+    st->acks++;
+    if (inflight > st->max_inflight) st->max_inflight = inflight;
+}
+
+// Upper edge of the bucket holding the p-th sample
+static double rtt_percentile(const struct xfer_stats *st, double p) {
+    long want = (long)(p * st->rtt_n), seen = 0;
+    for (int b = 0; b < TRACE_RTT_BUCKETS; ++b) {
+        seen += st->rtt[b];
+        if (seen > want) return bucket_ms(b + 1);
+    }
+    return 0;
+}
+
+void stats_print(FILE *out, const char *who, const struct xfer_stats *st, uint64_t now_ns, int winsz) {
+    double secs = now_ns > st->start_ns ? (now_ns - st->start_ns) / 1e9 : 0;
+    double mean = st->acks ? st->occupancy / st->acks : 0;
+    fprintf(out, "%s: goodput %.1f Mbit/s, %ld of %ld packets resent (%.2f%%), rtt p50 %.3f p90 %.3f p99 %.3f ms, "
+            "%.1f of %d packets in flight on average, %d at most\n",
+            who, secs > 0 ? st->bytes * 8 / secs / 1e6 : 0.0, st->resends, st->packets,
+            st->packets ? 100.0 * st->resends / st->packets : 0.0, rtt_percentile(st, 0.5),
+            rtt_percentile(st, 0.9), rtt_percentile(st, 0.99), mean, winsz, st->max_inflight);
+}
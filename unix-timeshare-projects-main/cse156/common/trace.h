@@ -0,0 +1,91 @@
+// trace.h — binary packet tracing and end-of-transfer statistics
+//
+// With tracing on, each DATA, ACK, RETRANSMIT, DROP and FEC event is a fixed
+// 48-byte record in a per-thread ring instead of a printf'd CSV line. A full
+// ring goes to the trace file with one write(), and whatever is left is
+// flushed at exit. ../tools/bin/tracedump turns a trace back into the CSV the
+// program would have printed.
+//
+// The file is a trace_header followed by trace_event records in host byte
+// order, grouped by thread; the decoder sorts them by time.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <netinet/in.h>
+
+#define TRACE_MAGIC "FTRC"
+#define TRACE_VERSION 2
+#define TRACE_RING 2048          // events per thread between writes
+
+// Which program wrote the trace, and so which CSV layout it decodes to
+#define TRACE_LAB3_CLIENT 1
+#define TRACE_LAB3_SERVER 2
+#define TRACE_LAB4_CLIENT 3
+#define TRACE_LAB4_SERVER 4
+
+#define TRACE_DATA 1
+#define TRACE_ACK 2
+#define TRACE_RETRANSMIT 3
+#define TRACE_DROP_DATA 4
+#define TRACE_DROP_ACK 5
+#define TRACE_DROP_META 6
+#define TRACE_DROP_PARITY 7
+#define TRACE_DROP_SIG 8
+#define TRACE_FEC 9
+#define TRACE_DROP_PROBE 10
+
+struct trace_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t format;
+    uint16_t port;               // the server's own port, for TRACE_LAB4_SERVER
+    uint16_t reserved[3];
+    int64_t clock_offset_ns;     // CLOCK_REALTIME minus CLOCK_MONOTONIC at open
+};
+
+struct trace_event {
+    uint64_t ns;                 // CLOCK_MONOTONIC
+    uint64_t seq, base, nextsn, wend;
+    uint32_t addr;               // peer, network order
+    uint16_t port;               // peer, host order
+    uint8_t type;
+    uint8_t reserved;
+};
+
+extern int trace_fd;
+
+// Start tracing to path, truncating it. Returns -1 with errno set.
+int trace_open(const char *path, int format, int port);
+
+// Record one event on the calling thread's ring; peer may be NULL
+void trace_event(int type, uint64_t seq, uint64_t base, uint64_t nextsn, uint64_t wend, const struct sockaddr_in *peer);
+
+// The CSV line event e would have been printed as, without the newline
+int trace_format(char *buf, size_t len, const struct trace_header *h, const struct trace_event *e);
+
+#define TRACE_RTT_BUCKETS 96     // four per octave from 1 us, up to about 16 s
+
+// What a client saw over one transfer, printed when it ends
+struct xfer_stats {
+    uint64_t start_ns;
+    uint64_t bytes;              // payload bytes acknowledged
+    long packets, resends;
+    uint32_t rtt[TRACE_RTT_BUCKETS];
+    long rtt_n;
+    double occupancy;            // sum of packets in flight at each ACK
+    long acks;
+    int max_inflight;
+};
+
+void stats_rtt(struct xfer_stats *st, uint64_t rtt_ns);
+void stats_ack(struct xfer_stats *st, int inflight);
+
+// One summary line: goodput, resend ratio, RTT percentiles and how full the
+// window ran, prefixed with who the transfer went to
+void stats_print(FILE *out, const char *who, const struct xfer_stats *st, uint64_t now_ns, int winsz);
+
+#endif
@@ -0,0 +1,136 @@
+// wheel.c — two-level timing wheel; every list is circular around its head
+
+#include <stddef.h>
+
+#include "wheel.h"
+
+#define L0_MASK (WHEEL_L0 - 1)
+
+static void list_init(struct wheel_timer *head) {
+    head->prev = head->next = head;
+}
+
+static int list_empty(const struct wheel_timer *head) {
+    return head->next == head;
+}
+
+static void list_append(struct wheel_timer *head, struct wheel_timer *t) {
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void unlink_timer(struct wheel_timer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+}
+
+// Slot for t relative to the wheel's current tick
+static void place(struct wheel *w, struct wheel_timer *t) {
+    uint64_t due = t->due_ms < w->tick ? w->tick : t->due_ms;
+    uint64_t delta = due - w->tick;
+    if (delta < WHEEL_L0) list_append(&w->l0[due & L0_MASK], t);
+    else if (delta < (uint64_t)(WHEEL_L1 - 1) << WHEEL_L0_BITS) list_append(&w->l1[(due >> WHEEL_L0_BITS) % WHEEL_L1], t);
+    else list_append(&w->l1[((w->tick >> WHEEL_L0_BITS) + WHEEL_L1 - 1) % WHEEL_L1], t);
+}
+
+void wheel_init(struct wheel *w, uint64_t now_ms) {
+    w->tick = now_ms;
+    w->armed = 0;
+    for (int i = 0; i < WHEEL_L0; ++i) list_init(&w->l0[i]);
+    for (int i = 0; i < WHEEL_L1; ++i) list_init(&w->l1[i]);
+    list_init(&w->expired);
+}
+
+void wheel_add(struct wheel *w, struct wheel_timer *t, uint64_t due_ms, uint64_t key) {
+    wheel_cancel(w, t);
+    t->due_ms = due_ms;
+    t->key = key;
+    if (due_ms < w->tick) list_append(&w->expired, t);
+    else place(w, t);
+    w->armed++;
+}
+
+void wheel_add_after(struct wheel *w, struct wheel_timer *t, struct wheel_timer *after, uint64_t key) {
+    wheel_cancel(w, t);
+    t->due_ms = after->due_ms;
+    t->key = key;
+    // Whichever list after is on, expired or a slot, t moves along with it
+    t->prev = after;
+    t->next = after->next;
+    after->next->prev = t;
+    after->next = t;
+    w->armed++;
+}
+
+void wheel_cancel(struct wheel *w, struct wheel_timer *t) {
+    if (!t->next) return;
+    unlink_timer(t);
+    w->armed--;
+}
+
+// Move what is due at or before now_ms onto the expired list
+static void advance(struct wheel *w, uint64_t now_ms) {
+    // Nothing armed: there is no slot to visit on the way
+    if (w->armed == 0) {
+        if (now_ms >= w->tick) w->tick = now_ms + 1;
+        return;
+    }
+    while (w->tick <= now_ms) {
+        // A new quarter second: spread its level-1 slot over level 0. Nothing
+        // placed from here lands back in the slot being emptied.
+        if ((w->tick & L0_MASK) == 0) {
+            struct wheel_timer *head = &w->l1[(w->tick >> WHEEL_L0_BITS) % WHEEL_L1];
+            while (!list_empty(head)) {
+                struct wheel_timer *t = head->next;
+                unlink_timer(t);
+                place(w, t);
+            }
+        }
+        struct wheel_timer *slot = &w->l0[w->tick & L0_MASK];
+        while (!list_empty(slot)) {
+            struct wheel_timer *t = slot->next;
+            unlink_timer(t);
+            list_append(&w->expired, t);
+        }
+        w->tick++;
+    }
+}
+
+struct wheel_timer *wheel_pop(struct wheel *w, uint64_t now_ms) {
+    if (list_empty(&w->expired)) advance(w, now_ms);
+    if (list_empty(&w->expired)) return NULL;
+    struct wheel_timer *t = w->expired.next;
+    unlink_timer(t);
+    w->armed--;
+    return t;
+}
+
+long wheel_next(const struct wheel *w, uint64_t now_ms) {
+    if (w->armed == 0) return -1;
+    if (!list_empty(&w->expired)) return 0;
+    // Level 0 holds the next 256 ms, but the next quarter second's level-1
+    // slot may start before its last timer: the earlier of the two
+    uint64_t next = UINT64_MAX;
+    for (uint64_t i = 0; i < WHEEL_L0; ++i) {
+        if (!list_empty(&w->l0[(w->tick + i) & L0_MASK])) {
+            next = w->tick + i;
+            break;
+        }
+    }
+    // From the current quarter second on, whose slot still holds its timers
+    // when the wheel stopped right at its start
+    for (uint64_t j = 0; j < WHEEL_L1; ++j) {
+        uint64_t block = (w->tick >> WHEEL_L0_BITS) + j, t = block << WHEEL_L0_BITS;
+        if (t < w->tick) t = w->tick;
+        if (t >= next) break;
+        if (!list_empty(&w->l1[block % WHEEL_L1])) {
+            next = t;
+            break;
+        }
+    }
+    if (next == UINT64_MAX) return -1;
+    return next > now_ms ? (long)(next - now_ms) : 0;
+}
@@ -0,0 +1,56 @@
+// wheel.h — hierarchical timing wheel of millisecond timers
+//
+// Level 0 has 256 one-millisecond slots for the next quarter second; level 1
+// has 64 slots of 256 ms each, about 16 s in all. A level-1 slot is spread
+// over level 0 when its quarter second begins, and deadlines further out wait
+// in the farthest slot and are placed again when it comes round. Arming and
+// cancelling a timer are O(1), and so is each millisecond of expiry.
+
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdint.h>
+
+#define WHEEL_L0_BITS 8
+#define WHEEL_L0 (1 << WHEEL_L0_BITS)
+#define WHEEL_L1 64
+
+// Embedded in whatever it times; next is NULL while it is not armed, so a
+// zeroed timer is ready to use
+struct wheel_timer {
+    struct wheel_timer *prev, *next;
+    uint64_t due_ms;
+    uint64_t key;                // the owner's, e.g. the seq of the packet timed
+};
+
+struct wheel {
+    uint64_t tick;               // the next millisecond to expire
+    long armed;
+    struct wheel_timer l0[WHEEL_L0];
+    struct wheel_timer l1[WHEEL_L1];
+    struct wheel_timer expired;  // due, not yet handed out by wheel_pop()
+};
+
+void wheel_init(struct wheel *w, uint64_t now_ms);
+
+// Arm t for due_ms, moving it if it is armed already; a deadline in the past
+// expires on the next wheel_pop()
+void wheel_add(struct wheel *w, struct wheel_timer *t, uint64_t due_ms, uint64_t key);
+
+// Arm t to expire with `after`, which must be armed, and be handed out right
+// after it
+void wheel_add_after(struct wheel *w, struct wheel_timer *t, struct wheel_timer *after, uint64_t key);
+
+// Disarm t; nothing happens if it is not armed
+void wheel_cancel(struct wheel *w, struct wheel_timer *t);
+
+// The next timer due at or before now_ms, earliest millisecond first, disarmed;
+// NULL when none is left. The caller may re-arm or cancel any timer between calls.
+struct wheel_timer *wheel_pop(struct wheel *w, uint64_t now_ms);
+
+// Milliseconds from now_ms until wheel_pop() next has work, 0 if it has now
+// and -1 when nothing is armed. A deadline in level 1 counts from when its
+// slot is spread, so the wait may end early but never late.
+long wheel_next(const struct wheel *w, uint64_t now_ms);
+
+#endif
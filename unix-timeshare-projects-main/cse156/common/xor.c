@@ -0,0 +1,101 @@
+// xor.c — XOR kernels for FEC parity with runtime dispatch
+
+#include <stdint.h>
+#include <string.h>
+
+#include "xor.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+static void (*impl)(unsigned char *, const unsigned char *, size_t);
+static const char *impl_name = "scalar";
+
+static void xor_words(unsigned char *d, const unsigned char *s, size_t len) {
+    while (len >= 8) {
+        uint64_t a, b;
+        memcpy(&a, d, 8);
+        memcpy(&b, s, 8);
+        a ^= b;
+        memcpy(d, &a, 8);
+        d += 8;
+        s += 8;
+        len -= 8;
+    }
+    while (len--) *d++ ^= *s++;
+}
+
+#ifdef HAVE_X86
+__attribute__((target("avx2")))
+static void xor_avx2(unsigned char *d, const unsigned char *s, size_t len) {
+    while (len >= 64) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)d);
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(d + 32));
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)s);
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(s + 32));
+        _mm256_storeu_si256((__m256i *)d, _mm256_xor_si256(a0, b0));
+        _mm256_storeu_si256((__m256i *)(d + 32), _mm256_xor_si256(a1, b1));
+        d += 64;
+        s += 64;
+        len -= 64;
+    }
+    xor_words(d, s, len);
+}
+
+__attribute__((target("sse2")))
+static void xor_sse2(unsigned char *d, const unsigned char *s, size_t len) {
+    while (len >= 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)d);
+        __m128i b = _mm_loadu_si128((const __m128i *)s);
+        _mm_storeu_si128((__m128i *)d, _mm_xor_si128(a, b));
+        d += 16;
+        s += 16;
+        len -= 16;
+    }
+    xor_words(d, s, len);
+}
+#endif
+
+#ifdef HAVE_NEON
+static void xor_neon(unsigned char *d, const unsigned char *s, size_t len) {
+    while (len >= 16) {
+        vst1q_u8(d, veorq_u8(vld1q_u8(d), vld1q_u8(s)));
+        d += 16;
+        s += 16;
+        len -= 16;
+    }
+    xor_words(d, s, len);
+}
+#endif
+
+__attribute__((constructor))
+static void xor_init(void) {
+    impl = xor_words;
+#ifdef HAVE_X86
+    if (__builtin_cpu_supports("sse2")) {
+        impl = xor_sse2;
+        impl_name = "sse2";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        impl = xor_avx2;
+        impl_name = "avx2";
+    }
+#endif
+#ifdef HAVE_NEON
+    impl = xor_neon;
+    impl_name = "neon";
+#endif
+}
+
+void xor_into(void *dst, const void *src, size_t len) {
+    impl(dst, src, len);
+}
+
+const char *xor_impl(void) {
+    return impl_name;
+}
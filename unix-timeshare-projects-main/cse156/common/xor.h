@@ -0,0 +1,17 @@
+// xor.h — bulk XOR used to build and apply FEC parity packets
+//
+// xor_into() dispatches to AVX2, SSE2 or NEON at startup and falls back to
+// 64-bit words elsewhere.
+
+#ifndef XOR_H
+#define XOR_H
+
+#include <stddef.h>
+
+// dst[i] ^= src[i] for i in [0, len)
+void xor_into(void *dst, const void *src, size_t len);
+
+// Name of the implementation xor_into() dispatches to
+const char *xor_impl(void);
+
+#endif
@@ -0,0 +1,129 @@
+// xxh64.c — XXH64 as specified by xxHash (little-endian reads on any host)
+
+#include <string.h>
+#include <endian.h>
+
+#include "xxh64.h"
+
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return le64toh(v);
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return le32toh(v);
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * P2;
+    acc = rotl(acc, 31);
+    return acc * P1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t val) {
+    acc ^= round64(0, val);
+    return acc * P1 + P4;
+}
+
+// Tail of at most 31 bytes and the final avalanche, shared by both forms
+static uint64_t finish(uint64_t h, const unsigned char *p, const unsigned char *end) {
+    while (p + 8 <= end) {
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * P1 + P4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * P1;
+        h = rotl(h, 23) * P2 + P3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= *p++ * P5;
+        h = rotl(h, 11) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t converge(const uint64_t v[4]) {
+    uint64_t h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+    for (int i = 0; i < 4; ++i) h = merge64(h, v[i]);
+    return h;
+}
+
+// Whole 32-byte stripes from p into v; returns where they stopped
+static const unsigned char *stripes(uint64_t v[4], const unsigned char *p, const unsigned char *end) {
+    while (p + 32 <= end) {
+        v[0] = round64(v[0], read64(p));
+        v[1] = round64(v[1], read64(p + 8));
+        v[2] = round64(v[2], read64(p + 16));
+        v[3] = round64(v[3], read64(p + 24));
+        p += 32;
+    }
+    return p;
+}
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v[4] = { seed + P1 + P2, seed + P2, seed, seed - P1 };
+        p = stripes(v, p, end);
+        h = converge(v);
+    } else {
+        h = seed + P5;
+    }
+    return finish(h + len, p, end);
+}
+
+void xxh64_reset(struct xxh64_state *st, uint64_t seed) {
+    memset(st, 0, sizeof(*st));
+    st->seed = seed;
+    st->v[0] = seed + P1 + P2;
+    st->v[1] = seed + P2;
+    st->v[2] = seed;
+    st->v[3] = seed - P1;
+}
+
+void xxh64_update(struct xxh64_state *st, const void *data, size_t len) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+    st->total += len;
+    if (st->buf_len) {
+        size_t n = 32 - st->buf_len < len ? 32 - st->buf_len : len;
+        memcpy(st->buf + st->buf_len, p, n);
+        st->buf_len += n;
+        p += n;
+        if (st->buf_len < 32) return;
+        stripes(st->v, st->buf, st->buf + 32);
+        st->buf_len = 0;
+    }
+    p = stripes(st->v, p, end);
+    memcpy(st->buf, p, end - p);
+    st->buf_len = end - p;
+}
+
+uint64_t xxh64_digest(const struct xxh64_state *st) {
+    uint64_t h = st->total >= 32 ? converge(st->v) : st->seed + P5;
+    return finish(h + st->total, st->buf, st->buf + st->buf_len);
+}
@@ -0,0 +1,28 @@
+// xxh64.h — XXH64, the 64-bit xxHash, used as the strong block hash and for
+// the end-to-end file hash (filehash.h)
+//
+// Non-cryptographic but far stronger than the rolling checksum it backs up,
+// and several GB/s per core.
+
+#ifndef XXH64_H
+#define XXH64_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+// The same hash over data that arrives in pieces of any size
+struct xxh64_state {
+    uint64_t v[4];
+    uint64_t total;
+    uint64_t seed;
+    unsigned char buf[32];   // bytes of a stripe not yet complete
+    size_t buf_len;
+};
+
+void xxh64_reset(struct xxh64_state *st, uint64_t seed);
+void xxh64_update(struct xxh64_state *st, const void *data, size_t len);
+uint64_t xxh64_digest(const struct xxh64_state *st);
+
+#endif
@@ -10,10 +10,15 @@
 #include <sys/stat.h>
 #include <libgen.h>
 #include <time.h>
+#include <poll.h>
+
+#include "pmtu.h"
 
 #define HEADER_SIZE 10
 #define TIMEOUT_SEC 60
 #define CRUZID "faslam:"
+#define MAX_MSS 32768   // the server's receive buffer
+#define TYPE_PROBE 0x3
 
 void print_error(const char *msg) {
     perror(msg);
@@ -32,15 +37,38 @@ unsigned char checksum(const char *data, int len) {
     return (unsigned char)(sum & 0xFF);
 }
 
+// A probe is a packet the server echoes like any other: type, seq, a zero
+// length, the fingerprint, padding and the checksum
+void probe_build(unsigned char *buf, int len, uint32_t id, void *ctx) {
+    (void)ctx;
+    int net_seq = htonl(id);
+    int net_len = htonl(0);
+    memset(buf, 0, len);
+    buf[0] = TYPE_PROBE;
+    memcpy(buf + 1, &net_seq, 4);
+    memcpy(buf + 5, &net_len, 4);
+    memcpy(buf + 9, CRUZID, strlen(CRUZID));
+    buf[len - 1] = checksum((const char *)buf, len - 1);
+}
+
+int probe_match(const unsigned char *buf, int len, uint32_t id, void *ctx) {
+    (void)ctx;
+    int seq;
+    if (len < HEADER_SIZE || buf[0] != TYPE_PROBE) return 0;
+    memcpy(&seq, buf + 1, 4);
+    return (uint32_t)ntohl(seq) == id && (unsigned char)buf[len - 1] == checksum((const char *)buf, len - 1);
+}
+
 int main(int argc, char *argv[]) {
     if (argc != 6) {
-        fprintf(stderr, "To use: %s <server_ip> <server_port> <mss> <infile> <outfile>\n", argv[0]);
+        fprintf(stderr, "To use: %s <server_ip> <server_port> <mss|auto> <infile> <outfile>\n", argv[0]);
         return 1;
     }
 
     const char *server_ip = argv[1];
     int server_port = atoi(argv[2]);
-    int mss = atoi(argv[3]);
+    int mss_auto = strcmp(argv[3], "auto") == 0;
+    int mss = mss_auto ? MAX_MSS : atoi(argv[3]);
     const char *infile = argv[4];
     const char *outfile = argv[5];
 
@@ -59,6 +87,18 @@ int main(int argc, char *argv[]) {
     if (inet_pton(AF_INET, server_ip, &servaddr.sin_addr) <= 0)
         print_error("inet_pton error");
 
+    // mss auto: the largest packet the server echoes back unfragmented
+    if (mss_auto) {
+        struct pmtu_probe p = { .peer = servaddr, .min = HEADER_SIZE + strlen(CRUZID) + 1, .max = MAX_MSS,
+                                .build = probe_build, .match = probe_match };
+        if (pmtu_set_df(sockfd) < 0) print_error("setsockopt");
+        if ((mss = pmtu_discover(&p)) < 0) {
+            fprintf(stderr, "Cannot detect server\n");
+            return 1;
+        }
+        fprintf(stderr, "MSS %d\n", mss);
+    }
+
     FILE *fin = fopen(infile, "rb");
     if (!fin) print_error("fopen infile");
 
@@ -103,18 +143,22 @@ int main(int argc, char *argv[]) {
         socklen_t fromlen = sizeof(from);
         ssize_t recv_len;
 
+        // Block until the echo arrives instead of sleeping between polls, so
+        // the round trip is not rounded up to a sleep interval
         while (1) {
             recv_len = recvfrom(sockfd, recvbuf, mss, MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen);
             if (recv_len > 0) break;
 
             current_time = time(NULL);
-            if (difftime(current_time, start_time) >= TIMEOUT_SEC) {
+            double left = TIMEOUT_SEC - difftime(current_time, start_time);
+            if (left <= 0) {
                 fprintf(stderr, "Cannot detect server\n");
                 fclose(fin); fclose(fout); free(payload); free(packet); free(recvbuf);
                 return 1;
             }
 
-            usleep(100000); 
+            struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+            poll(&pfd, 1, (int)(left * 1000));
         }
 
         int recv_seq;
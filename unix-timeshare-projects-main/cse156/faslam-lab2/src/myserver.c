@@ -1,15 +1,33 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/time.h>
 
 #define MAX_PACKET_SIZE 32768
+#define BATCH 64             // datagrams per recvmmsg / sendmmsg
+#define MAX_THREADS 64
+#define POLL_MS 200          // how often a blocked worker looks at the stop flag
+
+// One reflector thread: its own SO_REUSEPORT socket, so the kernel spreads
+// clients across threads by their address and port
+struct worker {
+    pthread_t tid;
+    int sockfd;
+    long packets, bytes, bad;
+};
+
+static volatile sig_atomic_t stop;
+static int verbose;
 
 unsigned char checksum(const char *data, int len) {
     unsigned long sum = 0;
@@ -28,72 +46,122 @@ void print_error(const char *msg) {
     exit(1);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-        return 1;
-    }
-
-    int port = atoi(argv[1]);
+void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
 
+int open_socket(int port) {
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) print_error("socket");
+    int one = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) print_error("setsockopt");
+    struct timeval tv = { 0, POLL_MS * 1000 };
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
-    struct sockaddr_in servaddr, cliaddr;
+    struct sockaddr_in servaddr;
     memset(&servaddr, 0, sizeof(servaddr));
-    memset(&cliaddr, 0, sizeof(cliaddr));
-
     servaddr.sin_family = AF_INET;
     servaddr.sin_addr.s_addr = INADDR_ANY;
     servaddr.sin_port = htons(port);
-
     if (bind(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
         print_error("bind error");
+    return sockfd;
+}
 
-    char buffer[MAX_PACKET_SIZE] = {0};
-
-    printf("Server listening on port %d...\n", port);
-
-    while (1) {
-        socklen_t len = sizeof(cliaddr);
-        ssize_t recv_len = recvfrom(sockfd, buffer, MAX_PACKET_SIZE, 0,
-                                    (struct sockaddr *)&cliaddr, &len);
-
-        if (recv_len <= 0) {
-            fprintf(stderr, "recvfrom error\n");
-            continue;
+// Take up to BATCH datagrams at once and send every one that checks out
+// straight back to where it came from, in one sendmmsg
+void *reflect(void *arg) {
+    struct worker *w = arg;
+    char *bufs = malloc((size_t)BATCH * MAX_PACKET_SIZE);
+    if (!bufs) print_error("malloc");
+    struct mmsghdr in[BATCH], out[BATCH];
+    struct iovec iov[BATCH];
+    struct sockaddr_in addrs[BATCH];
+
+    while (!stop) {
+        for (int i = 0; i < BATCH; ++i) {
+            iov[i].iov_base = bufs + (size_t)i * MAX_PACKET_SIZE;
+            iov[i].iov_len = MAX_PACKET_SIZE;
+            memset(&in[i].msg_hdr, 0, sizeof(in[i].msg_hdr));
+            in[i].msg_hdr.msg_name = &addrs[i];
+            in[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            in[i].msg_hdr.msg_iov = &iov[i];
+            in[i].msg_hdr.msg_iovlen = 1;
         }
-
-        //printf("RCV %zd bytes from %s:%d\n", recv_len, inet_ntoa(cliaddr.sin_addr), ntohs(cliaddr.sin_port));
-
-        if (recv_len < 10) {
-            fprintf(stderr, "Packet too small\n");
-            continue;
+        int n = recvmmsg(w->sockfd, in, BATCH, MSG_WAITFORONE, NULL);
+        if (n <= 0) continue;
+
+        int nout = 0;
+        for (int i = 0; i < n; ++i) {
+            char *buf = iov[i].iov_base;
+            int len = in[i].msg_len;
+            if (len < 10 || checksum(buf, len - 1) != (unsigned char)buf[len - 1]) {
+                w->bad++;
+                if (verbose) fprintf(stderr, "Bad packet of %d bytes from %s:%d\n", len,
+                                     inet_ntoa(addrs[i].sin_addr), ntohs(addrs[i].sin_port));
+                continue;
+            }
+            iov[i].iov_len = len;
+            out[nout].msg_hdr = in[i].msg_hdr;
+            out[nout].msg_hdr.msg_iov = &iov[i];
+            nout++;
+            w->packets++;
+            w->bytes += len;
+            if (verbose) printf("Echoed %d bytes to %s:%d\n", len, inet_ntoa(addrs[i].sin_addr),
+                                ntohs(addrs[i].sin_port));
+        }
+        for (int sent = 0; sent < nout;) {
+            int r = sendmmsg(w->sockfd, out + sent, nout - sent, 0);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                perror("sendmmsg");
+                break;
+            }
+            sent += r;
         }
+    }
+    free(bufs);
+    return NULL;
+}
 
-        unsigned char received_chk = buffer[recv_len - 1];
-        unsigned char computed_chk = checksum(buffer, recv_len - 1);
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-t threads] [-v] <port>\n", prog);
+    exit(1);
+}
 
-        printf("chcksm %u vs rcvd %u\n", computed_chk, received_chk);
+int main(int argc, char *argv[]) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = cores < 1 ? 1 : cores > MAX_THREADS ? MAX_THREADS : cores;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:v")) != -1) {
+        if (opt == 't') nthreads = atoi(optarg);
+        else if (opt == 'v') verbose = 1;
+        else usage(argv[0]);
+    }
+    if (argc - optind != 1 || nthreads < 1 || nthreads > MAX_THREADS) usage(argv[0]);
+    int port = atoi(argv[optind]);
 
-        if (computed_chk != received_chk) {
-            fprintf(stderr, "Checksum error: expected %u, got %u\n",
-                    computed_chk, received_chk);
-            continue;
-        }
+    struct sigaction sa = { .sa_handler = on_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
 
-        ssize_t sent_len = sendto(sockfd, buffer, recv_len, 0,
-                                  (struct sockaddr *)&cliaddr, len);
-        if (sent_len != recv_len) {
-            fprintf(stderr, "Failed to send full packet (%zd/%zd bytes)\n",
-                    sent_len, recv_len);
-        } else {
-            printf("Echoed %zd bytes to %s:%d\n",
-                   sent_len, inet_ntoa(cliaddr.sin_addr), ntohs(cliaddr.sin_port));
-        }
+    static struct worker workers[MAX_THREADS];
+    for (int i = 0; i < nthreads; ++i) {
+        workers[i].sockfd = open_socket(port);
+        if (pthread_create(&workers[i].tid, NULL, reflect, &workers[i]) != 0) print_error("pthread_create");
     }
-
-    close(sockfd);
+    printf("Server listening on port %d with %d threads...\n", port, nthreads);
+    fflush(stdout);
+
+    long packets = 0, bytes = 0, bad = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_join(workers[i].tid, NULL);
+        close(workers[i].sockfd);
+        packets += workers[i].packets;
+        bytes += workers[i].bytes;
+        bad += workers[i].bad;
+    }
+    fprintf(stderr, "Echoed %ld packets (%ld bytes), dropped %ld with a bad checksum\n", packets, bytes, bad);
     return 0;
 }
-
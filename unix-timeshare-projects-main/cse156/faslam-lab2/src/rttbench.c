@@ -0,0 +1,311 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#define HEADER_SIZE 10
+#define CRUZID "faslam:"
+#define MAX_MSS 32768        // the server's receive buffer
+#define TYPE_PING 0x4
+#define RING (1 << 17)       // sends remembered while their echo is outstanding
+#define GRACE_NS 1000000000LL // wait this long after the last send for echoes
+#define HIST_SUB_BITS 7      // 128 sub-buckets per power of two, under 1% error
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+// What is known about one send while its echo is outstanding
+struct slot {
+    uint32_t seq;
+    int used, echoed;
+    long long sched;         // when the send was due, CLOCK_MONOTONIC
+    long long kern_tx;       // kernel stamps, CLOCK_REALTIME; 0 until known
+    long long kern_rx;
+};
+
+// HDR histogram of nanosecond values: exact below 2^7, then 128 buckets per
+// power of two
+struct hist {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t n;
+    long long min, max;
+};
+
+static struct hist app_hist, kern_hist;
+
+void print_error(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+unsigned char checksum(const char *data, int len) {
+    unsigned long sum = 0;
+    for (int i = 0; i < len; ++i) {
+        sum += (unsigned char)data[i];
+        if (sum & 0xFFFF0000) {
+            sum &= 0xFFFF;
+            sum++;
+        }
+    }
+    return (unsigned char)(sum & 0xFF);
+}
+
+long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int hist_index(uint64_t v) {
+    if (v < 2 * HIST_SUB) return (int)v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return shift * HIST_SUB + (int)(v >> shift);
+}
+
+uint64_t hist_value(int idx) {
+    if (idx < 2 * HIST_SUB) return idx;
+    int shift = idx / HIST_SUB - 1;
+    return (uint64_t)(idx - shift * HIST_SUB) << shift;
+}
+
+void hist_add(struct hist *h, long long v) {
+    if (v < 0) v = 0;
+    h->counts[hist_index(v)]++;
+    if (h->n == 0 || v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+    h->n++;
+}
+
+long long hist_percentile(const struct hist *h, double p) {
+    uint64_t want = (uint64_t)(p / 100.0 * h->n + 0.999999), seen = 0;
+    if (want < 1) want = 1;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->counts[i];
+        if (seen >= want) {
+            long long v = hist_value(i);
+            return v < h->min ? h->min : v > h->max ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+void hist_print(const char *name, const struct hist *h) {
+    if (h->n == 0) {
+        printf("%s rtt: no samples\n", name);
+        return;
+    }
+    printf("%s rtt us: min %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f p99.99 %.1f max %.1f (%lu samples)\n", name,
+           h->min / 1e3, hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3, hist_percentile(h, 99) / 1e3,
+           hist_percentile(h, 99.9) / 1e3, hist_percentile(h, 99.99) / 1e3, h->max / 1e3, (unsigned long)h->n);
+}
+
+long long ts_ns(const struct timespec *ts) {
+    return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+// A send's kernel round trip is known once both of its stamps are in, in
+// whichever order they arrive
+void kern_sample(struct slot *s) {
+    if (s->kern_tx && s->kern_rx) hist_add(&kern_hist, s->kern_rx - s->kern_tx);
+}
+
+// Take every echo waiting on the socket; returns how many were good
+long drain_echoes(int sockfd, struct slot *ring, char *buf, int size, long *dups) {
+    long got = 0;
+    char ctrl[256];
+    for (;;) {
+        struct iovec iov = { buf, size };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctrl, .msg_controllen = sizeof(ctrl) };
+        ssize_t n = recvmsg(sockfd, &msg, MSG_DONTWAIT);
+        if (n < 0) return got;
+        long long arrived = now_ns();
+        if (n != size || buf[0] != TYPE_PING || checksum(buf, n - 1) != (unsigned char)buf[n - 1]) continue;
+        uint32_t seq;
+        memcpy(&seq, buf + 1, 4);
+        seq = ntohl(seq);
+        struct slot *s = &ring[seq & (RING - 1)];
+        if (!s->used || s->seq != seq) continue;
+        if (s->echoed) {
+            (*dups)++;
+            continue;
+        }
+        s->echoed = 1;
+        got++;
+        hist_add(&app_hist, arrived - s->sched);
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPING) {
+                struct scm_timestamping tss;
+                memcpy(&tss, CMSG_DATA(c), sizeof(tss));
+                s->kern_rx = ts_ns(&tss.ts[0]);
+                kern_sample(s);
+            }
+        }
+    }
+}
+
+// Take the transmit stamps the kernel queued on the error queue; with
+// SOF_TIMESTAMPING_OPT_ID each carries the number of the send it stamps
+void drain_tx_stamps(int sockfd, struct slot *ring) {
+    char ctrl[512];
+    for (;;) {
+        struct msghdr msg = { .msg_control = ctrl, .msg_controllen = sizeof(ctrl) };
+        if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return;
+        long long stamp = 0;
+        int have_id = 0;
+        uint32_t id = 0;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPING) {
+                struct scm_timestamping tss;
+                memcpy(&tss, CMSG_DATA(c), sizeof(tss));
+                stamp = ts_ns(&tss.ts[0]);
+            } else if (c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR) {
+                struct sock_extended_err ee;
+                memcpy(&ee, CMSG_DATA(c), sizeof(ee));
+                if (ee.ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+                    id = ee.ee_data;
+                    have_id = 1;
+                }
+            }
+        }
+        struct slot *s = &ring[id & (RING - 1)];
+        if (!have_id || !stamp || !s->used || s->seq != id) continue;
+        s->kern_tx = stamp;
+        kern_sample(s);
+    }
+}
+
+// Sleep in poll until deadline, or until the socket has something for us
+void wait_until(int sockfd, long long deadline, int busy) {
+    long long left = deadline - now_ns();
+    if (busy || left <= 0) return;
+    struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+    struct timespec ts = { left / 1000000000LL, left % 1000000000LL };
+    ppoll(&pfd, 1, &ts, NULL);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-r pps] [-d seconds] [-s size] [-B] <server_ip> <server_port>\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    long rate = 10000;
+    double duration = 5;
+    int size = 64, busy = 0, opt;
+    while ((opt = getopt(argc, argv, "r:d:s:B")) != -1) {
+        if (opt == 'r') rate = atol(optarg);
+        else if (opt == 'd') duration = atof(optarg);
+        else if (opt == 's') size = atoi(optarg);
+        else if (opt == 'B') busy = 1;
+        else usage(argv[0]);
+    }
+    int min_size = HEADER_SIZE - 1 + strlen(CRUZID) + 1;
+    if (argc - optind != 2 || rate < 1 || duration <= 0) usage(argv[0]);
+    if (size < min_size || size > MAX_MSS) {
+        fprintf(stderr, "Size must be between %d and %d\n", min_size, MAX_MSS);
+        return 1;
+    }
+
+    struct sockaddr_in servaddr;
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(atoi(argv[optind + 1]));
+    if (inet_pton(AF_INET, argv[optind], &servaddr.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid IP address\n");
+        return 1;
+    }
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) print_error("socket");
+    if (connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) print_error("connect");
+    int rcvbuf = 4 << 20;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    // Software stamps from the kernel on both sides of the round trip; when
+    // the kernel refuses, only the application's own clock is reported
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+                SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+        perror("SO_TIMESTAMPING, reporting application times only");
+    if (busy) {
+        int usec = 50;
+        setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec));
+    } else {
+        // Wake up from ppoll on time rather than up to 50 us late
+        prctl(PR_SET_TIMERSLACK, 1UL);
+    }
+
+    struct slot *ring = calloc(RING, sizeof(*ring));
+    char *packet = malloc(size), *recvbuf = malloc(size);
+    if (!ring || !packet || !recvbuf) print_error("malloc");
+    int payload_len = size - min_size;
+    memset(packet, 0, size);
+    packet[0] = TYPE_PING;
+    int net_len = htonl(payload_len);
+    memcpy(packet + 5, &net_len, 4);
+    memcpy(packet + 9, CRUZID, strlen(CRUZID));
+
+    // Open loop: send i is due at t0 + i / rate no matter how the echoes are
+    // doing, and its round trip counts from when it was due, so a stall in
+    // the sender shows up in the percentiles instead of hiding them
+    long total = (long)(rate * duration);
+    long long period = 1000000000LL / rate;
+    long sent = 0, received = 0, late = 0, failed = 0, dups = 0;
+    long long t0 = now_ns() + 1000000;
+    for (long i = 0; i < total; ++i) {
+        long long due = t0 + (long long)((unsigned long long)i * 1000000000ULL / rate);
+        long long now;
+        while ((now = now_ns()) < due) {
+            wait_until(sockfd, due, busy);
+            received += drain_echoes(sockfd, ring, recvbuf, size, &dups);
+            drain_tx_stamps(sockfd, ring);
+        }
+        if (now - due > period) late++;
+
+        uint32_t seq = sent;
+        uint32_t net_seq = htonl(seq);
+        memcpy(packet + 1, &net_seq, 4);
+        packet[size - 1] = checksum(packet, size - 1);
+        struct slot *s = &ring[seq & (RING - 1)];
+        *s = (struct slot){ .seq = seq, .used = 1, .sched = due };
+        if (send(sockfd, packet, size, 0) != size) {
+            failed++;
+            s->used = 0;
+            continue;
+        }
+        sent++;
+        received += drain_echoes(sockfd, ring, recvbuf, size, &dups);
+        drain_tx_stamps(sockfd, ring);
+    }
+    long long end = now_ns();
+    long long deadline = end + GRACE_NS;
+    while (received < sent && now_ns() < deadline) {
+        wait_until(sockfd, deadline, busy);
+        received += drain_echoes(sockfd, ring, recvbuf, size, &dups);
+        drain_tx_stamps(sockfd, ring);
+    }
+
+    double secs = (end - t0) / 1e9;
+    printf("Sent %ld, received %ld, lost %ld, %ld duplicate, %ld failed sends, %ld late sends\n", sent, received,
+           sent - received, dups, failed, late);
+    printf("Rate %.0f pps, %.1f Mbit/s each way, %s receive\n", sent / secs, sent * (double)size * 8 / secs / 1e6,
+           busy ? "busy-poll" : "blocking");
+    hist_print("App", &app_hist);
+    hist_print("Kernel", &kern_hist);
+
+    close(sockfd);
+    free(ring);
+    free(packet);
+    free(recvbuf);
+    return received == sent ? 0 : 2;
+}
@@ -0,0 +1,66 @@
+#!/bin/bash
+# retransmit.sh — completion time and bytes resent by one lab3 transfer against server drop rate
+#
+# usage: bench/retransmit.sh [size_bytes] [mss] [winsz]
+# Runs from the lab3 directory after make; every run uses a fresh server on a loopback port.
+# BASE names a second bin directory (an older build) to run side by side with BIN.
+# Resent bytes are resent packets times a full payload, so both builds are counted alike.
+
+SIZE=${1:-2000000}
+MSS=${2:-1400}
+WINSZ=${3:-32}
+LOSSES=${LOSSES:-"0 1 2 5 10"}
+REPS=${REPS:-5}
+PORT=${PORT:-19181}
+BIN=${BIN:-bin}
+BASE=${BASE:-}
+
+# the server writes into its working directory, so both are run by full path
+BIN=$(cd "$BIN" && pwd) || exit 1
+if [ -n "$BASE" ]; then BASE=$(cd "$BASE" && pwd) || exit 1; fi
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+head -c "$SIZE" /dev/urandom > "$WORK/in.bin"
+PAYLOAD=$((MSS - 24))
+
+# run <bin dir> <droppc>: prints seconds and resent bytes, or "fail"
+run() {
+    local bin=$1 drop=$2
+    rm -f "$WORK/out.bin"
+    (cd "$WORK" && exec "$bin/myserver" "$PORT" "$drop" > /dev/null 2>&1) &
+    local srv=$!
+    sleep 0.2
+    local t0=$(date +%s.%N)
+    timeout 300 "$bin/myclient" 127.0.0.1 "$PORT" "$MSS" "$WINSZ" "$WORK/in.bin" out.bin > /dev/null 2> "$WORK/err"
+    local rc=$?
+    local t1=$(date +%s.%N)
+    kill $srv 2>/dev/null
+    wait $srv 2>/dev/null
+    if [ $rc -ne 0 ] || ! cmp -s "$WORK/in.bin" "$WORK/out.bin"; then
+        echo fail
+        return
+    fi
+    local resent=$(sed -n 's/.* \([0-9]*\) of [0-9]* packets resent.*/\1/p' "$WORK/err" | head -1)
+    echo "$(awk "BEGIN { print $t1 - $t0 }") $((${resent:-0} * PAYLOAD))"
+}
+
+# median <bin dir> <droppc>: median seconds and resent bytes over REPS runs
+median() {
+    local out=()
+    for _ in $(seq "$REPS"); do out+=("$(run "$@")"); done
+    printf "%s\n" "${out[@]}" | grep -v fail | sort -n | awk '{ t[NR] = $1; r[NR] = $2 } END { if (NR) print t[int((NR + 1) / 2)], r[int((NR + 1) / 2)]; else print "fail" }'
+}
+
+printf "%-6s | %10s %12s" "loss%" "seconds" "resent bytes"
+[ -n "$BASE" ] && printf " | %10s %12s" "base s" "base resent"
+printf "\n"
+for loss in $LOSSES; do
+    read -r t r <<< "$(median "$BIN" "$loss")"
+    printf "%-6s | %10s %12s" "$loss" "$t" "${r:--}"
+    if [ -n "$BASE" ]; then
+        read -r t r <<< "$(median "$BASE" "$loss")"
+        printf " | %10s %12s" "$t" "${r:--}"
+    fi
+    printf "\n"
+done
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,34 +7,56 @@
 #include <errno.h>
 #include <time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
-#define HEADER_SIZE 9  // 1B type + 4B seq + 4B length
+#include "packet.h"
+#include "pktio.h"
+#include "bundle.h"
+#include "ring.h"
+#include "pmtu.h"
+#include "trace.h"
+#include "wheel.h"
+
+#define HEADER_SIZE PKT_HEADER  // 1B type + 8B seq + 4B length
+#define MAX_MSS 32768
 #define MAX_RETRIES 5
 #define TIMEOUT_SEC 2
+#define TIMEOUT_MS (TIMEOUT_SEC * 1000)  // RTO until the first RTT sample, and the longest wait for any packet
+#define RTO_MIN_MS 200
 #define TYPE_DATA 0x1
 #define TYPE_META 0x2
 
-const char* CRUZID = "faslam:";
-
-// Same as before
-unsigned char checksum(const unsigned char *data, int len) {
-    unsigned long sum = 0;
-    for (int i = 0; i < len; ++i) {
-        sum += (unsigned char)data[i];
-	if (sum & 0xFFFF0000) {
-		sum &= 0xFFFF;
-		sum++;
-	}
-    }
-    return (unsigned char)(sum & 0xFF);
-}
+// One packet in flight: its header and trailer, and where in the input its
+// payload lies. The payload itself is sent straight from the mapping.
+struct slot {
+    unsigned char hdr[PKT_PREFIX];
+    unsigned char trailer[TRAILER_SIZE];
+    size_t off;
+    int len;
+    uint64_t sent_ns;
+    int resent;
+    int retries;                 // timeouts of this seq; each has its own budget
+    uint64_t base_sent;          // base when it was last sent
+    uint64_t sent_no;            // when it was last sent, counted in packets sent
+    struct wheel_timer timer;
+};
 
+// RFC 6298 retransmission timeout from the RTT samples of packets sent once
+struct rto {
+    double srtt, rttvar;         // ms, srtt 0 until the first sample
+    long ms;
+};
 
 // Server responses
-void log_event(const char* event, int seq, int base, int nextsn, int window_end) {
+void log_event(int type, const char* event, uint64_t seq, uint64_t base, uint64_t nextsn, uint64_t window_end) {
+    if (trace_fd >= 0) {
+        trace_event(type, seq, base, nextsn, window_end, NULL);
+        return;
+    }
     char timebuf[64];
     struct timespec ts;
     struct tm *tm_info;
@@ -43,54 +66,105 @@ void log_event(const char* event, int seq, int base, int nextsn, int window_end)
     tm_info = gmtime(&sec);
     strftime(timebuf, sizeof(timebuf), "%Y-%m-%dT%H:%M:%S", tm_info);
 
-    printf("%s.%03ldZ, %s, %d, %d, %d, %d\n",
+    printf("%s.%03ldZ, %s, %llu, %llu, %llu, %llu\n",
            timebuf,
            ts.tv_nsec / 1000000,
            event,
-           seq,
-           base,
-           nextsn,
-           window_end);
+           (unsigned long long)seq,
+           (unsigned long long)base,
+           (unsigned long long)nextsn,
+           (unsigned long long)window_end);
     fflush(stdout);
 }
 
-int make_packet(unsigned char *packet, int type, int seq, const char *data, int len) {
-    int offset = 0;
-    packet[offset++] = (unsigned char)type;
+int make_packet(unsigned char *packet, int type, uint64_t seq, const char *data, int len) {
+    int offset = pkt_put_prefix(packet, type, seq, len);
+    memcpy(packet + offset, data, len);
+    return pkt_seal(packet, offset + len);
+}
+
+// Fill in s for the len bytes at src + off. The CRC is the only pass over the
+// payload: it is neither read into a buffer nor copied into the slot.
+void slot_fill(struct slot *s, uint64_t seq, const unsigned char *src, size_t off, int len) {
+    s->off = off;
+    s->len = len;
+    pkt_put_prefix(s->hdr, TYPE_DATA, seq, len);
+    pkt_put_trailer(s->trailer, crc32c(crc32c(0, s->hdr, PKT_PREFIX), src + off, len));
+}
 
-    int net_seq = htonl(seq);
-    memcpy(packet + offset, &net_seq, 4);
-    offset += 4;
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-    int net_len = htonl(len);
-    memcpy(packet + offset, &net_len, 4);
-    offset += 4;
+uint64_t now_ms() {
+    return now_ns() / 1000000;
+}
 
-    memcpy(packet + offset, CRUZID, strlen(CRUZID));
-    offset += strlen(CRUZID);
+void rto_sample(struct rto *r, double rtt_ms) {
+    if (r->srtt == 0) {
+        r->srtt = rtt_ms;
+        r->rttvar = rtt_ms / 2;
+    } else {
+        double err = r->srtt > rtt_ms ? r->srtt - rtt_ms : rtt_ms - r->srtt;
+        r->rttvar = 0.75 * r->rttvar + 0.25 * err;
+        r->srtt = 0.875 * r->srtt + 0.125 * rtt_ms;
+    }
+    r->ms = r->srtt + (4 * r->rttvar > 1 ? 4 * r->rttvar : 1);
+    if (r->ms < RTO_MIN_MS) r->ms = RTO_MIN_MS;
+    if (r->ms > TIMEOUT_MS) r->ms = TIMEOUT_MS;
+}
 
-    memcpy(packet + offset, data, len);
-    offset += len;
+// Wait after a packet's retries-th timeout: doubled each time, up to TIMEOUT_MS
+long rto_backoff(const struct rto *r, int retries) {
+    long ms = r->ms;
+    for (int i = 0; i < retries && ms < TIMEOUT_MS; ++i) ms *= 2;
+    return ms < TIMEOUT_MS ? ms : TIMEOUT_MS;
+}
+
+// Largest datagram up to max that reaches the server unfragmented, or -1
+int discover_mss(const struct sockaddr_in *server, int max) {
+    struct pmtu_probe p = { .peer = *server, .min = PKT_PREFIX + TRAILER_SIZE + 1, .max = max,
+                            .build = pmtu_pkt_build, .match = pmtu_pkt_match, .ctx = (void *)PKT_FINGERPRINT };
+    return pmtu_discover(&p);
+}
 
-    packet[offset] = checksum(packet, offset);
-    return offset + 1;
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-T trace] <server_ip> <server_port> <mss|auto> <winsz> <infile> <outfile>\n", prog);
+    exit(1);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 7) {
-        fprintf(stderr, "Usage: %s <server_ip> <server_port> <mss> <winsz> <infile> <outfile>\n", argv[0]);
-        exit(1);
+    int opt;
+    while ((opt = getopt(argc, argv, "T:")) != -1) {
+        if (opt != 'T') usage(argv[0]);
+        if (trace_open(optarg, TRACE_LAB3_CLIENT, 0) < 0) {
+            perror("open trace");
+            exit(1);
+        }
     }
+    if (argc - optind != 6) usage(argv[0]);
+    argv += optind - 1;
 
     const char *server_ip = argv[1];
     int server_port = atoi(argv[2]);
-    int mss = atoi(argv[3]);
+    int mss_auto = strcmp(argv[3], "auto") == 0;
+    int mss = mss_auto ? MAX_MSS : atoi(argv[3]);
     int winsz = atoi(argv[4]);
     const char *infile = argv[5];
     const char *outfile = argv[6];
 
-    if (mss <= HEADER_SIZE + (int)strlen(CRUZID)) {
-        fprintf(stderr, "MSS must be greater than HEADER_SIZE + CruzID length.\n");
+    if (mss <= PKT_PREFIX + TRAILER_SIZE) {
+        fprintf(stderr, "MSS must be greater than HEADER_SIZE + CruzID length + trailer.\n");
+        exit(1);
+    }
+    if (mss > MAX_MSS) {
+        fprintf(stderr, "Maximum MSS is %d\n", MAX_MSS);
+        exit(1);
+    }
+    if (winsz < 1) {
+        fprintf(stderr, "Window size must be at least 1.\n");
         exit(1);
     }
 
@@ -106,23 +180,92 @@ int main(int argc, char *argv[]) {
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(server_port);
     inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
-    FILE *fp = fopen(infile, "rb");
-    if (!fp) {
-        perror("fopen infile");
+
+    // mss auto: probe for the largest datagram that gets through, and keep
+    // the data unfragmented so a later black hole shows up as loss
+    if (mss_auto) {
+        pmtu_set_df(sockfd);
+        if ((mss = discover_mss(&server_addr, MAX_MSS)) < 0) {
+            fprintf(stderr, "No path MTU probe answered by IP %s port %d\n", server_ip, server_port);
+            exit(1);
+        }
+        fprintf(stderr, "MSS %d for IP %s port %d\n", mss, server_ip, server_port);
+    }
+
+    int infd = open(infile, O_RDONLY | O_CLOEXEC);
+    if (infd < 0) {
+        perror("open infile");
         exit(1);
     }
 
-    int base = 1, nextsn = 1, retries = 0;
-    char data_buf[mss - HEADER_SIZE - strlen(CRUZID)];
-    unsigned char window[winsz][1500];
-    int lens[winsz];
+    // A directory is sent as one stream of bundle records, staged in a
+    // temporary file; the trailing '/' on outfile tells the server to unpack it
+    char out_name[1024];
+    snprintf(out_name, sizeof(out_name), "%s", outfile);
+    struct stat st;
+    if (fstat(infd, &st) == 0 && S_ISDIR(st.st_mode)) {
+        struct bundle_stats bst;
+        int bundle_fd = bundle_stage(infile, &bst);
+        if (bundle_fd < 0) {
+            perror("bundle infile");
+            exit(1);
+        }
+        fprintf(stderr, "Bundled %u files and %u directories\n", bst.files, bst.dirs);
+        close(infd);
+        infd = bundle_fd;
+        if (out_name[0] && out_name[strlen(out_name) - 1] != '/')
+            strncat(out_name, "/", sizeof(out_name) - strlen(out_name) - 1);
+        outfile = out_name;
+    }
+    // Packets are sent from a mapping of the input rather than read into
+    // buffers first
+    if (fstat(infd, &st) < 0) {
+        perror("stat infile");
+        exit(1);
+    }
+    size_t src_size = st.st_size, next_off = 0;
+    const unsigned char *src = NULL;
+    if (src_size > 0) {
+        void *map = mmap(NULL, src_size, PROT_READ, MAP_SHARED, infd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap infile");
+            exit(1);
+        }
+        madvise(map, src_size, MADV_SEQUENTIAL);
+        src = map;
+    }
+    struct pkt_tx tx;
+    pkt_tx_init(&tx, sockfd, &server_addr);
+
+    uint64_t base = 1, nextsn = 1;
+    // One slot per packet in flight; with a large window this is far more
+    // than the stack holds
+    size_t ring_bytes = (size_t)winsz * sizeof(struct slot);
+    struct slot *window = ring_alloc(ring_bytes);
+    if (!window) {
+        perror("window");
+        exit(1);
+    }
+    struct xfer_stats stats = { .start_ns = now_ns() };
+    long long resent_bytes = 0;
+    uint64_t sends = 0;
     int last_packet_sent = 0;
     int finished = 0;
 
-    // Sending meta packetsssss
-    unsigned char meta_packet[1500];
+    // Every packet in flight has its own deadline on the wheel, so a timeout
+    // resends only what has timed out, and select() sleeps until the next one
+    struct wheel wheel;
+    wheel_init(&wheel, now_ms());
+    struct rto rto = { .ms = TIMEOUT_MS };
+
+    // Sending meta packetsssss, again on its own timer until the first ACK
+    // shows the server has it
+    unsigned char meta_packet[PKT_PREFIX + 1024 + TRAILER_SIZE];
     int meta_len = make_packet(meta_packet, TYPE_META, 0, outfile, strlen(outfile));
     sendto(sockfd, meta_packet, meta_len, 0, (struct sockaddr *)&server_addr, addr_len);
+    struct wheel_timer meta_timer = { 0 };
+    int meta_retries = 0, meta_acked = 0;
+    wheel_add(&wheel, &meta_timer, now_ms() + rto.ms, 0);
 
     fd_set read_fds;
     struct timeval timeout;
@@ -130,55 +273,140 @@ int main(int argc, char *argv[]) {
     while (!finished) {
         // GBN send windo
         while (nextsn < base + winsz && !last_packet_sent) {
-            int nread = fread(data_buf, 1, sizeof(data_buf), fp);
-            if (nread <= 0) {
+            size_t len = src_size - next_off;
+            if (len > (size_t)(mss - PKT_PREFIX - TRAILER_SIZE)) len = mss - PKT_PREFIX - TRAILER_SIZE;
+            if (len == 0) {
                 last_packet_sent = 1;
                 break;
             }
-            int plen = make_packet(window[nextsn % winsz], TYPE_DATA, nextsn, data_buf, nread);
-            lens[nextsn % winsz] = plen;
-            sendto(sockfd, window[nextsn % winsz], plen, 0, (struct sockaddr *)&server_addr, addr_len);
-            log_event("DATA", nextsn, base, nextsn + 1, base + winsz);
+            struct slot *s = &window[nextsn % winsz];
+            slot_fill(s, nextsn, src, next_off, len);
+            next_off += len;
+            pkt_sendv(&tx, &server_addr, s->hdr, PKT_PREFIX, src + s->off, s->len, s->trailer, NULL, 0);
+            s->sent_ns = now_ns();
+            s->resent = 0;
+            s->retries = 0;
+            s->base_sent = base;
+            s->sent_no = ++sends;
+            wheel_add(&wheel, &s->timer, now_ms() + rto.ms, nextsn);
+            stats.packets++;
+            log_event(TRACE_DATA, "DATA", nextsn, base, nextsn + 1, base + winsz);
             nextsn++;
         }
 
+        long wait = wheel_next(&wheel, now_ms());
+        if (wait < 0) wait = TIMEOUT_MS;
         FD_ZERO(&read_fds);
         FD_SET(sockfd, &read_fds);
-        timeout.tv_sec = TIMEOUT_SEC;
-        timeout.tv_usec = 0;
+        timeout.tv_sec = wait / 1000;
+        timeout.tv_usec = wait % 1000 * 1000;
 
         int rv = select(sockfd + 1, &read_fds, NULL, NULL, &timeout);
 
-        if (rv == 0) { // Timeout
-            retries++;
-            if (retries >= MAX_RETRIES) {
-                fprintf(stderr, "Max retries reached. Exiting.\n");
-                exit(1);
-            }
-            for (int i = base; i < nextsn; ++i) {
-                sendto(sockfd, window[i % winsz], lens[i % winsz], 0, (struct sockaddr *)&server_addr, addr_len);
-                log_event("DATA", i, base, nextsn, base + winsz);
-            }
-        } else if (FD_ISSET(sockfd, &read_fds)) {
-            unsigned char ack_buf[1500];
-            int rlen = recvfrom(sockfd, ack_buf, sizeof(ack_buf), 0, (struct sockaddr *)&server_addr, &addr_len);
-            if (rlen >= 5) {
-                int ack_seq;
-                memcpy(&ack_seq, ack_buf + 1, 4);
-                ack_seq = ntohl(ack_seq);
-                log_event("ACK", ack_seq, base, nextsn, base + winsz);
-                if (ack_seq >= base) {
-                    base = ack_seq + 1;
-                    retries = 0;
-                    if (last_packet_sent && base == nextsn) {
-                        finished = 1;
+        if (rv > 0 && FD_ISSET(sockfd, &read_fds)) {
+            // Zerocopy completions make the socket readable too
+            pkt_tx_reap(&tx);
+            // Every queued ACK, before any timer is looked at: one still
+            // waiting here must not count as a timeout
+            unsigned char ack_buf[HEADER_SIZE + TRAILER_SIZE];
+            int rlen;
+            while ((rlen = recvfrom(sockfd, ack_buf, sizeof(ack_buf), MSG_DONTWAIT, (struct sockaddr *)&server_addr, &addr_len)) > 0) {
+                if (rlen < HEADER_SIZE + TRAILER_SIZE || !pkt_valid(ack_buf, rlen)) continue;
+                uint64_t ack_seq = pkt_seq(ack_buf);
+                log_event(TRACE_ACK, "ACK", ack_seq, base, nextsn, base + winsz);
+                stats_ack(&stats, nextsn - base);
+                // An ACK of 0 also answers DATA that came before the META:
+                // only with nothing sent after it does it mean the server has it
+                if (!meta_acked && (ack_seq > 0 || nextsn == 1)) {
+                    meta_acked = 1;
+                    wheel_cancel(&wheel, &meta_timer);
+                }
+                if (ack_seq >= base && ack_seq < nextsn) {
+                    struct slot *acked = &window[ack_seq % winsz];
+                    if (!acked->resent) {
+                        uint64_t rtt = now_ns() - acked->sent_ns;
+                        stats_rtt(&stats, rtt);
+                        rto_sample(&rto, rtt / 1e6);
                     }
+                    for (uint64_t i = base; i <= ack_seq; ++i) {
+                        stats.bytes += window[i % winsz].len;
+                        wheel_cancel(&wheel, &window[i % winsz].timer);
+                    }
+                    base = ack_seq + 1;
                 }
             }
         }
+        if (meta_acked && last_packet_sent && base == nextsn) {
+            finished = 1;
+            break;
+        }
+
+        // Only the packets whose own deadline has passed go again
+        struct wheel_timer *t;
+        while ((t = wheel_pop(&wheel, now_ms()))) {
+            if (t == &meta_timer) {
+                if (++meta_retries > MAX_RETRIES) {
+                    fprintf(stderr, "Max retries reached for META. Exiting.\n");
+                    exit(1);
+                }
+                sendto(sockfd, meta_packet, meta_len, 0, (struct sockaddr *)&server_addr, addr_len);
+                wheel_add(&wheel, &meta_timer, now_ms() + rto_backoff(&rto, meta_retries), 0);
+                continue;
+            }
+            uint64_t seq = t->key;
+            struct slot *s = &window[seq % winsz];
+            // The server takes nothing past a missing packet, and base is
+            // missing: unless it has gone out again since this one did, go
+            // right after the packet before on its timer. Resent on their own,
+            // the packets behind one on a longer backoff would be thrown away.
+            struct slot *prev = &window[(seq - 1) % winsz];
+            if (seq > base && prev->timer.next && window[base % winsz].sent_no < s->sent_no) {
+                wheel_add_after(&wheel, t, &prev->timer, seq);
+                continue;
+            }
+            // The server drops everything behind a lost packet, so a timeout
+            // counts against this one only if the window has not moved since
+            if (base != s->base_sent) s->retries = 0;
+            s->base_sent = base;
+            if (++s->retries > MAX_RETRIES) {
+                fprintf(stderr, "Max retries reached for packet %llu. Exiting.\n", (unsigned long long)seq);
+                exit(1);
+            }
+            // The oldest packet timed out. With mss auto the path may have
+            // started dropping packets this big: probe again and, if it
+            // shrank, send the window over in smaller ones.
+            int smaller;
+            if (mss_auto && seq == base && s->retries == 1 && (smaller = discover_mss(&server_addr, mss)) > 0 &&
+                smaller < mss) {
+                fprintf(stderr, "Path to IP %s port %d shrank, MSS %d -> %d\n", server_ip, server_port, mss, smaller);
+                mss = smaller;
+                for (uint64_t i = base; i < nextsn; ++i) wheel_cancel(&wheel, &window[i % winsz].timer);
+                // The slots from base on are about to be refilled
+                pkt_tx_flush(&tx);
+                next_off = s->off;
+                nextsn = base;
+                last_packet_sent = 0;
+                break;
+            }
+            pkt_sendv(&tx, &server_addr, s->hdr, PKT_PREFIX, src + s->off, s->len, s->trailer, NULL, 0);
+            s->resent = 1;
+            s->sent_no = ++sends;
+            stats.packets++;
+            stats.resends++;
+            resent_bytes += s->len;
+            log_event(TRACE_DATA, "DATA", seq, base, nextsn, base + winsz);
+            wheel_add(&wheel, t, now_ms() + rto_backoff(&rto, s->retries), seq);
+        }
     }
 
-    fclose(fp);
+    char who[64];
+    snprintf(who, sizeof(who), "IP %s port %d", server_ip, server_port);
+    stats_print(stderr, who, &stats, now_ns(), winsz);
+    fprintf(stderr, "%s: %lld bytes resent, RTO %ld ms\n", who, resent_bytes, rto.ms);
+
+    ring_free(window, ring_bytes);
+    if (src) munmap((void *)src, src_size);
+    close(infd);
     close(sockfd);
     return 0;
 }
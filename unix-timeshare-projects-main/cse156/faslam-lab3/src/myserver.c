@@ -10,20 +10,17 @@
 #include <sys/types.h>
 #include <time.h>
 #include <libgen.h>
+#include <signal.h>
+
+#include "packet.h"
+#include "bundle.h"
+#include "trace.h"
 
 #define MAX_PACKET_SIZE 32768
-#define CRUZID_LEN 7
-#define HEADER_SIZE 9  // 1 byte type + 4 byte seq + 4 byte length
+#define HEADER_SIZE PKT_HEADER  // 1 byte type + 8 byte seq + 4 byte length
 #define TYPE_META 0x2
 #define TYPE_DATA 0x1
-
-unsigned char checksum(const unsigned char *data, int len) {
-    unsigned int sum = 0;
-    for (int i = 0; i < len; ++i) {
-        sum += data[i];
-    }
-    return (unsigned char)(sum % 256);
-}
+#define TYPE_PROBE PKT_TYPE_PROBE
 
 char *rfc3339_time() {
     static char buf[64];
@@ -36,23 +33,54 @@ char *rfc3339_time() {
     return buf;
 }
 
+// One CSV line, or with -T a binary trace event
+void log_pkt(int type, const char *name, const struct sockaddr_in *peer, uint64_t seq) {
+    if (trace_fd >= 0) trace_event(type, seq, 0, 0, 0, peer);
+    else printf("%s, %s, %llu\n", rfc3339_time(), name, (unsigned long long)seq);
+}
+
+volatile sig_atomic_t stop = 0;
+
+void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
 int should_drop(int droppc) {
     return (rand() % 100) < droppc;
 }
 
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-T trace] <port> <droppc>\n", prog);
+    exit(1);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <port> <droppc>\n", argv[0]);
-        return 1;
+    const char *trace_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "T:")) != -1) {
+        if (opt != 'T') usage(argv[0]);
+        trace_path = optarg;
     }
+    if (argc - optind != 2) usage(argv[0]);
 
-    int port = atoi(argv[1]);
-    int droppc = atoi(argv[2]);
+    int port = atoi(argv[optind]);
+    int droppc = atoi(argv[optind + 1]);
     if (droppc < 0 || droppc > 100) {
         fprintf(stderr, "droppc must be between 0 and 100\n");
         return 1;
     }
 
+    if (trace_path && trace_open(trace_path, TRACE_LAB3_SERVER, port) < 0) {
+        perror("open trace");
+        return 1;
+    }
+
+    // Stop on a signal so the trace gets flushed; recvfrom() is not restarted
+    struct sigaction sa = { .sa_handler = on_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
     srand(time(NULL));
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) {
@@ -74,75 +102,95 @@ int main(int argc, char *argv[]) {
     printf("Server listening on port %d...\n", port);
 
     FILE *fout = NULL;
-    int expected_seq = 1;
+    struct bundle *tree = NULL;  // outfile ending in '/': the data is a directory tree
+    uint64_t expected_seq = 1;
     char buffer[MAX_PACKET_SIZE];
 
-    while (1) {
+    while (!stop) {
         socklen_t len = sizeof(cliaddr);
         ssize_t recv_len = recvfrom(sockfd, buffer, MAX_PACKET_SIZE, 0, (struct sockaddr *)&cliaddr, &len);
-        if (recv_len < HEADER_SIZE + CRUZID_LEN + 1) continue;
+        if (recv_len < PKT_PREFIX + TRAILER_SIZE) continue;
 
-        unsigned char type = buffer[0];
-        int seq, datalen;
-        memcpy(&seq, buffer + 1, 4);
-        memcpy(&datalen, buffer + 5, 4);
-        seq = ntohl(seq);
-        datalen = ntohl(datalen);
+        unsigned char type = PKT_TYPE(buffer[0]);
+        uint64_t seq = pkt_seq((unsigned char *)buffer);
+        int datalen = pkt_len((unsigned char *)buffer);
 
         // Drop logic (DATA/META are both dropped as DATA here)
         if (should_drop(droppc)) {
-            printf("%s, DROP %s, %d\n", rfc3339_time(), type == TYPE_META ? "DATA" : "DATA", seq);
+            log_pkt(TRACE_DROP_DATA, "DROP DATA", &cliaddr, seq);
             continue;
         }
 
-        unsigned char received_chk = buffer[recv_len - 1];
-        unsigned char computed_chk = checksum((unsigned char *)buffer, recv_len - 1);
-        if (received_chk != computed_chk) continue;
+        if (!pkt_valid((unsigned char *)buffer, recv_len)) continue;
+        if (datalen < 0 || datalen > recv_len - PKT_PREFIX - TRAILER_SIZE) continue;
+
+        if (type == TYPE_PROBE) {
+            // Path MTU probe from a client given mss auto: say how much
+            // arrived, outside the transfer
+            unsigned char reply[PKT_PROBE_REPLY];
+            pkt_put_probe_reply(reply, seq, recv_len);
+            sendto(sockfd, reply, sizeof(reply), 0, (struct sockaddr *)&cliaddr, len);
+            continue;
+        }
 
-        if (type == TYPE_META && seq == 0 && fout == NULL) {
+        if (type == TYPE_META && seq == 0 && fout == NULL && tree == NULL) {
             // Extract output file path
             char outfile_path[1024] = {0};
-            memcpy(outfile_path, buffer + HEADER_SIZE + CRUZID_LEN, datalen);
-
-            // Create necessary directories
-            char *pathcopy = strdup(outfile_path);
-            char mkdir_cmd[1024];
-            snprintf(mkdir_cmd, sizeof(mkdir_cmd), "mkdir -p %s", dirname(pathcopy));
-            system(mkdir_cmd);
-            free(pathcopy);
-
-            // Open file
-            fout = fopen(outfile_path, "wb");
-            if (!fout) {
-                perror("fopen");
-                return 1;
+            memcpy(outfile_path, buffer + PKT_PREFIX, datalen < 1023 ? datalen : 1023);
+            size_t path_len = strlen(outfile_path);
+
+            if (path_len > 0 && outfile_path[path_len - 1] == '/') {
+                tree = bundle_open(outfile_path, 0);
+                if (!tree) {
+                    perror("mkdir");
+                    return 1;
+                }
+            } else {
+                // Create necessary directories
+                char *pathcopy = strdup(outfile_path);
+                if (make_dirs(dirname(pathcopy)) < 0) perror("mkdir");
+                free(pathcopy);
+
+                // Open file
+                fout = fopen(outfile_path, "wb");
+                if (!fout) {
+                    perror("fopen");
+                    return 1;
+                }
             }
             expected_seq = 1;
         }
+        else if (type == TYPE_DATA && seq == expected_seq && tree != NULL) {
+            // Files land in place as their last byte arrives
+            if (bundle_write(tree, buffer + PKT_PREFIX, datalen) < 0) {
+                perror("write");
+                return 1;
+            }
+            expected_seq++;
+        }
         else if (type == TYPE_DATA && seq == expected_seq && fout != NULL) {
-            fwrite(buffer + HEADER_SIZE + CRUZID_LEN, 1, datalen, fout);
+            fwrite(buffer + PKT_PREFIX, 1, datalen, fout);
             fflush(fout);
             expected_seq++;
         }
 
-        // Send ACK unless dropped
+        // Cumulative ACK of everything written so far, unless dropped; an
+        // out-of-order packet repeats the last one rather than acking its own seq
+        uint64_t cum = expected_seq - 1;
         if (should_drop(droppc)) {
-            printf("%s, DROP ACK, %d\n", rfc3339_time(), seq);
+            log_pkt(TRACE_DROP_ACK, "DROP ACK", &cliaddr, cum);
             continue;
         }
 
-        char ack[10] = {0};
-        ack[0] = 0x2;
-        int net_seq = htonl(seq);
-        int dummy = htonl(0);
-        memcpy(ack + 1, &net_seq, 4);
-        memcpy(ack + 5, &dummy, 4);
-        ack[9] = checksum((unsigned char *)ack, 9);
-        sendto(sockfd, ack, 10, 0, (struct sockaddr *)&cliaddr, len);
-        printf("%s, ACK, %d\n", rfc3339_time(), seq);
+        unsigned char ack[HEADER_SIZE + TRAILER_SIZE];
+        pkt_put_header(ack, TYPE_META, cum, 0);
+        pkt_seal(ack, HEADER_SIZE);
+        sendto(sockfd, ack, sizeof(ack), 0, (struct sockaddr *)&cliaddr, len);
+        log_pkt(TRACE_ACK, "ACK", &cliaddr, cum);
     }
 
     if (fout) fclose(fout);
+    if (tree) bundle_abort(tree);
     close(sockfd);
     return 0;
 }
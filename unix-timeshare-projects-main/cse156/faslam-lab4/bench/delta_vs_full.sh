@@ -0,0 +1,65 @@
+#!/bin/bash
+# delta_vs_full.sh — end-to-end time of re-replicating an edited file, full transfer against -D
+#
+# usage: bench/delta_vs_full.sh [size_bytes] [mss] [winsz]
+# Runs from the lab4 directory after make. For each edit the server starts from
+# the same old copy, once receiving the whole new file and once only its delta.
+
+SIZE=${1:-32000000}
+MSS=${2:-1400}
+WINSZ=${3:-64}
+PORT=${PORT:-19291}
+BIN=${BIN:-bin}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+head -c "$SIZE" /dev/urandom > "$WORK/old.bin"
+echo "127.0.0.1 $PORT" > "$WORK/servaddr.conf"
+
+# edit <name>: writes new.bin from old.bin
+edit() {
+    case $1 in
+    same) cp "$WORK/old.bin" "$WORK/new.bin" ;;
+    poke) cp "$WORK/old.bin" "$WORK/new.bin"
+          for off in 1000 $((SIZE / 3)) $((SIZE / 2)) $((SIZE - 5000)); do
+              head -c 64 /dev/urandom | dd of="$WORK/new.bin" bs=1 seek=$off conv=notrunc status=none
+          done ;;
+    insert) { head -c $((SIZE / 2)) "$WORK/old.bin"; head -c 4096 /dev/urandom; tail -c +$((SIZE / 2 + 1)) "$WORK/old.bin"; } > "$WORK/new.bin" ;;
+    append) { cat "$WORK/old.bin"; head -c $((SIZE / 10)) /dev/urandom; } > "$WORK/new.bin" ;;
+    fresh) head -c "$SIZE" /dev/urandom > "$WORK/new.bin" ;;
+    esac
+}
+
+# run [client options]: seconds for one transfer of new.bin onto a server holding old.bin
+run() {
+    rm -rf "$WORK/root"
+    mkdir -p "$WORK/root"
+    cp "$WORK/old.bin" "$WORK/root/out.bin"
+    "$BIN/myserver" "$PORT" 0 "$WORK/root" > /dev/null 2>&1 &
+    local srv=$!
+    sleep 0.2
+    local t0=$(date +%s.%N)
+    timeout 300 "$BIN/myclient" "$@" 1 "$WORK/servaddr.conf" "$MSS" "$WINSZ" "$WORK/new.bin" out.bin > /dev/null 2> "$WORK/err"
+    local rc=$?
+    local t1=$(date +%s.%N)
+    sleep 0.3
+    kill $srv 2>/dev/null
+    wait $srv 2>/dev/null
+    if [ $rc -ne 0 ] || ! cmp -s "$WORK/new.bin" "$WORK/root/out.bin"; then
+        echo fail
+        return
+    fi
+    awk "BEGIN { printf \"%.3f\", $t1 - $t0 }"
+}
+
+printf "%-8s | %10s | %10s %12s %8s | %8s\n" "edit" "full s" "delta s" "delta bytes" "saved" "speedup"
+for e in same poke insert append fresh; do
+    edit $e
+    t_full=$(run)
+    t_delta=$(run -D)
+    bytes=$(sed -n 's/.*delta \([0-9]*\) bytes.*/\1/p' "$WORK/err")
+    saved=$(sed -n 's/.*(\(-\?[0-9.]*%\) saved).*/\1/p' "$WORK/err")
+    speedup=-
+    [ "$t_full" != fail ] && [ "$t_delta" != fail ] && speedup=$(awk "BEGIN { printf \"%.2fx\", $t_full / $t_delta }")
+    printf "%-8s | %10s | %10s %12s %8s | %8s\n" "$e" "$t_full" "$t_delta" "${bytes:--}" "${saved:--}" "$speedup"
+done
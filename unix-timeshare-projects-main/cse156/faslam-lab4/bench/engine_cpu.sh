@@ -0,0 +1,62 @@
+#!/bin/bash
+# engine_cpu.sh — client CPU per MB replicated, one thread per server against the -e event loop
+#
+# usage: bench/engine_cpu.sh [file_bytes] [mss] [winsz]
+# Runs from the lab4 directory after make. SERVERS in the environment picks the
+# replica counts (default "1 4 16 64"); every server is its own process on
+# 127.0.0.1, so the larger counts mostly measure how the client copes with them.
+
+FSIZE=${1:-1000000}
+MSS=${2:-1400}
+WINSZ=${3:-32}
+SERVERS=${SERVERS:-"1 4 16 64"}
+PORT=${PORT:-19400}
+BIN=${BIN:-bin}
+
+WORK=$(mktemp -d)
+SRVS=()
+cleanup() {
+    for p in "${SRVS[@]}"; do kill "$p" 2>/dev/null; done
+    wait 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+head -c "$FSIZE" /dev/urandom > "$WORK/in.bin"
+
+# run <n> [-e]: client CPU ms/MB for one transfer to n servers
+run() {
+    local n=$1 engine=$2
+    SRVS=()
+    rm -rf "$WORK/roots" "$WORK/servaddr.conf"
+    for ((i = 0; i < n; i++)); do
+        mkdir -p "$WORK/roots/$i"
+        echo "127.0.0.1 $((PORT + i))" >> "$WORK/servaddr.conf"
+        "$BIN/myserver" $((PORT + i)) 0 "$WORK/roots/$i" > /dev/null 2>&1 &
+        SRVS+=($!)
+    done
+    sleep 0.5
+    timeout 300 "$BIN/myclient" $engine "$n" "$WORK/servaddr.conf" "$MSS" "$WINSZ" "$WORK/in.bin" out.bin \
+        > /dev/null 2> "$WORK/client.err"
+    local rc=$?
+    sleep 0.3
+    for p in "${SRVS[@]}"; do kill "$p" 2>/dev/null; done
+    wait 2>/dev/null
+    SRVS=()
+    for ((i = 0; i < n; i++)); do
+        cmp -s "$WORK/in.bin" "$WORK/roots/$i/out.bin" || rc=1
+    done
+    if [ $rc -ne 0 ]; then
+        echo fail
+        return
+    fi
+    awk '/^CPU / { printf "%.2f", $(NF - 1) }' "$WORK/client.err"
+}
+
+printf "%8s | %14s | %14s | %8s\n" servers "threads ms/MB" "-e ms/MB" ratio
+for n in $SERVERS; do
+    t=$(run "$n")
+    e=$(run "$n" -e)
+    ratio=-
+    [ "$t" != fail ] && [ "$e" != fail ] && ratio=$(awk "BEGIN { printf \"%.2fx\", $t / $e }")
+    printf "%8d | %14s | %14s | %8s\n" "$n" "$t" "$e" "$ratio"
+done
@@ -0,0 +1,67 @@
+#!/bin/bash
+# fec_goodput.sh — goodput of one lab4 transfer against server drop rate, with and without -F
+#
+# usage: bench/fec_goodput.sh [size_bytes] [mss] [winsz]
+# Runs from the lab4 directory after make; every run uses a fresh server on a loopback port.
+# A single lost retransmission costs a whole timeout, so each cell is the median of REPS runs.
+
+SIZE=${1:-4000000}
+MSS=${2:-1200}
+WINSZ=${3:-64}
+LOSSES=${LOSSES:-"0 1 2 5 10"}
+REPS=${REPS:-5}
+PORT=${PORT:-19191}
+BIN=${BIN:-bin}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+head -c "$SIZE" /dev/urandom > "$WORK/in.bin"
+echo "127.0.0.1 $PORT" > "$WORK/servaddr.conf"
+
+# run <droppc> [client options]: prints seconds and resent packets, or "fail"
+run() {
+    local drop=$1
+    shift
+    rm -rf "$WORK/root"
+    mkdir -p "$WORK/root"
+    "$BIN/myserver" "$PORT" "$drop" "$WORK/root" > /dev/null 2>&1 &
+    local srv=$!
+    sleep 0.2
+    local t0=$(date +%s.%N)
+    timeout 300 "$BIN/myclient" "$@" 1 "$WORK/servaddr.conf" "$MSS" "$WINSZ" "$WORK/in.bin" out.bin > /dev/null 2> "$WORK/err"
+    local rc=$?
+    local t1=$(date +%s.%N)
+    # the server renames the file once its writer has drained
+    for _ in $(seq 50); do
+        [ -f "$WORK/root/out.bin" ] && break
+        sleep 0.1
+    done
+    kill $srv 2>/dev/null
+    wait $srv 2>/dev/null
+    if [ $rc -ne 0 ] || ! cmp -s "$WORK/in.bin" "$WORK/root/out.bin"; then
+        echo fail
+        return
+    fi
+    local resent=$(sed -n 's/.* \([0-9]*\) resent.*/\1/p' "$WORK/err" | head -1)
+    echo "$(awk "BEGIN { print $t1 - $t0 }") ${resent:-0}"
+}
+
+# median <droppc> [client options]: median seconds and resent packets over REPS runs
+median() {
+    local out=()
+    for _ in $(seq "$REPS"); do out+=("$(run "$@")"); done
+    printf "%s\n" "${out[@]}" | grep -v fail | sort -n | awk '{ t[NR] = $1; r[NR] = $2 } END { if (NR) print t[int((NR + 1) / 2)], r[int((NR + 1) / 2)]; else print "fail" }'
+}
+
+printf "%-6s | %12s %8s | %12s %8s %8s\n" "loss%" "plain Mbit/s" "resent" "FEC Mbit/s" "resent" "gain"
+for loss in $LOSSES; do
+    read -r t_plain r_plain <<< "$(median "$loss")"
+    read -r t_fec r_fec <<< "$(median "$loss" -F)"
+    g_plain=-
+    g_fec=-
+    gain=-
+    [ "$t_plain" != fail ] && g_plain=$(awk "BEGIN { printf \"%.1f\", $SIZE * 8 / $t_plain / 1e6 }")
+    [ "$t_fec" != fail ] && g_fec=$(awk "BEGIN { printf \"%.1f\", $SIZE * 8 / $t_fec / 1e6 }")
+    [ "$g_plain" != - ] && [ "$g_fec" != - ] && gain=$(awk "BEGIN { printf \"%.2fx\", $t_plain / $t_fec }")
+    printf "%-6s | %12s %8s | %12s %8s %8s\n" "$loss" "$g_plain" "${r_plain:--}" "$g_fec" "${r_fec:--}" "$gain"
+done
@@ -0,0 +1,54 @@
+#!/bin/bash
+# tree_vs_files.sh — a directory of small files, one client run per file against one directory transfer
+#
+# usage: bench/tree_vs_files.sh [nfiles] [file_bytes] [mss] [winsz]
+# Runs from the lab4 directory after make. Files are spread over 100 directories.
+
+NFILES=${1:-2000}
+FSIZE=${2:-2000}
+MSS=${3:-1400}
+WINSZ=${4:-64}
+PORT=${PORT:-19293}
+BIN=${BIN:-bin}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+for ((i = 0; i < NFILES; i++)); do
+    d="$WORK/src/d$((i % 100))"
+    [ -d "$d" ] || mkdir -p "$d"
+    head -c "$FSIZE" /dev/urandom > "$d/f$i"
+done
+echo "127.0.0.1 $PORT" > "$WORK/servaddr.conf"
+
+# run <per-file|tree>: seconds to get every file of src under root/out
+run() {
+    rm -rf "$WORK/root"
+    mkdir -p "$WORK/root"
+    "$BIN/myserver" "$PORT" 0 "$WORK/root" > /dev/null 2>&1 &
+    local srv=$!
+    sleep 0.2
+    local t0=$(date +%s.%N) rc=0
+    if [ "$1" = tree ]; then
+        timeout 600 "$BIN/myclient" 1 "$WORK/servaddr.conf" "$MSS" "$WINSZ" "$WORK/src" out > /dev/null 2>&1 || rc=1
+    else
+        (cd "$WORK/src" && find . -type f -printf '%P\n') | while read -r f; do
+            timeout 60 "$BIN/myclient" 1 "$WORK/servaddr.conf" "$MSS" "$WINSZ" "$WORK/src/$f" "out/$f" > /dev/null 2>&1 || exit 1
+        done || rc=1
+    fi
+    local t1=$(date +%s.%N)
+    sleep 0.3
+    kill $srv 2>/dev/null
+    wait $srv 2>/dev/null
+    if [ $rc -ne 0 ] || ! diff -r "$WORK/src" "$WORK/root/out" > /dev/null; then
+        echo fail
+        return
+    fi
+    awk "BEGIN { printf \"%.3f\", $t1 - $t0 }"
+}
+
+t_files=$(run per-file)
+t_tree=$(run tree)
+speedup=-
+[ "$t_files" != fail ] && [ "$t_tree" != fail ] && speedup=$(awk "BEGIN { printf \"%.1fx\", $t_files / $t_tree }")
+printf "%8s x %6s B | %12s | %12s | %8s\n" files size "per-file s" "directory s" speedup
+printf "%8d x %6d B | %12s | %12s | %8s\n" "$NFILES" "$FSIZE" "$t_files" "$t_tree" "$speedup"
@@ -0,0 +1,94 @@
+#!/bin/bash
+# workers_pps.sh — server packet rate against receive worker count (-n), several clients at once
+#
+# usage: bench/workers_pps.sh [file_bytes] [mss] [winsz]
+# Runs from the lab4 directory after make. WORKERS picks the worker counts
+# (default 1, 2, 4, ... up to the core count) and CLIENTS how many clients
+# send at once (default 8); each client port hashes to one worker, so a few
+# workers may get more clients than others. Rates come from the server's -s
+# lines, summed over the run and divided by its length. Lost datagrams cost a
+# whole timeout, so each row is the run with the median total of REPS runs.
+
+FSIZE=${1:-20000000}
+MSS=${2:-1400}
+WINSZ=${3:-64}
+CLIENTS=${CLIENTS:-8}
+REPS=${REPS:-3}
+PORT=${PORT:-19500}
+BIN=${BIN:-bin}
+if [ -z "$WORKERS" ]; then
+    WORKERS=1
+    for ((n = 2; n <= $(nproc); n *= 2)); do WORKERS="$WORKERS $n"; done
+fi
+
+WORK=$(mktemp -d)
+SRV=
+cleanup() {
+    [ -n "$SRV" ] && kill "$SRV" 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+head -c "$FSIZE" /dev/urandom > "$WORK/in.bin"
+echo "127.0.0.1 $PORT" > "$WORK/servaddr.conf"
+
+# run <workers>: seconds, total pkt/s and pkt/s of each worker, or "fail"
+run() {
+    local n=$1
+    rm -rf "$WORK/root"
+    mkdir -p "$WORK/root"
+    "$BIN/myserver" -n "$n" -s "$PORT" 0 "$WORK/root" > /dev/null 2> "$WORK/stats" &
+    SRV=$!
+    sleep 0.5
+    local pids=() rc=0
+    local t0=$(date +%s.%N)
+    for ((c = 0; c < CLIENTS; c++)); do
+        timeout 300 "$BIN/myclient" 1 "$WORK/servaddr.conf" "$MSS" "$WINSZ" "$WORK/in.bin" "out$c.bin" \
+            > /dev/null 2>&1 &
+        pids+=($!)
+    done
+    for p in "${pids[@]}"; do wait "$p" || rc=1; done
+    local t1=$(date +%s.%N)
+    # one more stats line covers the last second; the server renames each
+    # file once its writer has drained
+    sleep 1.2
+    for _ in $(seq 50); do
+        [ "$(ls "$WORK/root" | grep -c '^out[0-9]*\.bin$')" -ge "$CLIENTS" ] && break
+        sleep 0.1
+    done
+    kill "$SRV" 2>/dev/null
+    wait "$SRV" 2>/dev/null
+    SRV=
+    for ((c = 0; c < CLIENTS; c++)); do
+        cmp -s "$WORK/in.bin" "$WORK/root/out$c.bin" || rc=1
+    done
+    if [ $rc -ne 0 ]; then
+        echo fail
+        return
+    fi
+    # <time>, STATS, <workers>, <total>, <per worker>...
+    awk -F', ' -v secs="$(awk "BEGIN { print $t1 - $t0 }")" -v n="$n" '
+        $2 == "STATS" { total += $4; for (i = 1; i <= n; i++) w[i] += $(4 + i) }
+        END {
+            printf "%.2f %.0f", secs, total / secs
+            for (i = 1; i <= n; i++) printf " %.0f", w[i] / secs
+            printf "\n"
+        }' "$WORK/stats"
+}
+
+# median <workers>: the run with the median total pkt/s over REPS runs
+median() {
+    local out=()
+    for _ in $(seq "$REPS"); do out+=("$(run "$@")"); done
+    printf "%s\n" "${out[@]}" | grep -v fail | sort -n -k2 | awk '{ l[NR] = $0 } END { if (NR) print l[int((NR + 1) / 2)]; else print "fail" }'
+}
+
+printf "%7s | %7s | %12s | %s\n" workers seconds "total pkt/s" "pkt/s per worker"
+for n in $WORKERS; do
+    read -r secs total per <<< "$(median "$n")"
+    if [ "$secs" = fail ]; then
+        printf "%7s | %7s | %12s |\n" "$n" fail -
+        continue
+    fi
+    printf "%7s | %7s | %12s | %s\n" "$n" "$secs" "$total" "$per"
+done
@@ -0,0 +1,253 @@
+// delta.c — block signatures (server) and delta encoding (client)
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <endian.h>
+#include <pthread.h>
+
+#include "delta.h"
+#include "xxh64.h"
+
+#define SIGN_BATCH 64              // blocks read at a time by a signing thread
+#define SIGN_MIN_BLOCKS 256        // fewer than this per thread is not worth a thread
+#define LITERAL_CHUNK (1u << 30)
+
+uint32_t delta_block_size(off_t size) {
+    uint32_t b = ((uint32_t)sqrt((double)size) + 1023) & ~1023u;
+    if (b < DELTA_MIN_BLOCK) b = DELTA_MIN_BLOCK;
+    if (b > DELTA_MAX_BLOCK) b = DELTA_MAX_BLOCK;
+    return b;
+}
+
+uint32_t delta_weak(const unsigned char *p, size_t len) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; ++i) {
+        a += p[i];
+        b += (uint32_t)(len - i) * p[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+static void put_sig(unsigned char *sig, const unsigned char *block, size_t len) {
+    uint32_t weak = htobe32(delta_weak(block, len));
+    uint64_t strong = htobe64(xxh64(block, len, 0));
+    memcpy(sig, &weak, 4);
+    memcpy(sig + 4, &strong, 8);
+}
+
+struct sign_job {
+    int fd;
+    uint32_t block, first, last;
+    unsigned char *sigs;
+    int rc;
+    pthread_t thread;
+};
+
+static void *sign_range(void *arg) {
+    struct sign_job *j = arg;
+    unsigned char *buf = malloc((size_t)j->block * SIGN_BATCH);
+    if (!buf) {
+        j->rc = -1;
+        return NULL;
+    }
+    for (uint32_t b = j->first; b < j->last && j->rc == 0;) {
+        uint32_t n = j->last - b < SIGN_BATCH ? j->last - b : SIGN_BATCH;
+        size_t want = (size_t)n * j->block, got = 0;
+        while (got < want) {
+            ssize_t r = pread(j->fd, buf + got, want - got, (off_t)b * j->block + got);
+            if (r <= 0) {
+                if (r == 0) errno = EIO;
+                j->rc = -1;
+                break;
+            }
+            got += r;
+        }
+        for (uint32_t i = 0; i < n && j->rc == 0; ++i)
+            put_sig(j->sigs + (size_t)(b + i) * SIG_SIZE, buf + (size_t)i * j->block, j->block);
+        b += n;
+    }
+    free(buf);
+    return NULL;
+}
+
+int delta_sign(int fd, uint32_t block, uint32_t nblocks, unsigned char *sigs, int nthreads) {
+    if (nthreads > (int)(nblocks / SIGN_MIN_BLOCKS)) nthreads = nblocks / SIGN_MIN_BLOCKS;
+    if (nthreads < 1) nthreads = 1;
+    struct sign_job jobs[nthreads];
+    for (int t = 0; t < nthreads; ++t) {
+        jobs[t] = (struct sign_job){ .fd = fd, .block = block, .sigs = sigs,
+                                     .first = (uint64_t)nblocks * t / nthreads,
+                                     .last = (uint64_t)nblocks * (t + 1) / nthreads };
+    }
+    // Thread 0's share runs here; a thread that fails to start does its share inline too
+    for (int t = 1; t < nthreads; ++t)
+        if (pthread_create(&jobs[t].thread, NULL, sign_range, &jobs[t]) != 0) {
+            sign_range(&jobs[t]);
+            jobs[t].thread = 0;
+        }
+    sign_range(&jobs[0]);
+    int rc = jobs[0].rc;
+    for (int t = 1; t < nthreads; ++t) {
+        if (jobs[t].thread) pthread_join(jobs[t].thread, NULL);
+        if (jobs[t].rc) rc = -1;
+    }
+    return rc;
+}
+
+struct op_buf {
+    unsigned char *p;
+    size_t len, cap;
+    int failed;
+};
+
+static void op_put(struct op_buf *o, const void *data, size_t len) {
+    if (o->failed) return;
+    if (o->len + len > o->cap) {
+        size_t cap = o->cap ? o->cap : 4096;
+        while (cap < o->len + len) cap *= 2;
+        unsigned char *p = realloc(o->p, cap);
+        if (!p) {
+            o->failed = 1;
+            return;
+        }
+        o->p = p;
+        o->cap = cap;
+    }
+    memcpy(o->p + o->len, data, len);
+    o->len += len;
+}
+
+static void op_literal(struct op_buf *o, const unsigned char *data, size_t len, struct delta_stats *st) {
+    st->literal += len;
+    while (len > 0) {
+        uint32_t n = len < LITERAL_CHUNK ? len : LITERAL_CHUNK;
+        unsigned char op[5] = { DELTA_LITERAL };
+        uint32_t net = htobe32(n);
+        memcpy(op + 1, &net, 4);
+        op_put(o, op, 5);
+        op_put(o, data, n);
+        data += n;
+        len -= n;
+    }
+}
+
+static void op_copy(struct op_buf *o, uint32_t first, uint32_t count) {
+    if (count == 0) return;
+    unsigned char op[9] = { DELTA_COPY };
+    uint32_t f = htobe32(first), c = htobe32(count);
+    memcpy(op + 1, &f, 4);
+    memcpy(op + 5, &c, 4);
+    op_put(o, op, 9);
+}
+
+static inline uint32_t slot_of(uint32_t weak, uint32_t mask) {
+    return ((weak ^ (weak >> 16)) * 0x9E3779B1u) & mask;
+}
+
+unsigned char *delta_encode(const unsigned char *data, size_t size, const unsigned char *sigs,
+                            uint32_t nblocks, uint32_t block, size_t *out_len, struct delta_stats *st) {
+    struct op_buf o = { 0 };
+    memset(st, 0, sizeof(*st));
+
+    // Open-addressed table of block index + 1 by rolling checksum
+    uint32_t mask = 0, *table = NULL, *weak = NULL;
+    uint64_t *strong = NULL;
+    if (nblocks > 0 && size >= block) {
+        uint32_t cap = 16;
+        while (cap < 2 * nblocks) cap *= 2;
+        mask = cap - 1;
+        table = calloc(cap, sizeof(*table));
+        weak = malloc(nblocks * sizeof(*weak));
+        strong = malloc(nblocks * sizeof(*strong));
+        if (!table || !weak || !strong) {
+            free(table);
+            free(weak);
+            free(strong);
+            return NULL;
+        }
+        for (uint32_t i = 0; i < nblocks; ++i) {
+            memcpy(&weak[i], sigs + (size_t)i * SIG_SIZE, 4);
+            memcpy(&strong[i], sigs + (size_t)i * SIG_SIZE + 4, 8);
+            weak[i] = be32toh(weak[i]);
+            strong[i] = be64toh(strong[i]);
+            uint32_t s = slot_of(weak[i], mask);
+            while (table[s]) s = (s + 1) & mask;
+            table[s] = i + 1;
+        }
+    }
+
+    size_t lit = 0, p = 0;
+    uint32_t run_first = 0, run_count = 0;
+    uint32_t a = 0, b = 0;
+    int rolled = 0;
+    while (table && p + block <= size) {
+        if (!rolled) {
+            uint32_t w = delta_weak(data + p, block);
+            a = w & 0xffff;
+            b = w >> 16;
+            rolled = 1;
+        }
+        uint32_t w = (a & 0xffff) | (b << 16);
+        int64_t match = -1;
+        int have_strong = 0;
+        uint64_t h = 0;
+        // The block after the last match comes first, so unchanged runs stay one op
+        uint32_t next = run_first + run_count;
+        if (run_count && p == lit && next < nblocks && weak[next] == w) {
+            h = xxh64(data + p, block, 0);
+            have_strong = 1;
+            if (h == strong[next]) match = next;
+        }
+        for (uint32_t s = slot_of(w, mask); match < 0 && table[s]; s = (s + 1) & mask) {
+            uint32_t i = table[s] - 1;
+            if (weak[i] != w) continue;
+            if (!have_strong) {
+                h = xxh64(data + p, block, 0);
+                have_strong = 1;
+            }
+            if (h == strong[i]) match = i;
+        }
+
+        if (match >= 0) {
+            if (p > lit) {
+                op_copy(&o, run_first, run_count);
+                op_literal(&o, data + lit, p - lit, st);
+                run_first = match;
+                run_count = 1;
+            } else if (run_count && (uint32_t)match == run_first + run_count) {
+                run_count++;
+            } else {
+                op_copy(&o, run_first, run_count);
+                run_first = match;
+                run_count = 1;
+            }
+            st->copied += block;
+            st->blocks++;
+            p += block;
+            lit = p;
+            rolled = 0;
+            continue;
+        }
+        if (p + block < size) {
+            uint32_t out = data[p], in = data[p + block];
+            a += in - out;
+            b += a - block * out;
+        }
+        p++;
+    }
+    op_copy(&o, run_first, run_count);
+    op_literal(&o, data + lit, size - lit, st);
+
+    free(table);
+    free(weak);
+    free(strong);
+    if (o.failed) {
+        free(o.p);
+        return NULL;
+    }
+    *out_len = o.len;
+    return o.p ? o.p : malloc(1);
+}
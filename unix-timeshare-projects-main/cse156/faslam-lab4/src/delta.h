@@ -0,0 +1,47 @@
+// delta.h — rsync-style block signatures and delta encoding for lab4
+//
+// The server signs the copy of a file it already holds: one rolling checksum
+// and one XXH64 per full block. The client slides the rolling checksum over
+// the new file one byte at a time, confirms candidates with XXH64 and sends a
+// stream of ops instead of the file:
+//
+//   'L' len(be32) <len bytes>       literal bytes
+//   'C' first(be32) count(be32)     count blocks of the old copy from block first
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DELTA_MIN_BLOCK 1024
+#define DELTA_MAX_BLOCK 65536
+#define SIG_SIZE 12          // rolling checksum (be32) + XXH64 (be64)
+#define SIG_PER_PACKET 100
+#define DELTA_LITERAL 'L'
+#define DELTA_COPY 'C'
+#define DELTA_OP_MAX 9
+
+struct delta_stats {
+    size_t literal;          // bytes sent as they are
+    size_t copied;           // bytes taken from the old copy
+    uint32_t blocks;         // old blocks referenced
+};
+
+// Block size for an old copy of size bytes: about sqrt(size), in 1 KiB steps
+uint32_t delta_block_size(off_t size);
+
+// rsync's rolling checksum of one block
+uint32_t delta_weak(const unsigned char *p, size_t len);
+
+// Sign the full blocks of fd into sigs (nblocks * SIG_SIZE bytes, wire order),
+// splitting them across up to nthreads threads. Returns -1 on a read error.
+int delta_sign(int fd, uint32_t block, uint32_t nblocks, unsigned char *sigs, int nthreads);
+
+// Ops that turn the old copy described by sigs into data[0, size). Returns the
+// malloc'd stream and its length in *out_len, NULL when out of memory.
+unsigned char *delta_encode(const unsigned char *data, size_t size, const unsigned char *sigs,
+                            uint32_t nblocks, uint32_t block, size_t *out_len, struct delta_stats *st);
+
+#endif
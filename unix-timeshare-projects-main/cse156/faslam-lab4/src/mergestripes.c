@@ -0,0 +1,147 @@
+// mergestripes.c — rebuild a striped lab4 transfer from its stripe files
+//
+// Each stripe <outfile>.s<i> is a sparse file holding its extents at their real
+// offsets, described by <outfile>.s<i>.manifest. The extents of all stripes
+// must cover the file exactly once; the result is renamed into place only then.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+
+#define COPY_CHUNK (1 << 20)
+
+struct extent {
+    long long off;
+    long long len;
+    int stripe;
+};
+
+int by_offset(const void *a, const void *b) {
+    const struct extent *x = a, *y = b;
+    return x->off < y->off ? -1 : x->off > y->off;
+}
+
+int copy_range(int in, int out, long long off, long long len, unsigned char *buf) {
+    while (len > 0) {
+        size_t n = len < COPY_CHUNK ? (size_t)len : COPY_CHUNK;
+        ssize_t r = pread(in, buf, n, off);
+        if (r <= 0) {
+            if (r == 0) errno = EIO;
+            return -1;
+        }
+        if (pwrite(out, buf, r, off) != r) return -1;
+        off += r;
+        len -= r;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <outfile> <stripe>...\n", argv[0]);
+        return 1;
+    }
+
+    int nstripes = argc - 2;
+    char **stripes = argv + 2;
+    struct extent *extents = NULL;
+    int n = 0, cap = 0;
+    unsigned long long size = 0, id = 0;
+
+    for (int i = 0; i < nstripes; ++i) {
+        char manifest[4096];
+        snprintf(manifest, sizeof(manifest), "%s.manifest", stripes[i]);
+        FILE *f = fopen(manifest, "r");
+        if (!f) {
+            perror(manifest);
+            return 1;
+        }
+        unsigned long long s_size, s_id;
+        if (fscanf(f, "%llu %llx", &s_size, &s_id) != 2) {
+            fprintf(stderr, "Malformed manifest %s\n", manifest);
+            return 1;
+        }
+        if (i > 0 && (s_size != size || s_id != id)) {
+            fprintf(stderr, "%s belongs to a different transfer\n", stripes[i]);
+            return 1;
+        }
+        size = s_size;
+        id = s_id;
+
+        long long off, len;
+        while (fscanf(f, "%lld %lld", &off, &len) == 2) {
+            if (n == cap) {
+                cap = cap ? cap * 2 : 256;
+                extents = realloc(extents, cap * sizeof(*extents));
+                if (!extents) {
+                    perror("realloc");
+                    return 1;
+                }
+            }
+            extents[n].off = off;
+            extents[n].len = len;
+            extents[n].stripe = i;
+            n++;
+        }
+        fclose(f);
+    }
+
+    qsort(extents, n, sizeof(*extents), by_offset);
+    unsigned long long covered = 0;
+    for (int i = 0; i < n; ++i) {
+        if ((unsigned long long)extents[i].off != covered) {
+            fprintf(stderr, "Bytes %llu-%lld are %s\n", covered, extents[i].off,
+                    (unsigned long long)extents[i].off > covered ? "missing" : "in two stripes");
+            return 1;
+        }
+        covered += extents[i].len;
+    }
+    if (covered != size) {
+        fprintf(stderr, "Bytes %llu-%llu are missing\n", covered, size);
+        return 1;
+    }
+
+    char part[4096];
+    snprintf(part, sizeof(part), "%s.%016llx.part", argv[1], id);
+    int out = open(part, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        perror("open outfile");
+        return 1;
+    }
+    if (size > 0 && fallocate(out, 0, 0, size) < 0 && ftruncate(out, size) < 0) {
+        perror("ftruncate");
+        return 1;
+    }
+
+    int *fds = calloc(nstripes, sizeof(int));
+    unsigned char *buf = malloc(COPY_CHUNK);
+    if (!fds || !buf) {
+        perror("malloc");
+        return 1;
+    }
+    for (int i = 0; i < nstripes; ++i) {
+        fds[i] = open(stripes[i], O_RDONLY);
+        if (fds[i] < 0) {
+            perror(stripes[i]);
+            return 1;
+        }
+    }
+    for (int i = 0; i < n; ++i) {
+        if (copy_range(fds[extents[i].stripe], out, extents[i].off, extents[i].len, buf) < 0) {
+            perror(stripes[extents[i].stripe]);
+            return 1;
+        }
+    }
+    if (fsync(out) < 0 || close(out) < 0 || rename(part, argv[1]) < 0) {
+        perror("write outfile");
+        return 1;
+    }
+
+    printf("Merged %llu bytes from %d extents in %d stripes\n", size, n, nstripes);
+    return 0;
+}
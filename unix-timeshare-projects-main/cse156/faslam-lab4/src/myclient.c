@@ -2,6 +2,7 @@
 // Changes: meta[pkt_len++] = ... → meta[pkt_len] = ...; pkt_len++;
 // and window[idx][full_len++] = ... → window[idx][full_len] = ...; full_len++;
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,24 +11,98 @@
 #include <errno.h>
 #include <time.h>
 #include <pthread.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 #include <libgen.h>
+#include <endian.h>
+#include <getopt.h>
+#include <math.h>
+#include <linux/net_tstamp.h>
 
-#define HEADER_SIZE 9
+#include "packet.h"
+#include "xor.h"
+#include "delta.h"
+#include "lz4.h"
+#include "bundle.h"
+#include "filehash.h"
+#include "trace.h"
+#include "ring.h"
+#include "pmtu.h"
+#include "pktio.h"
+
+#define HEADER_SIZE PKT_HEADER
 #define MAX_PACKET_SIZE 32768
 #define MAX_RETRIES 5
 #define TIMEOUT_SEC 3
+#define TIMEOUT_NS (TIMEOUT_SEC * 1000000000ULL)
 #define DEADLINE_SEC 30
 #define TYPE_META 0x2
 #define TYPE_DATA 0x1
-#define CRUZID_LEN 7
-#define MAX_SERVERS 10
-
-const char* CRUZID = "faslam:";
+#define TYPE_ACK 0x3
+#define TYPE_PARITY 0x4
+#define TYPE_SIG 0x5
+#define TYPE_FIN 0x7
+#define MAX_SACK 8
+#define SACK_RANGE 16        // first and last seq of a range the server holds
+#define DUP_THRESH 3
+#define BLACKHOLE_RETRIES 1  // timeouts of the oldest packet before an auto MSS is probed again
+#define PROBE_MIN_WAIT_MS 20
+#define META_FIXED 17        // transfer id (8) + file size (8) + flags (1)
+#define META_FRESH 0x1       // reject the server's resume offer
+#define META_STRIPE 0x2      // DATA payloads carry their file offset
+#define META_CHAIN 0x4       // the servers to forward to follow the fixed fields
+#define META_FEC 0x8         // parity follows; the server keeps recent payloads
+#define META_DELTA 0x10      // DATA carries delta ops against the server's old copy
+#define SIG_WAIT_MS 200      // quiet time before missing signatures are asked for again
+#define META_LZ4 0x20        // DATA payloads are self-contained compressed frames
+#define META_BUNDLE 0x40     // DATA is a directory tree as bundle records
+#define META_HASH 0x80       // a FIN with the file hash follows the last ACK
+#define FIN_REPLY 9          // verdict (1) + the server's file hash (8)
+#define FIN_OK 1
+#define FIN_MISMATCH 2
+#define FIN_ERROR 3
+#define FIN_UNKNOWN 4
+#define HASH_THREADS 8       // threads hashing the input, at most one per core
+#define HASH_POLL_NS 1000000 // how often a finished flow checks for the hash
+#define COMP_HDR 3           // frame kind (1) + raw length (2)
+#define COMP_RAW 0
+#define COMP_LZ4 1
+#define COMP_ALIGN 65536     // frames never straddle this, so resume offsets start a frame
+#define COMP_MAX_RAW 65535
+#define COMP_MIN_MSS 256     // below this a frame saves too little to be worth it
+#define COMP_PROBE 16        // after this many raw frames in a row, try only every 16th
+#define COMP_ARENA (4 << 20)
+#define COMP_CHUNK 4096      // frames per block of the frame table
+#define COMP_LEAD (32 << 20) // raw bytes the compressor may run ahead of the slowest flow
+#define COMP_POLL_NS 1000000 // how often a flow waiting on the compressor looks again
+#define FEC_HDR 6            // block size (2) + XOR of payload lengths (4)
+#define FEC_MIN_K 4
+#define FEC_MAX_K 32
+#define STRIPE_PREFIX 8
+#define HOP_SIZE 6           // IPv4 address + port, network order
+#define PACE_BURST 2         // packets that may leave back to back after a pause
+#define PACE_GAIN 1.25       // auto rate: this much above one window per RTT
+#define TXTIME_AHEAD_NS 2000000  // how far ahead departures are handed to fq
+#define BURST_GAP_NS 10000   // closer departures than this count as one burst
+#define CHAIN_STALL_SEC (4 * TIMEOUT_SEC)  // three lost retransmissions in a row
+#define EXTENT_SIZE (1 << 20)
+#define MAX_SERVERS 256     // the hop count of a chain META is one byte
+#define MAX_FLOWS 1024
+#define MAX_WINSZ 65536     // the most packets a server holds out of order (its REORDER_MAX)
+#define EVENT_BATCH 64
+#define FLOW_RUNNING 0
+#define FLOW_DONE 1
+#define FLOW_FAILED 2
 
 char *rfc3339_time() {
     static char buf[64];
@@ -40,155 +115,1572 @@ char *rfc3339_time() {
     return buf;
 }
 
-unsigned char checksum(const unsigned char *data, int len) {
-    unsigned long sum = 0;
-    for (int i = 0; i < len; ++i) {
-        sum += (unsigned char)data[i];
-        if (sum & 0xFFFF0000) {
-            sum &= 0xFFFF;
-            sum++;
-        }
-    }
-    return (unsigned char)(sum & 0xFF);
-}
+// Input file mapped once in main() and shared read-only by every replica thread
+struct shared_file {
+    const unsigned char *base;
+    size_t size;
+    uint64_t id;  // same for every attempt at the same file, so servers can resume
+};
+
+// One window slot: the packet header lives here, the payload stays in the mapping
+struct slot {
+    unsigned char hdr[PKT_PREFIX + STRIPE_PREFIX + COMP_HDR];
+    int hdr_len;
+    unsigned char trailer[TRAILER_SIZE];
+    const unsigned char *data;
+    int data_len;
+    int retries;
+    int resent;   // no RTT sample from it once it went out twice
+    uint64_t sent_ns;
+    int sacked;   // the server holds it out of order
+    int missed;   // ACKs that SACKed something above it while it was missing
+    uint64_t due_ns;
+    size_t off;   // raw file offset of a compressed frame
+};
+
+// Byte range of the input still to be sent by one stripe flow
+struct extent {
+    size_t off;
+    size_t end;
+};
+
+// Striping hands the file out in EXTENT_SIZE pieces to whichever flow asks
+// next, so faster flows carry more of it. Once the queue is empty an idle flow
+// takes the unsent back half of the largest extent still in progress.
+struct stripe_queue {
+    pthread_mutex_t lock;
+    size_t next_off;
+    size_t size;
+    int nflows;
+    struct extent cur[MAX_FLOWS];
+};
+
+// One packet's worth of the compressed stream: raw bytes [off, off + raw_len)
+// of the file, either LZ4-packed into the arena or sent as they are
+struct frame {
+    size_t off;
+    uint16_t raw_len;
+    uint16_t wire_len;
+    uint8_t kind;
+    const unsigned char *data;
+};
+
+// Compressed frames packed back to back; end is the raw offset just past the
+// last frame published from it
+struct comp_arena {
+    unsigned char *data;
+    size_t used, end;
+};
+
+// The file cut into frames by a worker thread ahead of the senders. Frames are
+// shared by every replica and never move once published. The compressor stays
+// within lead raw bytes of the slowest flow, and frames and arenas go once
+// every flow has ACKed past them, so memory does not grow with the file.
+struct comp_stream {
+    pthread_mutex_t lock;
+    pthread_cond_t room;       // a flow moved on, so the compressor may too
+    const struct shared_file *src;
+    size_t max_wire;           // payload room for a frame after COMP_HDR
+    size_t lead;
+    struct frame **chunks;     // frame i is chunks[i / COMP_CHUNK][i % COMP_CHUNK]
+    size_t nchunks, first_chunk;  // chunks below first_chunk are freed
+    size_t nframes, produced;  // produced: raw bytes cut into frames so far
+    int done, stop;
+    size_t pos[MAX_FLOWS];     // raw offset each flow still needs frames from, SIZE_MAX once it needs none
+    int nflows;
+    struct comp_arena *arenas; // oldest first; the last one is being filled
+    int narenas;
+    unsigned char *spare_arena;
+    struct frame *spare_chunk;
+};
+
+// Hash of the input (filehash.h), taken by its own thread while the flows
+// send and read by each of them once the server has every byte
+struct file_digest {
+    const struct shared_file *src;
+    int nthreads;
+    int done;
+    uint64_t value;
+};
+
+// Quorum run (-q): success once k of the n replicas hold the whole file. The
+// parent process waits on notify_fd and exits with the outcome then; this one
+// carries on with the replicas still behind, paced to share budget.
+struct quorum {
+    pthread_mutex_t lock;
+    int k, n;
+    int done, failed;
+    int reached;
+    int code;                  // exit code of the first replica to fail
+    double budget;             // bytes per ns for all lagging replicas, 0 for no limit
+    int notify_fd;             // -1 once the parent has its answer
+    uint64_t start_ns;
+};
 
 struct thread_args {
     char ip[INET_ADDRSTRLEN];
     int port;
     int mss;
+    int mss_auto;                // mss was probed; probe again when big packets vanish
     int winsz;
-    char file_path[1024];
+    const struct shared_file *src;
     char rel_path[1024];
+    struct stripe_queue *queue;  // NULL when replicating the whole file
+    int flow;
+    unsigned char hops[MAX_SERVERS * HOP_SIZE];  // chain behind this server
+    int nhops;
+    int failed;                  // the chain stalled and was given up on
+    double pace_mbps;            // 0 sends as fast as the window opens
+    int pace_auto;               // derive the rate from winsz * mss / srtt
+    int fec;
+    int delta;
+    struct comp_stream *comp;    // NULL unless -z
+    int tree;                    // src is a bundle of the directory infile
+    struct file_digest *digest;  // NULL when the servers cannot check a whole file
+    struct quorum *quorum;       // NULL unless -q; a failure then ends only this flow
+    int fail_code;
 };
 
-void* send_file_thread(void* arg) {
-    struct thread_args *args = (struct thread_args*)arg;
-    FILE *fp = fopen(args->file_path, "rb");
-    if (!fp) {
-        perror("fopen");
-        return NULL;
+// XOR parity over a block of k consecutive DATA payloads (stripe prefix
+// included), sent after the block's last packet. The server can rebuild any
+// one missing payload of the block from it without waiting for a timeout.
+// k follows the loss the flow sees: one parity per 1 / (2 * loss) packets,
+// between FEC_MIN_K and FEC_MAX_K.
+struct fec_block {
+    unsigned char hdr[PKT_PREFIX + FEC_HDR];
+    unsigned char *parity;
+    size_t parity_len;  // longest payload in the block
+    uint32_t len_xor;
+    uint64_t first;     // seq of the block's first packet
+    int n, k;
+    double loss;        // EWMA of resends per packet, sampled per block
+    long packets, resends;
+    long sent;
+};
+
+// Token bucket kept as the earliest time the next packet may leave. With fq
+// on the way out, departures go to the kernel as SO_TXTIME stamps; otherwise
+// the send loop waits for them itself.
+struct pacer {
+    double rate;        // bytes per ns, 0 while unpaced
+    uint64_t next_ns;
+    uint64_t burst_ns;  // PACE_BURST packets' worth of idle credit
+    int txtime;
+    uint64_t srtt_ns;
+    double cwnd;        // auto rate: packets per RTT, halved on a timeout
+    uint64_t cut_ns;
+    // departure statistics for the closing report
+    uint64_t last_ns;
+    double gap_sum, gap_sq;
+    long packets, resends, gaps;
+    int burst, max_burst;
+};
+
+// FNV-1a over the destination name, size and mtime of the input
+uint64_t transfer_id(const char *outfile, const struct stat *st) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const unsigned char *parts[3] = { (const unsigned char *)outfile, (const unsigned char *)&st->st_size,
+                                      (const unsigned char *)&st->st_mtim };
+    size_t lens[3] = { strlen(outfile), sizeof(st->st_size), sizeof(st->st_mtim) };
+    for (int p = 0; p < 3; ++p)
+        for (size_t i = 0; i < lens[p]; ++i) {
+            h ^= parts[p][i];
+            h *= 0x100000001b3ULL;
+        }
+    return h;
+}
+
+// Next piece of at most max bytes for this flow; returns 0 once nothing is left.
+size_t stripe_next(struct stripe_queue *q, int flow, size_t max, size_t *off) {
+    pthread_mutex_lock(&q->lock);
+    struct extent *e = &q->cur[flow];
+    if (e->off >= e->end && q->next_off < q->size) {
+        e->off = q->next_off;
+        e->end = q->next_off + EXTENT_SIZE < q->size ? q->next_off + EXTENT_SIZE : q->size;
+        q->next_off = e->end;
+    } else if (e->off >= e->end) {
+        int victim = -1;
+        size_t most = 2 * max;
+        for (int i = 0; i < q->nflows; ++i) {
+            if (i != flow && q->cur[i].end - q->cur[i].off > most) {
+                most = q->cur[i].end - q->cur[i].off;
+                victim = i;
+            }
+        }
+        if (victim >= 0) {
+            struct extent *v = &q->cur[victim];
+            size_t half = (v->end - v->off) / 2 / max * max;
+            e->end = v->end;
+            e->off = v->end - half;
+            v->end = e->off;
+            fprintf(stderr, "Flow %d took bytes %zu-%zu from flow %d\n", flow, e->off, e->end, victim);
+        }
     }
 
-    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    struct sockaddr_in servaddr;
-    memset(&servaddr, 0, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(args->port);
-    inet_pton(AF_INET, args->ip, &servaddr.sin_addr);
-    socklen_t addrlen = sizeof(servaddr);
-
-    char meta[2048];
-    meta[0] = TYPE_META;
-    int net_seq = htonl(0);
-    int net_len = htonl(strlen(args->rel_path));
-    memcpy(meta + 1, &net_seq, 4);
-    memcpy(meta + 5, &net_len, 4);
-    memcpy(meta + HEADER_SIZE, CRUZID, CRUZID_LEN);
-    memcpy(meta + HEADER_SIZE + CRUZID_LEN, args->rel_path, strlen(args->rel_path));
-    int pkt_len = HEADER_SIZE + CRUZID_LEN + strlen(args->rel_path);
-    meta[pkt_len] = checksum((unsigned char *)meta, pkt_len);
-    pkt_len++;
-    sendto(sockfd, meta, pkt_len, 0, (struct sockaddr *)&servaddr, addrlen);
-
-    char window[args->winsz][MAX_PACKET_SIZE];
-    int lens[args->winsz], retries[args->winsz];
-    time_t timers[args->winsz];
-
-    int base = 1, nextsn = 1, finished = 0;
-    time_t start_time = time(NULL);
-
-    while (!finished) {
-        while (nextsn < base + args->winsz) {
-            int idx = nextsn % args->winsz;
-            size_t data_len = fread(window[idx] + HEADER_SIZE + CRUZID_LEN, 1,
-                args->mss - HEADER_SIZE - CRUZID_LEN - 1, fp);
-            if (data_len == 0 && feof(fp)) break;
-
-            window[idx][0] = TYPE_DATA;
-            int net_seq = htonl(nextsn);
-            int net_len = htonl(data_len);
-            memcpy(window[idx] + 1, &net_seq, 4);
-            memcpy(window[idx] + 5, &net_len, 4);
-            memcpy(window[idx] + HEADER_SIZE, CRUZID, CRUZID_LEN);
-            int full_len = HEADER_SIZE + CRUZID_LEN + data_len;
-            window[idx][full_len] = checksum((unsigned char*)window[idx], full_len);
-            full_len++;
-
-            sendto(sockfd, window[idx], full_len, 0, (struct sockaddr*)&servaddr, addrlen);
-            lens[idx] = full_len;
-            timers[idx] = time(NULL);
-            retries[idx] = 0;
-            printf("%s, %d, %s, %d, DATA, %d, %d, %d, %d\n", rfc3339_time(), args->port, args->ip, args->port, nextsn, base, nextsn, base + args->winsz);
-            nextsn++;
+    size_t n = e->end - e->off;
+    if (n > max) n = max;
+    *off = e->off;
+    e->off += n;
+    pthread_mutex_unlock(&q->lock);
+    return n;
+}
+
+int build_meta(char *meta, const struct shared_file *src, int flags, const struct thread_args *args) {
+    const char *rel_path = args->rel_path;
+    int rel_len = strlen(rel_path);
+    int chain_len = args->nhops ? 1 + args->nhops * HOP_SIZE : 0;
+    if (args->nhops) flags |= META_CHAIN;
+    pkt_put_prefix((unsigned char *)meta, TYPE_META, 0, META_FIXED + chain_len + rel_len);
+    uint64_t id = htobe64(src->id), size = htobe64(src->size);
+    memcpy(meta + PKT_PREFIX, &id, 8);
+    memcpy(meta + PKT_PREFIX + 8, &size, 8);
+    meta[PKT_PREFIX + 16] = flags;
+    if (args->nhops) {
+        meta[PKT_PREFIX + META_FIXED] = args->nhops;
+        memcpy(meta + PKT_PREFIX + META_FIXED + 1, args->hops, args->nhops * HOP_SIZE);
+    }
+    memcpy(meta + PKT_PREFIX + META_FIXED + chain_len, rel_path, rel_len);
+    int pkt_len = PKT_PREFIX + META_FIXED + chain_len + rel_len;
+    pkt_seal((unsigned char *)meta, pkt_len);
+    return pkt_len + TRAILER_SIZE;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void pace_set_rate(struct pacer *p, double bytes_per_ns, int mss) {
+    p->rate = bytes_per_ns;
+    p->burst_ns = bytes_per_ns > 0 ? PACE_BURST * mss / bytes_per_ns : 0;
+}
+
+// Auto rate: cwnd packets per smoothed RTT. cwnd starts at the window, is
+// halved at most once per RTT when a packet times out and grows back by about
+// one packet per RTT, so a receiver that drops bursts gets a gentler stream.
+void pace_auto_update(struct pacer *p, int mss) {
+    if (p->srtt_ns > 0) pace_set_rate(p, PACE_GAIN * p->cwnd * mss / p->srtt_ns, mss);
+}
+
+// ns until the next packet may be sent, 0 when it may go now
+uint64_t pace_wait(const struct pacer *p, uint64_t now) {
+    uint64_t ahead = p->txtime ? TXTIME_AHEAD_NS : 0;
+    if (p->rate <= 0 || p->next_ns <= now + ahead) return 0;
+    return p->next_ns - now - ahead;
+}
+
+// Charge len bytes to the bucket; returns the departure time for the packet.
+uint64_t pace_charge(struct pacer *p, uint64_t now, size_t len) {
+    uint64_t depart = now;
+    if (p->rate > 0) {
+        if (p->next_ns + p->burst_ns < now) p->next_ns = now - p->burst_ns;
+        if (p->txtime && p->next_ns > now) depart = p->next_ns;
+        p->next_ns += len / p->rate;
+    }
+    if (p->packets++ > 0) {
+        double gap = depart > p->last_ns ? depart - p->last_ns : 0;
+        p->gap_sum += gap;
+        p->gap_sq += gap * gap;
+        p->gaps++;
+        p->burst = gap < BURST_GAP_NS ? p->burst + 1 : 1;
+    } else {
+        p->burst = 1;
+    }
+    if (p->burst > p->max_burst) p->max_burst = p->burst;
+    p->last_ns = depart;
+    return depart;
+}
+
+// SO_TXTIME only delays packets under the fq qdisc, so use it only when fq is
+// the system default and the socket accepts it.
+int pace_try_txtime(int sockfd) {
+    char qdisc[32] = "";
+    FILE *f = fopen("/proc/sys/net/core/default_qdisc", "r");
+    if (!f) return 0;
+    if (!fgets(qdisc, sizeof(qdisc), f)) qdisc[0] = '\0';
+    fclose(f);
+    if (strncmp(qdisc, "fq\n", 3) != 0) return 0;
+    struct sock_txtime cfg = { .clockid = CLOCK_MONOTONIC, .flags = 0 };
+    return setsockopt(sockfd, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg)) == 0;
+}
+
+void fec_add(struct fec_block *f, uint64_t seq, const struct slot *s, const unsigned char *data) {
+    size_t prefix = s->hdr_len - PKT_PREFIX;
+    if (f->n == 0) {
+        f->first = seq;
+        f->parity_len = 0;
+        f->len_xor = 0;
+    }
+    size_t len = prefix + s->data_len;
+    if (len > f->parity_len) {
+        memset(f->parity + f->parity_len, 0, len - f->parity_len);
+        f->parity_len = len;
+    }
+    xor_into(f->parity, s->hdr + PKT_PREFIX, prefix);
+    xor_into(f->parity + prefix, data, s->data_len);
+    f->len_xor ^= len;
+    f->n++;
+}
+
+// Send the parity of the block so far and pick k for the next one.
+void fec_send(struct fec_block *f, int sockfd, const struct sockaddr_in *servaddr, struct pacer *p) {
+    unsigned char *h = f->hdr;
+    pkt_put_prefix(h, TYPE_PARITY, f->first, FEC_HDR + f->parity_len);
+    uint16_t net_k = htons(f->n);
+    uint32_t net_lx = htonl(f->len_xor);
+    memcpy(h + PKT_PREFIX, &net_k, 2);
+    memcpy(h + PKT_PREFIX + 2, &net_lx, 4);
+    unsigned char trailer[TRAILER_SIZE];
+    pkt_put_trailer(trailer, crc32c(crc32c(0, h, sizeof(f->hdr)), f->parity, f->parity_len));
+
+    // Always copied, never MSG_ZEROCOPY: the parity buffer is reused as soon
+    // as the next block starts
+    struct iovec iov[3] = {
+        { .iov_base = h, .iov_len = sizeof(f->hdr) },
+        { .iov_base = f->parity, .iov_len = f->parity_len },
+        { .iov_base = trailer, .iov_len = TRAILER_SIZE },
+    };
+    struct msghdr msg = { .msg_name = (void *)servaddr, .msg_namelen = sizeof(*servaddr), .msg_iov = iov, .msg_iovlen = 3 };
+    pace_charge(p, now_ns(), sizeof(f->hdr) + f->parity_len + TRAILER_SIZE);
+    sendmsg(sockfd, &msg, 0);
+    f->sent++;
+    f->n = 0;
+
+    double sample = p->packets > f->packets ? (double)(p->resends - f->resends) / (p->packets - f->packets) : 0;
+    f->loss = (7 * f->loss + sample) / 8;
+    f->packets = p->packets;
+    f->resends = p->resends;
+    f->k = f->loss > 0 ? (int)(1 / (2 * f->loss)) : FEC_MAX_K;
+    if (f->k < FEC_MIN_K) f->k = FEC_MIN_K;
+    if (f->k > FEC_MAX_K) f->k = FEC_MAX_K;
+}
+
+// Lowest position any flow still needs frames from; called with the lock held
+size_t comp_low(const struct comp_stream *c) {
+    size_t low = SIZE_MAX;
+    for (int i = 0; i < c->nflows; ++i)
+        if (c->pos[i] < low) low = c->pos[i];
+    return low;
+}
+
+// Room for len compressed bytes in the current arena. A full one is replaced
+// by a new arena, or by one that every flow has ACKed past.
+unsigned char *comp_reserve(struct comp_stream *c, size_t len) {
+    if (c->narenas > 0 && c->arenas[c->narenas - 1].used + len <= COMP_ARENA)
+        return c->arenas[c->narenas - 1].data + c->arenas[c->narenas - 1].used;
+    pthread_mutex_lock(&c->lock);
+    size_t low = comp_low(c);
+    pthread_mutex_unlock(&c->lock);
+    while (c->narenas > 0 && c->arenas[0].end <= low) {
+        if (c->spare_arena) free(c->arenas[0].data);
+        else c->spare_arena = c->arenas[0].data;
+        memmove(c->arenas, c->arenas + 1, --c->narenas * sizeof(*c->arenas));
+    }
+    struct comp_arena *a = realloc(c->arenas, (c->narenas + 1) * sizeof(*a));
+    unsigned char *data = c->spare_arena ? c->spare_arena : malloc(COMP_ARENA);
+    if (!a || !data) {
+        perror("malloc");
+        exit(1);
+    }
+    c->spare_arena = NULL;
+    c->arenas = a;
+    a[c->narenas++] = (struct comp_arena){ .data = data };
+    return data;
+}
+
+// Append frame f, freeing the chunks of the table every flow is past; called
+// with the lock held
+void comp_publish(struct comp_stream *c, const struct frame *f) {
+    size_t ci = c->nframes / COMP_CHUNK;
+    if (c->nframes % COMP_CHUNK == 0) {
+        size_t low = comp_low(c);
+        while (c->first_chunk < ci) {
+            const struct frame *last = &c->chunks[c->first_chunk][COMP_CHUNK - 1];
+            if (last->off + last->raw_len > low) break;
+            if (c->spare_chunk) free(c->chunks[c->first_chunk]);
+            else c->spare_chunk = c->chunks[c->first_chunk];
+            c->chunks[c->first_chunk++] = NULL;
+        }
+        if (ci >= c->nchunks) {
+            size_t n = c->nchunks ? 2 * c->nchunks : 16;
+            struct frame **t = realloc(c->chunks, n * sizeof(*t));
+            if (!t) {
+                perror("malloc");
+                exit(1);
+            }
+            memset(t + c->nchunks, 0, (n - c->nchunks) * sizeof(*t));
+            c->chunks = t;
+            c->nchunks = n;
+        }
+        c->chunks[ci] = c->spare_chunk ? c->spare_chunk : malloc(COMP_CHUNK * sizeof(struct frame));
+        c->spare_chunk = NULL;
+        if (!c->chunks[ci]) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    c->chunks[ci][c->nframes++ % COMP_CHUNK] = *f;
+    c->produced = f->off + f->raw_len;
+    if (f->kind == COMP_LZ4) c->arenas[c->narenas - 1].end = c->produced;
+}
+
+// Cut the file into frames of as many raw bytes as still compress into one
+// payload, guessing from the ratio so far. A frame that does not shrink goes
+// raw; after COMP_PROBE of those in a row only every COMP_PROBE-th is tried.
+void *compress_thread(void *arg) {
+    struct comp_stream *c = arg;
+    const struct shared_file *src = c->src;
+    struct timespec cpu0, cpu1, wall0, wall1;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+    clock_gettime(CLOCK_MONOTONIC, &wall0);
+
+    size_t off = 0, wire = 0, nraw = 0;
+    double ratio = 2.0;
+    int raw_streak = 0;
+    while (off < src->size) {
+        // Wait while the slowest flow is a whole lead behind
+        pthread_mutex_lock(&c->lock);
+        size_t low;
+        while (!c->stop && (low = comp_low(c)) < off && off - low >= c->lead)
+            pthread_cond_wait(&c->room, &c->lock);
+        int stop = c->stop;
+        pthread_mutex_unlock(&c->lock);
+        if (stop) break;
+
+        size_t boundary = (off / COMP_ALIGN + 1) * COMP_ALIGN;
+        size_t limit = (boundary < src->size ? boundary : src->size) - off;
+        struct frame f = { .off = off, .kind = COMP_RAW };
+        if (raw_streak < COMP_PROBE || c->nframes % COMP_PROBE == 0) {
+            size_t want = c->max_wire * ratio * 0.9;
+            if (want < c->max_wire) want = c->max_wire;
+            for (int tries = 0; tries < 3; ++tries) {
+                if (want > limit) want = limit;
+                if (want > COMP_MAX_RAW) want = COMP_MAX_RAW;
+                unsigned char *out = comp_reserve(c, c->max_wire);
+                int n = lz4_compress(src->base + off, want, out, c->max_wire);
+                if (n > 0 && (size_t)n < want) {
+                    f.kind = COMP_LZ4;
+                    f.raw_len = want;
+                    f.wire_len = n;
+                    f.data = out;
+                    c->arenas[c->narenas - 1].used += n;
+                    ratio = 0.75 * ratio + 0.25 * want / n;
+                    break;
+                }
+                if (want <= c->max_wire) break;
+                want = want * 3 / 4 > c->max_wire ? want * 3 / 4 : c->max_wire;
+            }
+        }
+        if (f.kind == COMP_RAW) {
+            f.raw_len = f.wire_len = limit < c->max_wire ? limit : c->max_wire;
+            f.data = src->base + off;
+            raw_streak++;
+            nraw++;
+        } else {
+            raw_streak = 0;
         }
 
+        pthread_mutex_lock(&c->lock);
+        comp_publish(c, &f);
+        pthread_mutex_unlock(&c->lock);
+        off += f.raw_len;
+        wire += f.wire_len;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    c->done = 1;
+    pthread_mutex_unlock(&c->lock);
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+    clock_gettime(CLOCK_MONOTONIC, &wall1);
+    double cpu = (cpu1.tv_sec - cpu0.tv_sec) + (cpu1.tv_nsec - cpu0.tv_nsec) / 1e9;
+    double wall = (wall1.tv_sec - wall0.tv_sec) + (wall1.tv_nsec - wall0.tv_nsec) / 1e9;
+    fprintf(stderr, "Compressed %zu bytes into %zu (ratio %.2f) in %zu frames, %zu raw; %.3f s CPU, %.3f s wall, %.0f MB/s\n",
+            off, wire, wire ? (double)off / wire : 1.0, c->nframes, nraw, cpu, wall, cpu > 0 ? off / cpu / 1e6 : 0.0);
+    return NULL;
+}
+
+// Copy out frame i: 1 if it is there, 0 if it is not cut yet, -1 past the end
+// of the file. Never waits, so one engine thread can serve every flow.
+int comp_get(struct comp_stream *c, size_t i, struct frame *out) {
+    pthread_mutex_lock(&c->lock);
+    int got = i < c->nframes ? 1 : c->done ? -1 : 0;
+    if (got > 0) *out = c->chunks[i / COMP_CHUNK][i % COMP_CHUNK];
+    pthread_mutex_unlock(&c->lock);
+    return got;
+}
+
+// Index of the frame holding byte off, or -1 if it is not cut yet. The
+// caller's position must already be at or below off, so that it is still kept.
+long comp_find(struct comp_stream *c, size_t off) {
+    pthread_mutex_lock(&c->lock);
+    long found = -1;
+    if (off < c->produced) {
+        size_t lo = c->first_chunk * COMP_CHUNK, hi = c->nframes - 1;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo + 1) / 2;
+            if (c->chunks[mid / COMP_CHUNK][mid % COMP_CHUNK].off <= off) lo = mid;
+            else hi = mid - 1;
+        }
+        found = lo;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return found;
+}
+
+// Flow i needs no frames below pos any more; SIZE_MAX once it needs none
+void comp_move(struct comp_stream *c, int i, size_t pos) {
+    pthread_mutex_lock(&c->lock);
+    if (pos > c->pos[i]) {
+        c->pos[i] = pos;
+        pthread_cond_signal(&c->room);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Start cutting src into frames for nflows flows, each from byte 0
+int comp_open(struct comp_stream *c, const struct shared_file *src, size_t max_wire, size_t lead, int nflows,
+              pthread_t *thread) {
+    memset(c, 0, sizeof(*c));
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->room, NULL);
+    c->src = src;
+    c->max_wire = max_wire;
+    c->lead = lead;
+    c->nflows = nflows;
+    return pthread_create(thread, NULL, compress_thread, c) == 0 ? 0 : -1;
+}
+
+// Stop the compressor, which reports its stats, and release the frames
+void comp_close(struct comp_stream *c, pthread_t thread) {
+    if (!c) return;
+    pthread_mutex_lock(&c->lock);
+    c->stop = 1;
+    pthread_cond_signal(&c->room);
+    pthread_mutex_unlock(&c->lock);
+    pthread_join(thread, NULL);
+    for (size_t i = c->first_chunk; i < c->nchunks; ++i)
+        free(c->chunks[i]);
+    free(c->chunks);
+    free(c->spare_chunk);
+    for (int i = 0; i < c->narenas; ++i)
+        free(c->arenas[i].data);
+    free(c->arenas);
+    free(c->spare_arena);
+    pthread_cond_destroy(&c->room);
+    pthread_mutex_destroy(&c->lock);
+}
+
+void *digest_thread(void *arg) {
+    struct file_digest *d = arg;
+    uint64_t t0 = now_ns();
+    uint64_t value = file_hash_mem(d->src->base, d->src->size, d->nthreads);
+    double secs = (now_ns() - t0) / 1e9;
+    fprintf(stderr, "Hashed %zu bytes in %.3f s (%.2f GB/s, %d threads): %016llx\n", d->src->size, secs,
+            secs > 0 ? d->src->size / secs / 1e9 : 0.0, d->nthreads, (unsigned long long)value);
+    d->value = value;
+    __atomic_store_n(&d->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Signatures of the server's old copy: pushed right after the META reply, and
+// asked for again by packet index once SIG_WAIT_MS pass without a new one
+int fetch_signatures(int sockfd, const struct sockaddr_in *servaddr, const struct thread_args *args,
+                     uint32_t nblocks, unsigned char *sigs) {
+    int npkts = (nblocks + SIG_PER_PACKET - 1) / SIG_PER_PACKET, have = 0;
+    char *got = calloc(npkts ? npkts : 1, 1);
+    if (!got) return -1;
+    time_t last_progress = time(NULL);
+    while (have < npkts) {
         fd_set readfds;
-        struct timeval tv = {.tv_sec = 1, .tv_usec = 0};
         FD_ZERO(&readfds);
         FD_SET(sockfd, &readfds);
+        struct timeval tv = { .tv_sec = 0, .tv_usec = SIG_WAIT_MS * 1000 };
+        if (select(sockfd + 1, &readfds, NULL, NULL, &tv) > 0) {
+            unsigned char buf[HEADER_SIZE + SIG_PER_PACKET * SIG_SIZE + TRAILER_SIZE];
+            ssize_t rlen;
+            while ((rlen = recvfrom(sockfd, buf, sizeof(buf), MSG_DONTWAIT, NULL, NULL)) > 0) {
+                if (rlen < HEADER_SIZE + TRAILER_SIZE || !pkt_valid(buf, rlen) || PKT_TYPE(buf[0]) != TYPE_SIG) continue;
+                uint64_t idx = pkt_seq(buf);
+                if (idx >= (uint64_t)npkts || got[idx]) continue;
+                uint32_t first = (uint32_t)idx * SIG_PER_PACKET;
+                uint32_t n = nblocks - first < SIG_PER_PACKET ? nblocks - first : SIG_PER_PACKET;
+                if (rlen != HEADER_SIZE + (ssize_t)(n * SIG_SIZE) + TRAILER_SIZE) continue;
+                memcpy(sigs + (size_t)first * SIG_SIZE, buf + HEADER_SIZE, n * SIG_SIZE);
+                got[idx] = 1;
+                have++;
+                last_progress = time(NULL);
+            }
+            continue;
+        }
+        if (difftime(time(NULL), last_progress) > DEADLINE_SEC) {
+            free(got);
+            return -1;
+        }
+        for (int i = 0; i < npkts; ++i) {
+            if (got[i]) continue;
+            unsigned char req[PKT_PREFIX + TRAILER_SIZE];
+            pkt_put_prefix(req, TYPE_SIG, i, 0);
+            pkt_seal(req, PKT_PREFIX);
+            sendto(sockfd, req, sizeof(req), 0, (const struct sockaddr *)servaddr, sizeof(*servaddr));
+        }
+        fprintf(stderr, "IP %s port %d: asked again for %d of %d signature packets\n", args->ip, args->port, npkts - have, npkts);
+    }
+    free(got);
+    return 0;
+}
+
+ssize_t send_slot(struct pkt_tx *tx, struct slot *s, const struct sockaddr_in *servaddr, struct pacer *p) {
+    uint64_t now = now_ns();
+    uint64_t depart = pace_charge(p, now, s->hdr_len + s->data_len + TRAILER_SIZE);
+    char ctrl[CMSG_SPACE(sizeof(uint64_t))];
+    size_t ctrl_len = 0;
+    if (p->txtime) {
+        memset(ctrl, 0, sizeof(ctrl));
+        struct cmsghdr *cm = (struct cmsghdr *)ctrl;
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_TXTIME;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+        memcpy(CMSG_DATA(cm), &depart, sizeof(depart));
+        ctrl_len = sizeof(ctrl);
+    }
+    s->sent_ns = depart;
+    return pkt_sendv(tx, servaddr, s->hdr, s->hdr_len, s->data, s->data_len, s->trailer, ctrl, ctrl_len);
+}
+
+// One replica transfer, stepped by whichever engine runs it: flow_send() fills
+// the window, flow_input() takes replies and flow_timers() resends and checks
+// for completion. flow_deadline() says when it next needs a step.
+struct flow {
+    struct thread_args *args;
+    const struct shared_file *src;  // the file, or the delta cut from it
+    int sockfd;
+    struct pkt_tx tx;               // DATA sends on sockfd, zerocopy when large
+    struct sockaddr_in servaddr;
+    int meta_flags;
+    char meta[2048 + MAX_SERVERS * HOP_SIZE];
+    int meta_len;
+    int meta_acked, meta_retries;
+    uint64_t meta_due_ns;
+    struct comp_stream *comp;       // set once the server agrees to compression
+    size_t next_frame;              // SIZE_MAX: look up the frame at next_off
+    size_t comp_pos;                // last position reported to the compressor
+    int comp_wait;                  // the next frame is not cut yet
+    struct shared_file delta;
+    struct delta_stats dstats;
+    struct slot *window;
+    struct pacer pacer;
+    struct fec_block fec;
+    uint64_t base, nextsn;
+    int sent_all;
+    size_t next_off, prefix, max_data;
+    uint64_t rto_ns;                // no slot times out before this
+    uint64_t progress_ns, start_ns;
+    int state;
+    uint64_t due_ns;                // event engine: heap key and position
+    int heap_pos;
+    int verify;                     // the server holds the file until our FIN
+    int fin_verdict, fin_retries;
+    uint64_t fin_due_ns;
+    uint64_t server_digest;
+    struct xfer_stats stats;
+};
+
+// One CSV line, or with -T a binary trace event
+void flow_log(const struct flow *f, int type, const char *name, uint64_t seq) {
+    const struct thread_args *args = f->args;
+    if (trace_fd >= 0) trace_event(type, seq, f->base, f->nextsn, f->base + args->winsz, &f->servaddr);
+    else printf("%s, %d, %s, %d, %s, %llu, %llu, %llu, %llu\n", rfc3339_time(), args->port, args->ip, args->port, name,
+                (unsigned long long)seq, (unsigned long long)f->base, (unsigned long long)f->nextsn,
+                (unsigned long long)(f->base + args->winsz));
+}
+
+// Payload room in a DATA packet; parity carries FEC_HDR more bytes than the
+// payloads it covers
+size_t flow_max_data(const struct flow *f) {
+    const struct thread_args *args = f->args;
+    return args->mss - PKT_PREFIX - TRAILER_SIZE - f->prefix - (args->fec ? FEC_HDR : 0) -
+           (args->comp ? COMP_HDR : 0);
+}
+
+// Largest datagram between min and max that reaches the server, or -1.
+// wait_ms bounds each probe's round trip, 0 when the RTT is not known yet.
+int discover_mss(const struct thread_args *args, int min, int max, int wait_ms) {
+    struct pmtu_probe p = { .min = min, .max = max, .wait_ms = wait_ms, .build = pmtu_pkt_build,
+                            .match = pmtu_pkt_match, .ctx = (void *)PKT_FINGERPRINT };
+    p.peer.sin_family = AF_INET;
+    p.peer.sin_port = htons(args->port);
+    inet_pton(AF_INET, args->ip, &p.peer.sin_addr);
+    return pmtu_discover(&p);
+}
+
+// The oldest packet keeps timing out and nothing behind it was SACKed, as when
+// the path starts dropping datagrams of this size without an ICMP error.
+// Probe again and, if the path did shrink, send the window over in smaller
+// packets. Only a plain transfer can be cut up again like this: stripes,
+// frames and parity blocks are fixed once sent.
+int flow_reprobe(struct flow *f) {
+    struct thread_args *args = f->args;
+    if (!args->mss_auto || args->queue || args->fec || args->nhops || f->comp) return 0;
+    for (uint64_t i = f->base; i < f->nextsn; ++i)
+        if (f->window[i % args->winsz].sacked) return 0;
+    // The server drops an idle session, so the search has to be quick: each
+    // probe gets a few smoothed RTTs rather than the cold-start wait
+    int wait_ms = f->pacer.srtt_ns * 4 / 1000000;
+    if (wait_ms < PROBE_MIN_WAIT_MS) wait_ms = PROBE_MIN_WAIT_MS;
+    int mss = discover_mss(args, PKT_PREFIX + TRAILER_SIZE + 1, args->mss, wait_ms);
+    if (mss < 0 || mss >= args->mss) return 0;
+
+    fprintf(stderr, "Path to IP %s port %d shrank, MSS %d -> %d\n", args->ip, args->port, args->mss, mss);
+    // The slots from base on are about to be rewritten
+    pkt_tx_flush(&f->tx);
+    args->mss = mss;
+    f->max_data = flow_max_data(f);
+    f->next_off = f->window[f->base % args->winsz].data - f->src->base;
+    f->nextsn = f->base;
+    f->sent_all = 0;
+    f->rto_ns = UINT64_MAX;
+    return 1;
+}
+
+// Once the quorum holds the file, the replicas still behind catch up in the
+// background, splitting the budget evenly; a share grows as others finish.
+void quorum_throttle(struct flow *f) {
+    struct thread_args *args = f->args;
+    struct quorum *q = args->quorum;
+    if (!__atomic_load_n(&q->reached, __ATOMIC_ACQUIRE) || q->budget <= 0) return;
+    int lagging = q->n - __atomic_load_n(&q->done, __ATOMIC_RELAXED) - __atomic_load_n(&q->failed, __ATOMIC_RELAXED);
+    double share = q->budget / (lagging > 0 ? lagging : 1);
+    if (f->pacer.rate == share) return;
+    args->pace_auto = 0;
+    pace_set_rate(&f->pacer, share, args->mss);
+}
 
-        if (select(sockfd + 1, &readfds, NULL, NULL, &tv) > 0 && FD_ISSET(sockfd, &readfds)) {
-            char ackbuf[64];
-            recvfrom(sockfd, ackbuf, sizeof(ackbuf), 0, NULL, NULL);
-            int ack;
-            memcpy(&ack, ackbuf + 1, 4);
-            ack = ntohl(ack);
-            if (ack >= base) base = ack + 1;
-            printf("%s, %d, %s, %d, ACK, %d, %d, %d, %d\n", rfc3339_time(), args->port, args->ip, args->port, ack, base, nextsn, base + args->winsz);
+// Tell the waiting parent how the run went, once
+void quorum_notify(struct quorum *q, int code) {
+    if (q->notify_fd < 0) return;
+    unsigned char c = code;
+    if (write(q->notify_fd, &c, 1) < 0) perror("quorum notify");
+    close(q->notify_fd);
+    q->notify_fd = -1;
+}
+
+// A replica has finished or failed: report its completion latency and decide
+// the run as soon as the quorum is reached or can no longer be
+void quorum_report(struct flow *f) {
+    struct thread_args *args = f->args;
+    struct quorum *q = args->quorum;
+    double secs = (now_ns() - q->start_ns) / 1e9;
+    pthread_mutex_lock(&q->lock);
+    if (f->state == FLOW_DONE) {
+        __atomic_add_fetch(&q->done, 1, __ATOMIC_RELAXED);
+        fprintf(stderr, "IP %s port %d: replica complete after %.3f s (%d of %d)%s\n", args->ip, args->port, secs,
+                q->done, q->n, q->reached ? ", in the background" : "");
+    } else {
+        __atomic_add_fetch(&q->failed, 1, __ATOMIC_RELAXED);
+        if (!q->code) q->code = args->fail_code;
+        fprintf(stderr, "IP %s port %d: replica failed after %.3f s\n", args->ip, args->port, secs);
+    }
+    if (!q->reached && q->done >= q->k) {
+        __atomic_store_n(&q->reached, 1, __ATOMIC_RELEASE);
+        fprintf(stderr, "Quorum of %d of %d servers reached in %.3f s\n", q->k, q->n, secs);
+        quorum_notify(q, 0);
+    } else if (!q->reached && q->failed > q->n - q->k) {
+        fprintf(stderr, "Quorum of %d of %d servers out of reach: %d failed\n", q->k, q->n, q->failed);
+        quorum_notify(q, q->code);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Open the socket, send META and set up the window. Returns -1 if there is no
+// memory for the window; the flow is then left out.
+int flow_open(struct flow *f, struct thread_args *args) {
+    memset(f, 0, sizeof(*f));
+    f->args = args;
+    f->src = args->src;
+    f->start_ns = now_ns();
+    f->stats.start_ns = f->start_ns;
+    f->sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (f->sockfd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    f->servaddr.sin_family = AF_INET;
+    f->servaddr.sin_port = htons(args->port);
+    inet_pton(AF_INET, args->ip, &f->servaddr.sin_addr);
+    pkt_tx_init(&f->tx, f->sockfd, &f->servaddr);
+    // A probed size only holds while nothing fragments the packets
+    if (args->mss_auto) pmtu_set_df(f->sockfd);
+
+    // Stripes and chains start over every time; only this run knows which
+    // extents a stripe holds, and replicas down a chain cannot offer a resume
+    f->meta_flags = args->queue ? META_FRESH | META_STRIPE : args->nhops ? META_FRESH : 0;
+    if (args->fec) f->meta_flags |= META_FEC;
+    // A delta is cut against what the server holds now, so it never resumes
+    if (args->delta) f->meta_flags |= META_DELTA | META_FRESH;
+    if (args->comp) f->meta_flags |= META_LZ4;
+    if (args->tree) f->meta_flags |= META_BUNDLE | META_FRESH;
+    if (args->digest) f->meta_flags |= META_HASH;
+    f->delta.id = f->src->id;
+    f->meta_len = build_meta(f->meta, f->src, f->meta_flags, args);
+    sendto(f->sockfd, f->meta, f->meta_len, 0, (struct sockaddr *)&f->servaddr, sizeof(f->servaddr));
+    f->meta_due_ns = now_ns() + TIMEOUT_NS;
+
+    f->window = ring_alloc((size_t)args->winsz * sizeof(*f->window));
+    if (!f->window) {
+        perror("mmap window");
+        close(f->sockfd);
+        f->state = FLOW_FAILED;
+        args->fail_code = 1;
+        if (args->comp) comp_move(args->comp, args->flow, SIZE_MAX);
+        if (args->quorum) quorum_report(f);
+        return -1;
+    }
+
+    if (args->pace_mbps > 0) pace_set_rate(&f->pacer, args->pace_mbps / 8000.0, args->mss);
+    if (args->pace_mbps > 0 || args->pace_auto) f->pacer.txtime = pace_try_txtime(f->sockfd);
+    f->pacer.cwnd = args->winsz;
+
+    f->base = f->nextsn = 1;
+    f->prefix = args->queue ? STRIPE_PREFIX : 0;
+    f->max_data = flow_max_data(f);
+    f->fec.k = FEC_MAX_K;
+    if (args->fec && !(f->fec.parity = malloc(args->mss))) {
+        perror("malloc");
+        exit(1);
+    }
+    f->rto_ns = UINT64_MAX;
+    f->progress_ns = now_ns();
+    return 0;
+}
+
+// New DATA for as long as the window has room and the pacer allows
+void flow_send(struct flow *f) {
+    struct thread_args *args = f->args;
+    const struct shared_file *src = f->src;
+    f->comp_wait = 0;
+    while (f->meta_acked && !f->sent_all && f->nextsn < f->base + args->winsz && pace_wait(&f->pacer, now_ns()) == 0) {
+        struct slot *s = &f->window[f->nextsn % args->winsz];
+        size_t off, data_len;
+        struct frame fr;
+        if (f->comp) {
+            // The compressor may be behind, or held back by a slower flow;
+            // look again in COMP_POLL_NS rather than block the engine. An
+            // empty window waiting on it is not the server's silence.
+            if (f->next_frame == SIZE_MAX) {
+                long i = comp_find(f->comp, f->next_off);
+                if (i >= 0) f->next_frame = i;
+            }
+            int got = f->next_frame == SIZE_MAX ? 0 : comp_get(f->comp, f->next_frame, &fr);
+            if (got <= 0) {
+                f->comp_wait = got == 0;
+                if (f->base == f->nextsn) f->progress_ns = now_ns();
+                break;
+            }
+            f->next_frame++;
+            off = fr.off;
+            data_len = fr.wire_len;
+            f->next_off = fr.off + fr.raw_len;
+            f->sent_all = f->next_off >= src->size;
+        } else if (args->queue) {
+            // An empty piece is the end-of-stripe marker
+            data_len = stripe_next(args->queue, args->flow, f->max_data, &off);
+            if (data_len == 0) {
+                off = src->size;
+                f->sent_all = 1;
+            }
+        } else {
+            off = f->next_off;
+            data_len = src->size - f->next_off;
+            if (data_len > f->max_data) data_len = f->max_data;
+            f->next_off += data_len;
+            f->sent_all = f->next_off >= src->size;
+        }
+
+        s->hdr_len = pkt_put_prefix(s->hdr, TYPE_DATA, f->nextsn, f->prefix + (f->comp ? COMP_HDR : 0) + data_len);
+        if (args->queue) {
+            uint64_t net_off = htobe64(off);
+            memcpy(s->hdr + s->hdr_len, &net_off, STRIPE_PREFIX);
+            s->hdr_len += STRIPE_PREFIX;
+        }
+        s->data = src->base + off;
+        s->off = off;
+        if (f->comp) {
+            uint16_t raw_len = htons(fr.raw_len);
+            s->hdr[s->hdr_len] = fr.kind;
+            memcpy(s->hdr + s->hdr_len + 1, &raw_len, 2);
+            s->hdr_len += COMP_HDR;
+            s->data = fr.data;
+        }
+        uint32_t crc = crc32c(0, s->hdr, s->hdr_len);
+        pkt_put_trailer(s->trailer, crc32c(crc, s->data, data_len));
+        s->data_len = data_len;
+
+        send_slot(&f->tx, s, &f->servaddr, &f->pacer);
+        s->due_ns = now_ns() + TIMEOUT_NS;
+        if (s->due_ns < f->rto_ns) f->rto_ns = s->due_ns;
+        s->retries = 0;
+        s->resent = 0;
+        s->sacked = 0;
+        s->missed = 0;
+        flow_log(f, TRACE_DATA, "DATA", f->nextsn);
+        if (args->fec) {
+            fec_add(&f->fec, f->nextsn, s, s->data);
+            if (f->fec.n >= f->fec.k || f->sent_all) fec_send(&f->fec, f->sockfd, &f->servaddr, &f->pacer);
         }
+        f->nextsn++;
+    }
+}
+
+// A chain that stops making progress is given up on, so that main() can fall
+// back to sending to every server directly, and in a quorum run only this
+// replica is; anything else ends the client.
+void flow_fail(struct flow *f, int code) {
+    if (!f->args->nhops && !f->args->quorum) exit(code);
+    f->args->fail_code = code;
+    f->state = FLOW_FAILED;
+}
 
-        for (int i = base; i < nextsn; ++i) {
-            int idx = i % args->winsz;
-            if (difftime(time(NULL), timers[idx]) >= TIMEOUT_SEC) {
-                if (++retries[idx] > MAX_RETRIES) {
+// Drain every queued reply, not just the first one
+void flow_input(struct flow *f) {
+    struct thread_args *args = f->args;
+    unsigned char ackbuf[HEADER_SIZE + MAX_SACK * SACK_RANGE + TRAILER_SIZE];
+    ssize_t rlen;
+    // Zerocopy completions wake the engines like replies do
+    pkt_tx_reap(&f->tx);
+    while ((rlen = recvfrom(f->sockfd, ackbuf, sizeof(ackbuf), MSG_DONTWAIT, NULL, NULL)) > 0) {
+        if (rlen < HEADER_SIZE + TRAILER_SIZE || !pkt_valid(ackbuf, rlen)) continue;
+
+        // META reply: offset the server already holds and a CRC32C of the
+        // bytes just before it, then the old copy's block size and block
+        // count for a delta and the options the server took up.
+        int reply_len = rlen - HEADER_SIZE - TRAILER_SIZE;
+        if (PKT_TYPE(ackbuf[0]) == TYPE_META && !f->meta_acked && reply_len >= 16) {
+            uint32_t block = DELTA_MIN_BLOCK, nblocks = 0;
+            if (reply_len >= 24) {
+                memcpy(&block, ackbuf + HEADER_SIZE + 16, 4);
+                memcpy(&nblocks, ackbuf + HEADER_SIZE + 20, 4);
+                block = ntohl(block);
+                nblocks = ntohl(nblocks);
+            }
+            if (reply_len >= 25 && ackbuf[HEADER_SIZE + 24] & META_LZ4) f->comp = args->comp;
+            else if (args->comp) comp_move(args->comp, args->flow, SIZE_MAX);
+            f->verify = args->digest && reply_len >= 25 && ackbuf[HEADER_SIZE + 24] & META_HASH;
+            if (args->tree && (reply_len < 25 || !(ackbuf[HEADER_SIZE + 24] & META_BUNDLE))) {
+                fprintf(stderr, "IP %s port %d does not take directories\n", args->ip, args->port);
+                flow_fail(f, 3);
+                return;
+            }
+
+            // Delta: the ops are built against the old copy's signatures and
+            // sent through the window in place of the file
+            if (args->delta) {
+                unsigned char *sigs = malloc(nblocks ? (size_t)nblocks * SIG_SIZE : 1);
+                if (!sigs || block == 0 || fetch_signatures(f->sockfd, &f->servaddr, args, nblocks, sigs) < 0) {
+                    fprintf(stderr, "Cannot get block signatures from IP %s port %d\n", args->ip, args->port);
+                    free(sigs);
+                    flow_fail(f, 3);
+                    return;
+                }
+                f->delta.base = delta_encode(f->src->base, f->src->size, sigs, nblocks, block, &f->delta.size, &f->dstats);
+                free(sigs);
+                if (!f->delta.base) {
+                    perror("malloc");
+                    exit(1);
+                }
+                f->src = &f->delta;
+                f->next_off = 0;
+                f->sent_all = f->delta.size == 0;
+                f->meta_acked = 1;
+                f->progress_ns = now_ns();
+                continue;
+            }
+            // Resume only if our copy agrees with the server's tail, and with
+            // compression only where a frame starts
+            uint64_t off;
+            uint32_t tail_len, tail_crc;
+            memcpy(&off, ackbuf + HEADER_SIZE, 8);
+            memcpy(&tail_len, ackbuf + HEADER_SIZE + 8, 4);
+            memcpy(&tail_crc, ackbuf + HEADER_SIZE + 12, 4);
+            off = be64toh(off);
+            tail_len = ntohl(tail_len);
+            tail_crc = ntohl(tail_crc);
+            int frame_start = !f->comp || off % COMP_ALIGN == 0 || off >= f->src->size;
+            if (off == 0 || (off <= f->src->size && tail_len <= off && frame_start &&
+                             crc32c(0, f->src->base + off - tail_len, tail_len) == tail_crc)) {
+                if (off > 0) fprintf(stderr, "Resuming IP %s at byte %llu\n", args->ip, (unsigned long long)off);
+                f->next_off = off;
+                // flow_send() finds the frame once the compressor gets there
+                if (f->comp && off > 0) {
+                    f->next_frame = SIZE_MAX;
+                    f->comp_pos = off;
+                    comp_move(f->comp, args->flow, off);
+                }
+                f->sent_all = !args->queue && off >= f->src->size;
+                f->meta_acked = 1;
+                f->progress_ns = now_ns();
+            } else {
+                f->meta_len = build_meta(f->meta, f->src, f->meta_flags | META_FRESH, args);
+                sendto(f->sockfd, f->meta, f->meta_len, 0, (struct sockaddr *)&f->servaddr, sizeof(f->servaddr));
+                f->meta_due_ns = now_ns() + TIMEOUT_NS;
+            }
+            continue;
+        }
+        if (PKT_TYPE(ackbuf[0]) == TYPE_FIN) {
+            if (f->verify && !f->fin_verdict && reply_len >= FIN_REPLY) {
+                uint64_t digest;
+                memcpy(&digest, ackbuf + HEADER_SIZE + 1, 8);
+                f->server_digest = be64toh(digest);
+                f->fin_verdict = ackbuf[HEADER_SIZE] ? ackbuf[HEADER_SIZE] : FIN_UNKNOWN;
+            }
+            continue;
+        }
+        if (PKT_TYPE(ackbuf[0]) != TYPE_ACK || !f->meta_acked) continue;
+        uint64_t ack = pkt_seq(ackbuf);
+        uint32_t sack_len = pkt_len(ackbuf);
+        stats_ack(&f->stats, (int)(f->nextsn - f->base));
+        if (ack >= f->base && ack < f->nextsn) {
+            // RTT from the newest packet covered, unless it was resent
+            struct slot *acked = &f->window[ack % args->winsz];
+            if (!acked->resent) {
+                uint64_t now = now_ns(), rtt = now > acked->sent_ns ? now - acked->sent_ns : 0;
+                f->pacer.srtt_ns = f->pacer.srtt_ns ? (7 * f->pacer.srtt_ns + rtt) / 8 : rtt;
+                stats_rtt(&f->stats, rtt);
+            }
+            if (args->pace_auto) {
+                f->pacer.cwnd += (double)(ack - f->base + 1) / f->pacer.cwnd;
+                if (f->pacer.cwnd > args->winsz) f->pacer.cwnd = args->winsz;
+                pace_auto_update(&f->pacer, args->mss);
+            }
+            for (uint64_t i = f->base; i <= ack; ++i) f->stats.bytes += f->window[i % args->winsz].data_len;
+            f->base = ack + 1;
+            f->progress_ns = now_ns();
+            // Frames behind the oldest unACKed one are done with here
+            if (f->comp) {
+                size_t pos = f->base < f->nextsn ? f->window[f->base % args->winsz].off : f->next_off;
+                if (pos > f->comp_pos) {
+                    f->comp_pos = pos;
+                    comp_move(f->comp, args->flow, pos);
+                }
+            }
+        }
+
+        int nranges = sack_len / SACK_RANGE;
+        if (nranges > reply_len / SACK_RANGE) nranges = reply_len / SACK_RANGE;
+        uint64_t highest = 0;
+        for (int r = 0; r < nranges; ++r) {
+            uint64_t range[2];
+            memcpy(range, ackbuf + HEADER_SIZE + r * SACK_RANGE, SACK_RANGE);
+            uint64_t first = be64toh(range[0]), last = be64toh(range[1]);
+            if (first < f->base) first = f->base;
+            if (last >= f->nextsn) last = f->nextsn - 1;
+            for (uint64_t i = first; i <= last; ++i) f->window[i % args->winsz].sacked = 1;
+            if (last > highest) highest = last;
+        }
+
+        // Holes the server keeps reporting below a SACKed packet are resent
+        // right away instead of waiting for their timer.
+        for (uint64_t i = f->base; i < highest; ++i) {
+            struct slot *s = &f->window[i % args->winsz];
+            if (s->sacked || ++s->missed != DUP_THRESH) continue;
+            send_slot(&f->tx, s, &f->servaddr, &f->pacer);
+            s->due_ns = now_ns() + TIMEOUT_NS;
+            s->resent = 1;
+            f->pacer.resends++;
+            flow_log(f, TRACE_RETRANSMIT, "RETRANSMIT", i);
+        }
+        flow_log(f, TRACE_ACK, "ACK", ack);
+    }
+}
+
+// Every byte is ACKed and the server holds the file as a part file until it
+// hears the hash of what was meant to arrive. FIN carries it once the digest
+// thread is done, and goes again until the server's verdict comes back.
+void flow_fin(struct flow *f, uint64_t now) {
+    struct thread_args *args = f->args;
+    switch (f->fin_verdict) {
+    case 0:
+        break;
+    case FIN_MISMATCH:
+        fprintf(stderr, "IP %s port %d: file hash mismatch, sent %016llx, server wrote %016llx\n", args->ip,
+                args->port, (unsigned long long)args->digest->value, (unsigned long long)f->server_digest);
+        flow_fail(f, 5);
+        return;
+    case FIN_ERROR:
+        fprintf(stderr, "IP %s port %d could not move the file into place\n", args->ip, args->port);
+        flow_fail(f, 5);
+        return;
+    default:
+        fprintf(stderr, "IP %s port %d no longer holds the transfer\n", args->ip, args->port);
+        flow_fail(f, 5);
+        return;
+    }
+    if (!__atomic_load_n(&args->digest->done, __ATOMIC_ACQUIRE)) {
+        f->fin_due_ns = now + HASH_POLL_NS;
+        return;
+    }
+    if (now < f->fin_due_ns) return;
+    if (++f->fin_retries > MAX_RETRIES) {
+        fprintf(stderr, "Reached max re-transmission limit IP %s\n", args->ip);
+        flow_fail(f, 4);
+        return;
+    }
+    unsigned char fin[PKT_PREFIX + 8 + TRAILER_SIZE];
+    uint64_t digest = htobe64(args->digest->value);
+    pkt_put_prefix(fin, TYPE_FIN, 0, 8);
+    memcpy(fin + PKT_PREFIX, &digest, 8);
+    pkt_seal(fin, PKT_PREFIX + 8);
+    sendto(f->sockfd, fin, sizeof(fin), 0, (struct sockaddr *)&f->servaddr, sizeof(f->servaddr));
+    f->fin_due_ns = now + TIMEOUT_NS;
+}
+
+// META and DATA retransmissions, completion and the progress deadline
+void flow_timers(struct flow *f) {
+    struct thread_args *args = f->args;
+    uint64_t now = now_ns();
+    if (f->state != FLOW_RUNNING) return;
+    if (args->quorum) quorum_throttle(f);
+    if (!f->meta_acked && now >= f->meta_due_ns) {
+        if (++f->meta_retries > MAX_RETRIES) {
+            fprintf(stderr, "Reached max re-transmission limit IP %s\n", args->ip);
+            flow_fail(f, 4);
+            return;
+        }
+        sendto(f->sockfd, f->meta, f->meta_len, 0, (struct sockaddr *)&f->servaddr, sizeof(f->servaddr));
+        f->meta_due_ns = now + TIMEOUT_NS;
+    }
+
+    // The window is only walked once its earliest timer may have fired.
+    // Timed-out packets are paced too, so a lost window does not go out again
+    // as one burst.
+    if (now >= f->rto_ns) {
+        f->rto_ns = UINT64_MAX;
+        for (uint64_t i = f->base; i < f->nextsn; ++i) {
+            struct slot *s = &f->window[i % args->winsz];
+            if (s->sacked) continue;
+            if (s->due_ns <= now && pace_wait(&f->pacer, now_ns()) == 0) {
+                if (args->pace_auto && now - f->pacer.cut_ns > f->pacer.srtt_ns) {
+                    f->pacer.cwnd = f->pacer.cwnd / 2 > PACE_BURST ? f->pacer.cwnd / 2 : PACE_BURST;
+                    f->pacer.cut_ns = now;
+                    pace_auto_update(&f->pacer, args->mss);
+                }
+                if (++s->retries > MAX_RETRIES) {
                     fprintf(stderr, "Reached max re-transmission limit IP %s\n", args->ip);
-                    exit(4);
+                    flow_fail(f, 4);
+                    return;
                 }
-                sendto(sockfd, window[idx], lens[idx], 0, (struct sockaddr*)&servaddr, addrlen);
-                timers[idx] = time(NULL);
+                if (i == f->base && s->retries == BLACKHOLE_RETRIES && flow_reprobe(f)) return;
+                send_slot(&f->tx, s, &f->servaddr, &f->pacer);
+                s->due_ns = now_ns() + TIMEOUT_NS;
+                s->missed = 0;
+                s->resent = 1;
+                f->pacer.resends++;
                 fprintf(stderr, "Packet loss detected\n");
-                printf("%s, %d, %s, %d, RETRANSMIT, %d, %d, %d, %d\n", rfc3339_time(), args->port, args->ip, args->port, i, base, nextsn, base + args->winsz);
+                flow_log(f, TRACE_RETRANSMIT, "RETRANSMIT", i);
             }
+            if (s->due_ns < f->rto_ns) f->rto_ns = s->due_ns;
         }
+    }
+
+    if (f->meta_acked && f->sent_all && f->base == f->nextsn) {
+        if (!f->verify || f->fin_verdict == FIN_OK) f->state = FLOW_DONE;
+        else flow_fin(f, now);
+    } else if (now - f->progress_ns > (args->nhops ? CHAIN_STALL_SEC : DEADLINE_SEC) * 1000000000ULL) {
+        fprintf(stderr, "Cannot detect server IP %s port %d\n", args->ip, args->port);
+        flow_fail(f, 3);
+    }
+}
 
-        if (feof(fp) && base == nextsn) finished = 1;
-        if (difftime(time(NULL), start_time) > DEADLINE_SEC) {
-            fprintf(stderr, "Cannot detect server IP %s port %d\n", args->ip, args->port);
-            exit(3);
+// When the flow next needs attention if no reply comes in first
+uint64_t flow_deadline(const struct flow *f) {
+    const struct thread_args *args = f->args;
+    uint64_t now = now_ns(), paced = now + pace_wait(&f->pacer, now);
+    uint64_t due = f->progress_ns + (args->nhops ? CHAIN_STALL_SEC : DEADLINE_SEC) * 1000000000ULL;
+    if (!f->meta_acked && f->meta_due_ns < due) due = f->meta_due_ns;
+    if (f->rto_ns != UINT64_MAX) {
+        uint64_t rto = f->rto_ns > paced ? f->rto_ns : paced;
+        if (rto < due) due = rto;
+    }
+    if (f->meta_acked && !f->sent_all && !f->comp_wait && f->nextsn < f->base + args->winsz && paced < due) due = paced;
+    if (f->comp_wait && now + COMP_POLL_NS < due) due = now + COMP_POLL_NS;
+    if (f->verify && f->meta_acked && f->sent_all && f->base == f->nextsn && f->fin_due_ns < due) due = f->fin_due_ns;
+    return due;
+}
+
+// Closing report, or for a chain that was given up on just the cleanup
+void flow_close(struct flow *f) {
+    struct thread_args *args = f->args;
+    if (args->quorum) quorum_report(f);
+    if (f->state == FLOW_FAILED) {
+        args->failed = 1;
+    } else {
+        // Burstiness and loss as this flow saw them; compare runs with and without -r
+        struct pacer *p = &f->pacer;
+        double mean = p->gaps ? p->gap_sum / p->gaps : 0;
+        double var = p->gaps ? p->gap_sq / p->gaps - mean * mean : 0;
+        fprintf(stderr, "IP %s port %d: %ld packets, %ld resent (%.2f%%), rate %.1f Mbit/s%s, srtt %.3f ms, gap %.1f us (cv %.2f), longest burst %d\n",
+                args->ip, args->port, p->packets, p->resends,
+                p->packets ? 100.0 * p->resends / p->packets : 0.0,
+                p->rate * 8000.0, p->txtime ? " (SO_TXTIME)" : "", p->srtt_ns / 1e6,
+                mean / 1000, mean > 0 ? sqrt(var > 0 ? var : 0) / mean : 0.0, p->max_burst);
+        if (args->fec)
+            fprintf(stderr, "IP %s port %d: %ld parity packets, last k %d, loss estimate %.2f%%\n",
+                    args->ip, args->port, f->fec.sent, f->fec.k, 100 * f->fec.loss);
+        if (args->delta) {
+            size_t full = args->src->size;
+            fprintf(stderr, "IP %s port %d: delta %zu bytes for %zu (%.1f%% saved), %zu literal, %u blocks reused, done in %.3f s\n",
+                    args->ip, args->port, f->delta.size, full, full ? 100.0 * ((double)full - f->delta.size) / full : 0.0,
+                    f->dstats.literal, f->dstats.blocks, (now_ns() - f->start_ns) / 1e9);
         }
+        char who[64];
+        snprintf(who, sizeof(who), "IP %s port %d", args->ip, args->port);
+        f->stats.packets = p->packets;
+        f->stats.resends = p->resends;
+        stats_print(stderr, who, &f->stats, now_ns(), args->winsz);
+        if (f->tx.zc_sends)
+            fprintf(stderr, "IP %s port %d: %ld packets sent zerocopy, %ld of them copied by the kernel\n", args->ip,
+                    args->port, f->tx.zc_sends, f->tx.zc_copied);
     }
+    // The kernel may still hold pages of the delta or of frames
+    pkt_tx_flush(&f->tx);
+    if (args->comp) comp_move(args->comp, args->flow, SIZE_MAX);
+    free(f->fec.parity);
+    free((void *)f->delta.base);
+    ring_free(f->window, (size_t)args->winsz * sizeof(*f->window));
+    close(f->sockfd);
+}
 
-    fclose(fp);
-    close(sockfd);
+// Thread engine: one thread per flow, sleeping in ppoll() until a reply or
+// the flow's next deadline
+void* send_file_thread(void* arg) {
+    struct flow *f = malloc(sizeof(*f));
+    if (!f || flow_open(f, arg) < 0) {
+        free(f);
+        return NULL;
+    }
+    while (f->state == FLOW_RUNNING) {
+        flow_send(f);
+        uint64_t now = now_ns(), due = flow_deadline(f), wait = due > now ? due - now : 0;
+        struct timespec ts = { .tv_sec = wait / 1000000000ULL, .tv_nsec = wait % 1000000000ULL };
+        struct pollfd pfd = { .fd = f->sockfd, .events = POLLIN };
+        if (ppoll(&pfd, 1, &ts, NULL) > 0) flow_input(f);
+        flow_timers(f);
+    }
+    flow_close(f);
+    free(f);
     return NULL;
 }
 
+// Flows of the event loop as a binary min-heap on their next deadline
+struct flow_heap {
+    struct flow **v;
+    int n;
+};
+
+void heap_swap(struct flow_heap *h, int a, int b) {
+    struct flow *t = h->v[a];
+    h->v[a] = h->v[b];
+    h->v[b] = t;
+    h->v[a]->heap_pos = a;
+    h->v[b]->heap_pos = b;
+}
+
+// Restore the order around position i after its deadline changed
+void heap_fix(struct flow_heap *h, int i) {
+    while (i > 0 && h->v[i]->due_ns < h->v[(i - 1) / 2]->due_ns) {
+        heap_swap(h, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        int l = 2 * i + 1, m = i;
+        if (l < h->n && h->v[l]->due_ns < h->v[m]->due_ns) m = l;
+        if (l + 1 < h->n && h->v[l + 1]->due_ns < h->v[m]->due_ns) m = l + 1;
+        if (m == i) return;
+        heap_swap(h, i, m);
+        i = m;
+    }
+}
+
+void heap_remove(struct flow_heap *h, struct flow *f) {
+    int i = f->heap_pos;
+    heap_swap(h, i, --h->n);
+    if (i < h->n) heap_fix(h, i);
+}
+
+// Event engine: one thread owns every flow's socket through epoll and a single
+// timerfd armed for the earliest deadline in the heap, so a reply is handled
+// the moment it lands and an idle flow costs nothing between its deadlines.
+void run_event_loop(struct thread_args *args, int nflows) {
+    struct flow *flows = calloc(nflows, sizeof(*flows));
+    struct flow_heap heap = { .v = calloc(nflows, sizeof(struct flow *)), .n = 0 };
+    struct epoll_event events[EVENT_BATCH];
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (!flows || !heap.v || ep < 0 || tfd < 0) {
+        perror("event loop");
+        exit(1);
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(ep, EPOLL_CTL_ADD, tfd, &ev);
+
+    for (int i = 0; i < nflows; ++i) {
+        struct flow *f = &flows[i];
+        if (flow_open(f, &args[i]) < 0) continue;
+        ev.data.ptr = f;
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, f->sockfd, &ev) < 0) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+        f->due_ns = flow_deadline(f);
+        f->heap_pos = heap.n;
+        heap.v[heap.n++] = f;
+        heap_fix(&heap, f->heap_pos);
+    }
+
+    while (heap.n > 0) {
+        uint64_t due = heap.v[0]->due_ns;
+        struct itimerspec its = { .it_value = { .tv_sec = due / 1000000000ULL, .tv_nsec = due % 1000000000ULL } };
+        if (due == 0) its.it_value.tv_nsec = 1;
+        timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+
+        int n = epoll_wait(ep, events, EVENT_BATCH, -1);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < n; ++i) {
+            struct flow *f = events[i].data.ptr;
+            if (!f) {
+                uint64_t expirations;
+                if (read(tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) perror("timerfd");
+                continue;
+            }
+            if (f->state != FLOW_RUNNING) continue;
+            flow_input(f);
+            f->due_ns = 0;  // step it below, as if its deadline had come
+            heap_fix(&heap, f->heap_pos);
+        }
+
+        uint64_t now = now_ns();
+        while (heap.n > 0 && heap.v[0]->due_ns <= now) {
+            struct flow *f = heap.v[0];
+            flow_timers(f);
+            if (f->state == FLOW_RUNNING) flow_send(f);
+            if (f->state != FLOW_RUNNING) {
+                heap_remove(&heap, f);
+                epoll_ctl(ep, EPOLL_CTL_DEL, f->sockfd, NULL);
+                flow_close(f);
+                continue;
+            }
+            f->due_ns = flow_deadline(f);
+            heap_fix(&heap, 0);
+        }
+    }
+    close(tfd);
+    close(ep);
+    free(heap.v);
+    free(flows);
+}
+
+// Run flows args[0..nflows) to the end on the engine chosen with -e
+void run_flows(struct thread_args *args, int nflows, int event_loop) {
+    if (event_loop) {
+        run_event_loop(args, nflows);
+        return;
+    }
+    pthread_t *threads = calloc(nflows, sizeof(*threads));
+    if (!threads) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < nflows; ++i) {
+        if (pthread_create(&threads[i], NULL, send_file_thread, &args[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < nflows; ++i)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+// Client CPU time for the whole run against the bytes it pushed out
+void report_cpu(double mbytes) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    double cpu_ms = ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3 + ru.ru_stime.tv_sec * 1e3 + ru.ru_stime.tv_usec / 1e3;
+    fprintf(stderr, "CPU %.1f ms for %.2f MB, %.2f ms/MB\n", cpu_ms, mbytes, mbytes > 0 ? cpu_ms / mbytes : 0.0);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-S [-c conns] | -P | -q k [-b mbps]] [-r mbps|auto] [-F] [-D | -z] [-e] [-T trace] <servn> <servaddr.conf> <mss|auto> <winsz> <infile> <outfile>\n", prog);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 7) {
-        fprintf(stderr, "Usage: %s <servn> <servaddr.conf> <mss> <winsz> <infile> <outfile>\n", argv[0]);
+    int stripe = 0, conns = 1, chain = 0, pace_auto = 0;
+    double pace_mbps = 0;
+    int opt;
+    int fec = 0, delta = 0, compress = 0, event_loop = 0, quorum_k = 0;
+    double budget_mbps = 0;
+    static const struct option long_opts[] = {
+        { "quorum", required_argument, NULL, 'q' },
+        { "budget", required_argument, NULL, 'b' },
+        { NULL, 0, NULL, 0 },
+    };
+    while ((opt = getopt_long(argc, argv, "Sc:Pr:FDzeT:q:b:", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'q':
+            if ((quorum_k = atoi(optarg)) < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'b':
+            if ((budget_mbps = atof(optarg)) <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'T':
+            if (trace_open(optarg, TRACE_LAB4_CLIENT, 0) < 0) {
+                perror("open trace");
+                return 1;
+            }
+            break;
+        case 'e':
+            event_loop = 1;
+            break;
+        case 'z':
+            compress = 1;
+            break;
+        case 'D':
+            delta = 1;
+            break;
+        case 'F':
+            fec = 1;
+            break;
+        case 'r':
+            if (strcmp(optarg, "auto") == 0) {
+                pace_auto = 1;
+            } else if ((pace_mbps = atof(optarg)) <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'S':
+            stripe = 1;
+            break;
+        case 'P':
+            chain = 1;
+            break;
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 6 || (stripe && chain) || (delta && (stripe || chain)) ||
+        (compress && (stripe || delta)) || (quorum_k && (stripe || chain)) || (budget_mbps > 0 && !quorum_k)) {
+        usage(argv[0]);
         return 1;
     }
+    argv += optind - 1;
 
     int servn = atoi(argv[1]);
     if (servn <= 0 || servn > MAX_SERVERS) {
         fprintf(stderr, "Invalid server count (max %d)\n", MAX_SERVERS);
         return 1;
     }
+    if (quorum_k > servn) {
+        fprintf(stderr, "Quorum of %d needs at least that many servers\n", quorum_k);
+        return 1;
+    }
+    if (conns < 1 || (conns > 1 && !stripe) || servn * conns > MAX_FLOWS) {
+        fprintf(stderr, "Invalid connection count (striping only, max %d flows)\n", MAX_FLOWS);
+        return 1;
+    }
 
     char *conf_file = argv[2];
-    int mss = atoi(argv[3]);
+    int mss_auto = strcmp(argv[3], "auto") == 0;
+    int mss = mss_auto ? MAX_PACKET_SIZE : atoi(argv[3]);
     int winsz = atoi(argv[4]);
     char *infile = argv[5];
     char *outfile = argv[6];
 
-    int min_mss = HEADER_SIZE + CRUZID_LEN + 1;
+    int min_mss = PKT_PREFIX + TRAILER_SIZE + 1 + (stripe ? STRIPE_PREFIX : 0) + (fec ? FEC_HDR : 0);
     if (mss < min_mss) {
         fprintf(stderr, "Required minimum MSS is %d\n", min_mss);
         return 1;
     }
+    if (mss > MAX_PACKET_SIZE) {
+        fprintf(stderr, "Maximum MSS is %d\n", MAX_PACKET_SIZE);
+        return 1;
+    }
+    if (compress && mss < COMP_MIN_MSS) {
+        fprintf(stderr, "Compression needs an MSS of at least %d\n", COMP_MIN_MSS);
+        return 1;
+    }
+    if (winsz > MAX_WINSZ) {
+        fprintf(stderr, "Window capped at %d packets, the most a server holds out of order\n", MAX_WINSZ);
+        winsz = MAX_WINSZ;
+    }
+
+    // Map the input once; every replica sends straight out of the same pages
+    int infd = open(infile, O_RDONLY);
+    if (infd < 0) {
+        perror("open infile");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(infd, &st) < 0) {
+        perror("fstat infile");
+        return 1;
+    }
+    // A directory goes out as one stream of bundle records, staged in a
+    // temporary file
+    int tree = S_ISDIR(st.st_mode);
+    if (tree) {
+        if (stripe || delta) {
+            fprintf(stderr, "Directories cannot be striped or sent as a delta\n");
+            return 1;
+        }
+        struct bundle_stats bst;
+        int bundle_fd = bundle_stage(infile, &bst);
+        if (bundle_fd < 0 || fstat(bundle_fd, &st) < 0) {
+            perror("bundle infile");
+            return 1;
+        }
+        fprintf(stderr, "Bundled %u files (%llu bytes) and %u directories into %lld bytes\n", bst.files,
+                (unsigned long long)bst.bytes, bst.dirs, (long long)st.st_size);
+        close(infd);
+        infd = bundle_fd;
+    }
+    struct shared_file src = { .base = NULL, .size = st.st_size, .id = transfer_id(outfile, &st) };
+    if (src.size > 0) {
+        void *map = mmap(NULL, src.size, PROT_READ, MAP_SHARED, infd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap infile");
+            return 1;
+        }
+        madvise(map, src.size, MADV_SEQUENTIAL);
+        src.base = map;
+    }
+    close(infd);
 
-    struct thread_args args[MAX_SERVERS];
-    pthread_t threads[MAX_SERVERS];
+    struct thread_args *args = calloc(MAX_FLOWS, sizeof(*args));
+    if (!args) {
+        perror("calloc");
+        return 1;
+    }
+    // Every flow holds a socket; hundreds of replicas need more than the usual 1024
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)servn * conns + 64) {
+        rl.rlim_cur = rl.rlim_max < (rlim_t)servn * conns + 64 ? rl.rlim_max : (rlim_t)servn * conns + 64;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
 
     FILE *f = fopen(conf_file, "r");
     if (!f) {
@@ -210,16 +1702,176 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    // mss auto: each server gets the largest datagram that reaches it
+    // unfragmented. Compressed frames are shared by every replica and a chain
+    // forwards packets as they are, so those take the smallest.
+    int path_mss[MAX_SERVERS];
     for (int i = 0; i < servn; ++i) {
-        strncpy(args[i].file_path, infile, sizeof(args[i].file_path));
-        strncpy(args[i].rel_path, outfile, sizeof(args[i].rel_path));
-        args[i].mss = mss;
-        args[i].winsz = winsz;
-        pthread_create(&threads[i], NULL, send_file_thread, &args[i]);
+        path_mss[i] = mss;
+        if (!mss_auto) continue;
+        if ((path_mss[i] = discover_mss(&args[i], min_mss, MAX_PACKET_SIZE, 0)) < 0) {
+            fprintf(stderr, "No path MTU probe answered by IP %s port %d\n", args[i].ip, args[i].port);
+            return 3;
+        }
+        fprintf(stderr, "MSS %d for IP %s port %d\n", path_mss[i], args[i].ip, args[i].port);
+    }
+    for (int i = 0; mss_auto && i < servn; ++i)
+        if (path_mss[i] < mss) mss = path_mss[i];
+    if (compress && mss < COMP_MIN_MSS) {
+        fprintf(stderr, "Compression needs an MSS of at least %d\n", COMP_MIN_MSS);
+        return 1;
     }
 
-    for (int i = 0; i < servn; ++i)
-        pthread_join(threads[i], NULL);
+    // Quorum: the process that was started waits only until k replicas are
+    // done, or too many have failed for that, and exits with the outcome. The
+    // transfers run in a child, forked before any thread exists, which keeps
+    // going in the background until the lagging replicas finish too.
+    static struct quorum quorum = { .lock = PTHREAD_MUTEX_INITIALIZER, .notify_fd = -1 };
+    if (quorum_k) {
+        int pipefd[2];
+        if (pipe(pipefd) < 0) {
+            perror("pipe");
+            return 1;
+        }
+        fflush(NULL);
+        pid_t child = fork();
+        if (child < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (child > 0) {
+            close(pipefd[1]);
+            unsigned char code;
+            if (read(pipefd[0], &code, 1) == 1) return code;
+            // The child ended without deciding, as on exit(1)
+            int status;
+            if (waitpid(child, &status, 0) < 0 || !WIFEXITED(status)) return 1;
+            return WEXITSTATUS(status);
+        }
+        close(pipefd[0]);
+        quorum.k = quorum_k;
+        quorum.n = servn;
+        quorum.budget = budget_mbps / 8000.0;
+        quorum.notify_fd = pipefd[1];
+    }
+
+    // One compressor feeds every replica: each frame is packed once and sent
+    // to all servers that accepted compression. Its lead always covers a
+    // whole window of the largest frames, so the slowest flow never waits.
+    static struct comp_stream comp;
+    pthread_t comp_thread;
+    size_t comp_wire = mss - PKT_PREFIX - TRAILER_SIZE - (fec ? FEC_HDR : 0) - COMP_HDR;
+    size_t comp_lead = (size_t)(winsz + 1) * COMP_MAX_RAW > COMP_LEAD ? (size_t)(winsz + 1) * COMP_MAX_RAW : COMP_LEAD;
+    if (compress && comp_open(&comp, &src, comp_wire, comp_lead, chain && servn > 1 ? 1 : servn, &comp_thread) < 0) {
+        perror("pthread_create");
+        return 1;
+    }
+
+    // Every server writing a whole copy checks it against one hash of the
+    // input before moving it into place. The hash is taken alongside the
+    // sends, which read the same pages.
+    static struct file_digest digest;
+    pthread_t digest_tid;
+    int hashing = !stripe && !tree;
+    if (hashing) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        digest.src = &src;
+        digest.nthreads = cores < 1 ? 1 : cores > HASH_THREADS ? HASH_THREADS : cores;
+        if (pthread_create(&digest_tid, NULL, digest_thread, &digest) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    // Pipeline: only the first server hears from us; it forwards everything
+    // along the rest of the list and ACKs come back from the last one
+    if (chain && servn > 1) {
+        for (int i = 1; i < servn; ++i) {
+            unsigned char *hop = args[0].hops + (i - 1) * HOP_SIZE;
+            uint16_t net_port = htons(args[i].port);
+            if (inet_pton(AF_INET, args[i].ip, hop) != 1) {
+                fprintf(stderr, "Chain needs IPv4 addresses, got %s\n", args[i].ip);
+                return 1;
+            }
+            memcpy(hop + 4, &net_port, 2);
+        }
+        args[0].nhops = servn - 1;
+        args[0].src = &src;
+        args[0].mss = mss;
+        args[0].mss_auto = mss_auto;
+        args[0].winsz = winsz;
+        args[0].queue = NULL;
+        args[0].failed = 0;
+        args[0].pace_mbps = pace_mbps;
+        args[0].pace_auto = pace_auto;
+        args[0].fec = fec;
+        args[0].delta = delta;
+        args[0].comp = compress ? &comp : NULL;
+        args[0].tree = tree;
+        args[0].digest = NULL;
+        args[0].quorum = NULL;
+        snprintf(args[0].rel_path, sizeof(args[0].rel_path), "%s", outfile);
+        run_flows(args, 1, event_loop);
+        if (!args[0].failed) {
+            comp_close(compress ? &comp : NULL, comp_thread);
+            if (hashing) pthread_join(digest_tid, NULL);
+            report_cpu(src.size / 1e6);
+            if (src.base) munmap((void *)src.base, src.size);
+            free(args);
+            return 0;
+        }
+        // Servers that got the data keep it as a part file and offer a resume.
+        // The frames the head was sent are gone, so compression starts over.
+        fprintf(stderr, "Chain stalled, falling back to direct fan-out\n");
+        args[0].nhops = 0;
+        if (compress) {
+            comp_close(&comp, comp_thread);
+            if (comp_open(&comp, &src, comp_wire, comp_lead, servn, &comp_thread) < 0) {
+                perror("pthread_create");
+                return 1;
+            }
+        }
+    }
 
+    // Striping runs conns flows per server, each on its own socket, and flow i
+    // stores its part of the file as <outfile>.s<i> on server i % servn
+    static struct stripe_queue queue = { .lock = PTHREAD_MUTEX_INITIALIZER };
+    int nflows = stripe ? servn * conns : servn;
+    queue.size = src.size;
+    queue.nflows = nflows;
+    for (int i = 0; i < nflows; ++i) {
+        if (i >= servn) args[i] = args[i % servn];
+        args[i].src = &src;
+        args[i].mss = mss_auto && !compress ? path_mss[i % servn] : mss;
+        args[i].mss_auto = mss_auto;
+        args[i].winsz = winsz;
+        args[i].queue = stripe ? &queue : NULL;
+        args[i].flow = i;
+        args[i].nhops = 0;
+        args[i].failed = 0;
+        args[i].pace_mbps = pace_mbps;
+        args[i].pace_auto = pace_auto;
+        args[i].fec = fec;
+        args[i].delta = delta;
+        args[i].comp = compress ? &comp : NULL;
+        args[i].tree = tree;
+        args[i].digest = hashing ? &digest : NULL;
+        args[i].quorum = quorum_k ? &quorum : NULL;
+        args[i].fail_code = 0;
+        if (stripe) snprintf(args[i].rel_path, sizeof(args[i].rel_path), "%s.s%d", outfile, i);
+        else strncpy(args[i].rel_path, outfile, sizeof(args[i].rel_path));
+    }
+    quorum.start_ns = now_ns();
+    run_flows(args, nflows, event_loop);
+
+    comp_close(compress ? &comp : NULL, comp_thread);
+    if (hashing) pthread_join(digest_tid, NULL);
+    report_cpu(src.size / 1e6 * (stripe ? 1 : nflows));
+    if (src.base) munmap((void *)src.base, src.size);
+    free(args);
+    if (quorum_k) {
+        fprintf(stderr, "%d of %d replicas complete, %d failed\n", quorum.done, quorum.n, quorum.failed);
+        return quorum.reached ? 0 : quorum.code ? quorum.code : 1;
+    }
     return 0;
 }
@@ -1,158 +1,1395 @@
 // FINAL myserver.c — fixed -Wsign-compare by casting sizeof() for safe comparison
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <linux/filter.h>
+#include <endian.h>
+#include <stdint.h>
 #include <time.h>
 #include <libgen.h>
+#include <getopt.h>
+#include <signal.h>
+
+#include "packet.h"
+#include "writer.h"
+#include "delta.h"
+#include "xor.h"
+#include "lz4.h"
+#include "bundle.h"
+#include "filehash.h"
+#include "trace.h"
 
 #define MAX_PACKET_SIZE 32768
-#define CRUZID_LEN 7
-#define HEADER_SIZE 9
+#define HEADER_SIZE PKT_HEADER
 #define TYPE_META 0x2
 #define TYPE_DATA 0x1
+#define TYPE_ACK 0x3
+#define TYPE_PARITY 0x4
+#define TYPE_SIG 0x5
+#define TYPE_PROBE PKT_TYPE_PROBE
+#define TYPE_FIN 0x7
+#define IDLE_FLUSH_MS 200
+#define SESSION_IDLE_SEC 10
+#define REORDER_SLOTS 1024   // first reorder ring, doubled as the client's window needs
+#define REORDER_MAX 65536     // largest ring; the lab4 client caps its window at this
+#define RCVBUF_SIZE (16 << 20) // asked for per worker socket; the kernel caps it at net.core.rmem_max
+#define MAX_SACK 8
+#define SACK_RANGE 16        // first and last seq of a range held out of order
+#define ACK_EVERY 4
+#define ACK_DELAY_MS 10
+#define META_FIXED 17        // transfer id (8) + file size (8) + flags (1)
+#define META_FRESH 0x1       // client rejected the offered resume point
+#define META_STRIPE 0x2      // DATA payloads carry their file offset; see stripe_append()
+#define META_CHAIN 0x4       // hop count and the rest of the chain follow the fixed fields
+#define META_FEC 0x8         // parity follows; keep recent payloads to rebuild from
+#define META_DELTA 0x10      // DATA is a delta against the copy already here; see delta_append()
+#define META_LZ4 0x20        // DATA payloads are compressed frames; see lz4_append()
+#define META_BUNDLE 0x40     // DATA is a directory tree as bundle records; see bundle.h
+#define META_HASH 0x80       // hold the file until a FIN with the client's file hash; see handle_fin()
+#define META_REPLY 25        // offset, tail, delta block size and count, accepted flags
+#define FIN_REPLY 9          // verdict (1) + this server's file hash (8)
+#define FIN_OK 1
+#define FIN_MISMATCH 2
+#define FIN_ERROR 3          // the file could not be written or moved into place
+#define FIN_UNKNOWN 4        // no finished transfer with a hash for this client
+#define COMP_HDR 3           // frame kind (1) + raw length (2)
+#define COMP_RAW 0
+#define COMP_LZ4 1
+#define COMP_MAX_RAW 65535
+#define STRIPE_PREFIX 8
+#define FEC_HDR 6            // block size (2) + XOR of payload lengths (4)
+#define FEC_CACHE 64         // delivered payloads kept for parity; twice the largest block
+#define HOP_SIZE 6           // IPv4 address + port, network order
+#define RESUME_ALIGN 65536   // a whole number of FILE_HASH_LEAFs
+#define RESUME_TAIL 65536
+#define MAX_WORKERS 64
+#define MAX_SESSIONS 16      // per worker
+#define MAX_LOCKS (MAX_WORKERS * MAX_SESSIONS)
+#define SIGN_THREADS 8       // signing threads for one old copy, at most one per core
+#define SIGN_POLL_MS 10      // how often a worker checks on a session's sign thread
+#define COPY_CHUNK (1 << 20)
 
-unsigned char checksum(const unsigned char *data, int len) {
-    unsigned int sum = 0;
-    for (int i = 0; i < len; ++i) {
-        sum += data[i];
-    }
-    return (unsigned char)(sum % 256);
-}
+// Out-of-order payload held until the gap in front of it is filled
+struct ooo_pkt {
+    uint64_t seq;
+    int len;
+    unsigned char *data;
+};
+
+// Copy of an already delivered payload, kept while a parity may still need it
+struct fec_entry {
+    uint64_t seq;
+    int len;
+    int cap;
+    unsigned char *data;
+};
+
+// Contiguous byte range of the original file held by a stripe
+struct extent {
+    off_t off;
+    off_t len;
+};
+
+struct session {
+    int sockfd;            // socket of the worker that owns the session
+    struct writer *out;
+    struct sockaddr_in addr;
+    char client[64];
+    char path[2048];
+    char part_path[2100];  // <path>.<transfer id>.part until the last byte lands
+    char fold_path[2100];  // <path>.<transfer id>.fold: the file hash's fold after each leaf
+    int fold_fd;           // -1 unless the session is writing the file in order
+    uint64_t id;
+    uint64_t size;
+    off_t start;           // resume offset agreed in the META exchange
+    off_t written;
+    uint32_t tail_len, tail_crc;
+    int finished;
+    uint64_t expected_seq;
+    int dirty;
+    long long last_rx_ms;
+    int unacked;
+    long long ack_due_ms;  // 0 while no ACK is owed
+    uint64_t ooo_max;
+    struct ooo_pkt *ooo;   // nooo slots by seq % nooo, allocated on the first gap
+    size_t nooo;
+    int stripe;
+    off_t pos;             // file offset the next stripe byte is written at
+    struct extent *extents;
+    int nextents, extents_cap;
+    int fwd_fd;            // socket to the next server in a chain, -1 at the tail
+    struct sockaddr_in next;
+    uint64_t down_cum;     // last cumulative ACK from the next server
+    uint64_t down_ranges[MAX_SACK * 2];
+    int down_nranges;
+    int fec;
+    struct fec_entry *fec_cache;  // FEC_CACHE entries, allocated on first use
+    int delta;
+    int base_fd;           // copy of path from before this transfer, -1 if there was none
+    uint32_t block_size;
+    uint32_t nblocks;      // full blocks of the old copy, signed in sigs
+    unsigned char *sigs;
+    int signing;           // a sign thread is filling sigs; the SIGs go out once it is done
+    pthread_t sign_tid;
+    int sign_done, sign_errno;
+    long long sign_start_ms;
+    unsigned char op[DELTA_OP_MAX];
+    int op_len;            // bytes of the next op header seen so far
+    uint32_t literal_left;
+    int lz4;
+    unsigned char *unpacked;  // COMP_MAX_RAW bytes, allocated on first use
+    int tree;
+    struct bundle *bundle;    // directory tree, unpacked as it arrives; out stays NULL
+    int verify;
+    struct file_hash hash;    // of every byte written, in file order
+    uint64_t digest;
+    int held;                 // complete as a part file, waiting for the client's FIN
+    int verdict;
+};
+
+// One receive thread with its own SO_REUSEPORT socket and its own sessions
+struct worker {
+    int id;
+    int sockfd;
+    pthread_t thread;
+    struct session *sessions[MAX_SESSIONS];
+    unsigned long long packets;
+};
+
+// Destination paths being written. Shared by every worker so one client at a
+// time owns a file, whichever worker its session landed on.
+struct path_lock {
+    int in_use;
+    char path[2048];
+};
+
+int port;
+int droppc;
+int ack_every = ACK_EVERY;
+int direct = 0;
+int policy = FSYNC_DATA;
+char *root_folder;
+volatile sig_atomic_t stop = 0;
+
+struct path_lock locks[MAX_LOCKS];
+pthread_mutex_t locks_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+__thread unsigned int drop_seed;
 
 char *rfc3339_time() {
-    static char buf[64];
+    static __thread char buf[64];
     struct timespec ts;
     clock_gettime(CLOCK_REALTIME, &ts);
-    struct tm *tm = gmtime(&ts.tv_sec);
-    strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", tm);
+    struct tm tm;
+    gmtime_r(&ts.tv_sec, &tm);
+    strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
     int ms = ts.tv_nsec / 1000000;
     snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), ".%03dZ", ms);
     return buf;
 }
 
+// One CSV line, or with -T a binary trace event
+void log_pkt(int type, const char *name, const struct sockaddr_in *peer, uint64_t seq) {
+    if (trace_fd >= 0) trace_event(type, seq, 0, 0, 0, peer);
+    else printf("%s, %d, %s, %d, %s, %llu\n", rfc3339_time(), port, inet_ntoa(peer->sin_addr), ntohs(peer->sin_port), name,
+                (unsigned long long)seq);
+}
+
+long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
 int should_drop(int droppc) {
-    return (rand() % 100) < droppc;
+    return (rand_r(&drop_seed) % 100) < droppc;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <port> <droppc> <root_folder>\n", argv[0]);
-        return 1;
+int path_acquire(const char *path) {
+    int rc = -1, free_slot = -1;
+    pthread_mutex_lock(&locks_mutex);
+    for (int i = 0; i < MAX_LOCKS; ++i) {
+        if (locks[i].in_use && strcmp(locks[i].path, path) == 0) goto out;
+        if (!locks[i].in_use && free_slot < 0) free_slot = i;
     }
+    if (free_slot >= 0) {
+        locks[free_slot].in_use = 1;
+        strcpy(locks[free_slot].path, path);
+        rc = 0;
+    }
+out:
+    pthread_mutex_unlock(&locks_mutex);
+    return rc;
+}
 
-    int port = atoi(argv[1]);
-    int droppc = atoi(argv[2]);
-    char *root_folder = argv[3];
+void path_release(const char *path) {
+    pthread_mutex_lock(&locks_mutex);
+    for (int i = 0; i < MAX_LOCKS; ++i)
+        if (locks[i].in_use && strcmp(locks[i].path, path) == 0) locks[i].in_use = 0;
+    pthread_mutex_unlock(&locks_mutex);
+}
 
-    srand(time(NULL));
-    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        perror("socket");
-        return 1;
+void session_reset(struct session *s) {
+    for (size_t i = 0; i < s->nooo; ++i) {
+        free(s->ooo[i].data);
+        s->ooo[i].data = NULL;
     }
+    if (s->fec_cache)
+        for (int i = 0; i < FEC_CACHE; ++i) s->fec_cache[i].seq = 0;
+    s->expected_seq = 1;
+    s->ooo_max = 0;
+    s->finished = 0;
+    s->unacked = 0;
+    s->ack_due_ms = 0;
+    s->dirty = 0;
+    s->stripe = 0;
+    s->pos = 0;
+    s->nextents = 0;
+    s->down_cum = 0;
+    s->down_nranges = 0;
+    s->fec = 0;
+    s->delta = 0;
+    s->nblocks = 0;
+    free(s->sigs);
+    s->sigs = NULL;
+    s->op_len = 0;
+    s->literal_left = 0;
+    s->lz4 = 0;
+    s->tree = 0;
+    s->verify = 0;
+    s->verdict = 0;
+}
 
-    struct sockaddr_in servaddr, cliaddr;
-    memset(&servaddr, 0, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = INADDR_ANY;
-    servaddr.sin_port = htons(port);
+// Stop writing without finishing; the part file stays behind for a resume.
+// A sign thread still reading the old copy is waited for, which only happens
+// when its client restarts or the server stops mid-signing.
+void session_close(struct session *s) {
+    if (s->signing) {
+        pthread_join(s->sign_tid, NULL);
+        s->signing = 0;
+    }
+    if (s->held) {
+        s->held = 0;
+        path_release(s->path);
+    }
+    if (s->fwd_fd >= 0) {
+        close(s->fwd_fd);
+        s->fwd_fd = -1;
+    }
+    if (s->base_fd >= 0) {
+        close(s->base_fd);
+        s->base_fd = -1;
+    }
+    if (s->fold_fd >= 0) {
+        close(s->fold_fd);
+        s->fold_fd = -1;
+    }
+    if (s->bundle) {
+        bundle_abort(s->bundle);
+        s->bundle = NULL;
+        path_release(s->path);
+    }
+    if (!s->out) return;
+    if (writer_close(s->out, policy) < 0) perror("write");
+    s->out = NULL;
+    path_release(s->path);
+}
 
-    if (bind(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
-        perror("bind");
-        return 1;
+// Still taking DATA: a file or a directory being written
+int session_live(const struct session *s) {
+    return s->out || s->bundle;
+}
+
+// Cumulative ACK of the last in-order seq plus up to MAX_SACK ranges of
+// buffered packets above it, as (first, last) pairs. Inside a chain both come
+// from the next server, capped at what this one holds, so the client only
+// hears about packets that every replica behind it has.
+void send_ack(struct session *s) {
+    uint64_t cum = s->expected_seq - 1;
+    if (s->fwd_fd >= 0 && s->down_cum < cum) cum = s->down_cum;
+    s->unacked = 0;
+    s->ack_due_ms = 0;
+
+    if (should_drop(droppc)) {
+        log_pkt(TRACE_DROP_ACK, "DROP ACK", &s->addr, cum);
+        return;
     }
 
-    printf("Server listening on port %d...\n", port);
+    unsigned char ack[HEADER_SIZE + MAX_SACK * SACK_RANGE + TRAILER_SIZE];
+    int nranges = 0;
+    for (int r = 0; s->fwd_fd >= 0 && r < s->down_nranges; ++r) {
+        uint64_t first = s->down_ranges[2 * r], last = s->down_ranges[2 * r + 1];
+        if (last <= cum) continue;
+        if (first <= cum) first = cum + 1;
+        uint64_t range[2] = { htobe64(first), htobe64(last) };
+        memcpy(ack + HEADER_SIZE + nranges * SACK_RANGE, range, SACK_RANGE);
+        nranges++;
+    }
+    for (uint64_t seq = s->expected_seq + 1; s->fwd_fd < 0 && seq <= s->ooo_max && nranges < MAX_SACK; ++seq) {
+        struct ooo_pkt *p = &s->ooo[seq % s->nooo];
+        if (!p->data || p->seq != seq) continue;
+        uint64_t first = seq;
+        while (seq + 1 <= s->ooo_max && s->ooo[(seq + 1) % s->nooo].data &&
+               s->ooo[(seq + 1) % s->nooo].seq == seq + 1)
+            seq++;
+        uint64_t range[2] = { htobe64(first), htobe64(seq) };
+        memcpy(ack + HEADER_SIZE + nranges * SACK_RANGE, range, SACK_RANGE);
+        nranges++;
+    }
+
+    pkt_put_header(ack, TYPE_ACK, cum, nranges * SACK_RANGE);
+    int len = HEADER_SIZE + nranges * SACK_RANGE;
+    pkt_seal(ack, len);
+    sendto(s->sockfd, ack, len + TRAILER_SIZE, 0, (struct sockaddr *)&s->addr, sizeof(s->addr));
+
+    log_pkt(TRACE_ACK, "ACK", &s->addr, cum);
+}
+
+// Offer the client the partial file back, cut to a RESUME_ALIGN boundary so a
+// torn last block is rewritten, along with a CRC32C of the bytes just before it.
+// The writer never leaves a hole below the end of the file, so its size is
+// where the data stops. The file hash picks up from the fold kept for that
+// leaf, so the offer goes no further than the fold file does.
+void find_resume_point(struct session *s) {
+    struct stat st, fst;
+    s->start = 0;
+    s->tail_len = 0;
+    s->tail_crc = 0;
+    if (stat(s->part_path, &st) < 0 || stat(s->fold_path, &fst) < 0) return;
+
+    off_t off = st.st_size - st.st_size % RESUME_ALIGN;
+    if ((uint64_t)off > s->size) off = s->size - s->size % RESUME_ALIGN;
+    off_t folded = fst.st_size / 8 * FILE_HASH_LEAF;
+    if (off > folded) off = folded - folded % RESUME_ALIGN;
+    if (off == 0) return;
+
+    uint64_t fold;
+    int ffd = open(s->fold_path, O_RDONLY);
+    if (ffd < 0) return;
+    ssize_t r = pread(ffd, &fold, 8, (off / FILE_HASH_LEAF - 1) * 8);
+    close(ffd);
+    if (r != 8) return;
+
+    int fd = open(s->part_path, O_RDONLY);
+    if (fd < 0) return;
+    unsigned char *tail = malloc(RESUME_TAIL);
+    size_t want = off < RESUME_TAIL ? (size_t)off : RESUME_TAIL;
+    if (tail && pread(fd, tail, want, off - want) == (ssize_t)want) {
+        s->start = off;
+        s->tail_len = want;
+        s->tail_crc = crc32c(0, tail, want);
+        file_hash_resume(&s->hash, le64toh(fold), off);
+    }
+    free(tail);
+    close(fd);
+}
+
+// Feed the file hash, and write down its fold at every leaf it completes
+void session_hash(struct session *s, const unsigned char *data, size_t len) {
+    while (len > 0) {
+        size_t n = FILE_HASH_LEAF - s->hash.leaf_fill < len ? FILE_HASH_LEAF - s->hash.leaf_fill : len;
+        file_hash_update(&s->hash, data, n);
+        data += n;
+        len -= n;
+        if (s->hash.leaf_fill > 0 || s->fold_fd < 0) continue;
+        uint64_t fold = htole64(s->hash.fold);
+        if (pwrite(s->fold_fd, &fold, 8, (s->hash.size / FILE_HASH_LEAF - 1) * 8) != 8) {
+            perror("fold");
+            close(s->fold_fd);
+            s->fold_fd = -1;
+        }
+    }
+}
+
+void send_meta_reply(struct session *s) {
+    if (should_drop(droppc)) {
+        log_pkt(TRACE_DROP_ACK, "DROP ACK", &s->addr, 0);
+        return;
+    }
+
+    // Delta transfers also learn the block size and how many signatures follow;
+    // the last byte says which of the offered options this server took up
+    unsigned char reply[HEADER_SIZE + META_REPLY + TRAILER_SIZE];
+    int len = META_REPLY;
+    uint64_t off = htobe64(s->start);
+    uint32_t tail_len = htonl(s->tail_len), tail_crc = htonl(s->tail_crc);
+    uint32_t block = htonl(s->block_size), nblocks = htonl(s->nblocks);
+    pkt_put_header(reply, TYPE_META, 0, len);
+    memcpy(reply + HEADER_SIZE, &off, 8);
+    memcpy(reply + HEADER_SIZE + 8, &tail_len, 4);
+    memcpy(reply + HEADER_SIZE + 12, &tail_crc, 4);
+    memcpy(reply + HEADER_SIZE + 16, &block, 4);
+    memcpy(reply + HEADER_SIZE + 20, &nblocks, 4);
+    reply[HEADER_SIZE + 24] = (s->delta ? META_DELTA : 0) | (s->fec ? META_FEC : 0) | (s->lz4 ? META_LZ4 : 0) |
+                              (s->tree ? META_BUNDLE : 0) | (s->verify ? META_HASH : 0);
+    pkt_seal(reply, HEADER_SIZE + len);
+    sendto(s->sockfd, reply, HEADER_SIZE + len + TRAILER_SIZE, 0, (struct sockaddr *)&s->addr, sizeof(s->addr));
+
+    log_pkt(TRACE_ACK, "ACK", &s->addr, 0);
+}
+
+// Signatures of blocks [idx * SIG_PER_PACKET, ...) of the old copy as packet idx
+void send_signatures(struct session *s, int idx) {
+    uint32_t first = (uint32_t)idx * SIG_PER_PACKET;
+    if (idx < 0 || first >= s->nblocks) return;
+    if (should_drop(droppc)) {
+        log_pkt(TRACE_DROP_SIG, "DROP SIG", &s->addr, idx);
+        return;
+    }
+
+    unsigned char pkt[HEADER_SIZE + SIG_PER_PACKET * SIG_SIZE + TRAILER_SIZE];
+    uint32_t n = s->nblocks - first < SIG_PER_PACKET ? s->nblocks - first : SIG_PER_PACKET;
+    int len = n * SIG_SIZE;
+    pkt_put_header(pkt, TYPE_SIG, idx, len);
+    memcpy(pkt + HEADER_SIZE, s->sigs + (size_t)first * SIG_SIZE, len);
+    pkt_seal(pkt, HEADER_SIZE + len);
+    sendto(s->sockfd, pkt, HEADER_SIZE + len + TRAILER_SIZE, 0, (struct sockaddr *)&s->addr, sizeof(s->addr));
+}
+
+void *sign_thread(void *arg) {
+    struct session *s = arg;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = cores < 1 ? 1 : cores > SIGN_THREADS ? SIGN_THREADS : cores;
+    s->sign_errno = delta_sign(s->base_fd, s->block_size, s->nblocks, s->sigs, nthreads) < 0 ? errno : 0;
+    __atomic_store_n(&s->sign_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Sign the copy of path this server already has, if any, for a delta transfer.
+// Reading a large old copy takes seconds, so it happens on a sign thread and
+// the worker goes on serving its other sessions; the META reply only needs the
+// block count. A thread that fails to start signs inline.
+void load_base(struct session *s) {
+    struct stat st;
+    s->base_fd = open(s->path, O_RDONLY);
+    if (s->base_fd < 0 || fstat(s->base_fd, &st) < 0) {
+        s->block_size = DELTA_MIN_BLOCK;
+        return;
+    }
+    s->block_size = delta_block_size(st.st_size);
+    s->nblocks = st.st_size / s->block_size;
+    if (s->nblocks == 0) return;
+
+    s->sigs = malloc((size_t)s->nblocks * SIG_SIZE);
+    if (!s->sigs) {
+        perror("malloc");
+        s->nblocks = 0;
+        return;
+    }
+    s->sign_start_ms = now_ms();
+    s->sign_done = 0;
+    s->sign_errno = 0;
+    s->signing = 1;
+    if (pthread_create(&s->sign_tid, NULL, sign_thread, s) != 0) {
+        s->signing = 0;
+        sign_thread(s);
+    }
+}
+
+// Signatures are ready: send them all. On a read error the session ends,
+// since the client already expects nblocks of them, and gives up on this server.
+void sign_finish(struct session *s) {
+    if (s->signing) {
+        pthread_join(s->sign_tid, NULL);
+        s->signing = 0;
+    }
+    if (s->sign_errno) {
+        fprintf(stderr, "sign %s: %s\n", s->path, strerror(s->sign_errno));
+        session_close(s);
+        session_reset(s);
+        return;
+    }
+    fprintf(stderr, "Signed %u blocks of %u bytes of %s in %lld ms\n", s->nblocks, s->block_size, s->path,
+            now_ms() - s->sign_start_ms);
+    for (uint32_t i = 0; i * SIG_PER_PACKET < s->nblocks; ++i) send_signatures(s, i);
+}
+
+// <path>.manifest: "<file size> <transfer id>" and then one "<offset> <length>"
+// line per extent, which is what mergestripes needs to rebuild the file.
+int write_manifest(struct session *s) {
+    char manifest[2200];
+    snprintf(manifest, sizeof(manifest), "%s.manifest", s->path);
+    FILE *f = fopen(manifest, "w");
+    if (!f) return -1;
+    fprintf(f, "%llu %016llx\n", (unsigned long long)s->size, (unsigned long long)s->id);
+    for (int i = 0; i < s->nextents; ++i)
+        fprintf(f, "%lld %lld\n", (long long)s->extents[i].off, (long long)s->extents[i].len);
+    return fclose(f);
+}
+
+// Pass META on to the next server with this hop taken off the front of the chain
+void forward_meta(struct session *s, const unsigned char *pkt, int datalen) {
+    unsigned char out[PKT_PREFIX + 4096 + TRAILER_SIZE];
+    const unsigned char *m = pkt + PKT_PREFIX;
+    int head = PKT_PREFIX + META_FIXED;
+    int len = datalen - HOP_SIZE;
+    if (datalen > 4096) return;
+
+    memcpy(out, pkt, head);
+    out[head] = m[META_FIXED] - 1;
+    memcpy(out + head + 1, m + META_FIXED + 1 + HOP_SIZE, datalen - META_FIXED - 1 - HOP_SIZE);
+    pkt_put_header(out, TYPE_META, pkt_seq(pkt), len);
+    int pkt_len = PKT_PREFIX + len;
+    pkt_seal(out, pkt_len);
+    sendto(s->fwd_fd, out, pkt_len + TRAILER_SIZE, 0, (struct sockaddr *)&s->next, sizeof(s->next));
+}
+
+// Replies from the next server in the chain: its META reply goes straight back
+// upstream, its ACKs are folded into this server's own (see send_ack()).
+void relay_downstream(struct session *s) {
+    unsigned char buf[HEADER_SIZE + MAX_SACK * SACK_RANGE + TRAILER_SIZE];
+    ssize_t n;
+    while (s->fwd_fd >= 0 && (n = recv(s->fwd_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        if (n < HEADER_SIZE + TRAILER_SIZE || !pkt_valid(buf, n)) continue;
+        if (PKT_TYPE(buf[0]) == TYPE_META) {
+            if (should_drop(droppc)) {
+                log_pkt(TRACE_DROP_ACK, "DROP ACK", &s->addr, 0);
+                continue;
+            }
+            sendto(s->sockfd, buf, n, 0, (struct sockaddr *)&s->addr, sizeof(s->addr));
+            log_pkt(TRACE_ACK, "ACK", &s->addr, 0);
+            continue;
+        }
+        if (PKT_TYPE(buf[0]) != TYPE_ACK) continue;
+
+        s->down_cum = pkt_seq(buf);
+        s->down_nranges = pkt_len(buf) / SACK_RANGE;
+        if (s->down_nranges > (n - HEADER_SIZE - TRAILER_SIZE) / SACK_RANGE)
+            s->down_nranges = (n - HEADER_SIZE - TRAILER_SIZE) / SACK_RANGE;
+        if (s->down_nranges > MAX_SACK || s->down_nranges < 0) s->down_nranges = 0;
+        for (int r = 0; r < s->down_nranges * 2; ++r) {
+            uint64_t v;
+            memcpy(&v, buf + HEADER_SIZE + r * 8, 8);
+            s->down_ranges[r] = be64toh(v);
+        }
+        send_ack(s);
+    }
+}
+
+// Last byte is in: apply the fsync policy and move the file into place.
+int session_finish(struct session *s) {
+    if (s->bundle) {
+        struct bundle_stats st;
+        int rc = bundle_close(s->bundle, policy != FSYNC_NONE, &st);
+        s->bundle = NULL;
+        path_release(s->path);
+        s->finished = 1;
+        fprintf(stderr, "Unpacked %u files (%llu bytes) and %u directories into %s\n", st.files,
+                (unsigned long long)st.bytes, st.dirs, s->path);
+        return rc;
+    }
+    int rc = writer_close(s->out, policy);
+    s->out = NULL;
+    if (s->fold_fd >= 0) {
+        close(s->fold_fd);
+        s->fold_fd = -1;
+    }
+    if (rc == 0 && s->verify) {
+        // Stays a part file until the client's hash agrees; see handle_fin()
+        s->digest = file_hash_final(&s->hash);
+        s->held = 1;
+    } else {
+        if (rc == 0) rc = rename(s->part_path, s->path);
+        if (rc == 0) unlink(s->fold_path);
+        if (rc == 0 && s->stripe) rc = write_manifest(s);
+        if (rc < 0) s->verdict = FIN_ERROR;
+        path_release(s->path);
+    }
+    if (s->base_fd >= 0) {
+        close(s->base_fd);
+        s->base_fd = -1;
+    }
+    s->finished = 1;
+    return rc;
+}
+
+int add_extent(struct session *s, off_t off, off_t len) {
+    struct extent *last = s->nextents ? &s->extents[s->nextents - 1] : NULL;
+    if (last && last->off + last->len == off) {
+        last->len += len;
+        return 0;
+    }
+    if (s->nextents == s->extents_cap) {
+        int cap = s->extents_cap ? s->extents_cap * 2 : 64;
+        struct extent *e = realloc(s->extents, cap * sizeof(*e));
+        if (!e) return -1;
+        s->extents = e;
+        s->extents_cap = cap;
+    }
+    s->extents[s->nextents].off = off;
+    s->extents[s->nextents].len = len;
+    s->nextents++;
+    return 0;
+}
+
+// Stripe payloads start with the be64 file offset of the bytes behind it, which
+// land at that offset in a sparse file. A bare offset marks the end of the stripe.
+int stripe_append(struct session *s, const unsigned char *data, int len) {
+    s->expected_seq++;
+    if (len < STRIPE_PREFIX) return 0;
+    uint64_t off;
+    memcpy(&off, data, 8);
+    off = be64toh(off);
+    len -= STRIPE_PREFIX;
+    if (len == 0) return session_finish(s);
+    if (off + len > s->size) return 0;
+
+    if ((off_t)off != s->pos && writer_seek(s->out, off) < 0) return -1;
+    if (writer_append(s->out, data + STRIPE_PREFIX, len) < 0) return -1;
+    s->dirty = 1;
+    s->written += len;
+    s->pos = off + len;
+    return add_extent(s, off, len);
+}
+
+int delta_write(struct session *s, const unsigned char *data, size_t len) {
+    if (s->verify) session_hash(s, data, len);
+    if (writer_append(s->out, data, len) < 0) return -1;
+    s->dirty = 1;
+    s->written += len;
+    return 0;
+}
+
+// Blocks [first, first + count) of the old copy, appended to the new one
+int delta_copy(struct session *s, uint32_t first, uint32_t count) {
+    if (s->base_fd < 0 || first >= s->nblocks || count > s->nblocks - first) {
+        errno = EPROTO;
+        return -1;
+    }
+    unsigned char *buf = malloc(COPY_CHUNK);
+    if (!buf) return -1;
+    off_t off = (off_t)first * s->block_size, end = off + (off_t)count * s->block_size;
+    int rc = 0;
+    while (rc == 0 && off < end) {
+        size_t want = end - off < COPY_CHUNK ? (size_t)(end - off) : COPY_CHUNK;
+        ssize_t r = pread(s->base_fd, buf, want, off);
+        if (r <= 0) {
+            if (r == 0) errno = EIO;
+            rc = -1;
+        } else {
+            rc = delta_write(s, buf, r);
+            off += r;
+        }
+    }
+    free(buf);
+    return rc;
+}
+
+// Delta payloads are a byte stream of ops (see delta.h) that may be split
+// anywhere between packets; literal bytes go straight to the writer and copy
+// ops read the old copy of the file.
+int delta_append(struct session *s, const unsigned char *data, int len) {
+    s->expected_seq++;
+    while (len > 0) {
+        if (s->literal_left > 0) {
+            int n = (uint32_t)len < s->literal_left ? len : (int)s->literal_left;
+            if (delta_write(s, data, n) < 0) return -1;
+            s->literal_left -= n;
+            data += n;
+            len -= n;
+            continue;
+        }
+        s->op[s->op_len++] = *data++;
+        len--;
+        int need = s->op[0] == DELTA_LITERAL ? 5 : s->op[0] == DELTA_COPY ? 9 : 0;
+        if (need == 0) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (s->op_len < need) continue;
+        s->op_len = 0;
+        uint32_t a, b;
+        memcpy(&a, s->op + 1, 4);
+        if (s->op[0] == DELTA_LITERAL) {
+            s->literal_left = be32toh(a);
+            continue;
+        }
+        memcpy(&b, s->op + 5, 4);
+        if (delta_copy(s, be32toh(a), be32toh(b)) < 0) return -1;
+    }
+    if ((uint64_t)s->written >= s->size) return session_finish(s);
+    return 0;
+}
+
+void fec_remember(struct session *s, uint64_t seq, const unsigned char *data, int len) {
+    if (!s->fec_cache && !(s->fec_cache = calloc(FEC_CACHE, sizeof(*s->fec_cache)))) return;
+    struct fec_entry *e = &s->fec_cache[seq % FEC_CACHE];
+    if (e->cap < len) {
+        unsigned char *p = realloc(e->data, len);
+        if (!p) {
+            e->seq = 0;
+            return;
+        }
+        e->data = p;
+        e->cap = len;
+    }
+    memcpy(e->data, data, len);
+    e->seq = seq;
+    e->len = len;
+}
+
+// Unpack one compressed frame: kind (1), raw length (be16), then the raw bytes
+// or an LZ4 block that must inflate to exactly that length
+int lz4_append(struct session *s, const unsigned char **data, int *len) {
+    uint16_t raw_len;
+    if (*len < COMP_HDR) goto bad;
+    memcpy(&raw_len, *data + 1, 2);
+    raw_len = ntohs(raw_len);
+    if ((*data)[0] == COMP_RAW) {
+        if (*len - COMP_HDR != raw_len) goto bad;
+        *data += COMP_HDR;
+        *len = raw_len;
+        return 0;
+    }
+    if ((*data)[0] != COMP_LZ4) goto bad;
+    if (!s->unpacked && !(s->unpacked = malloc(COMP_MAX_RAW))) return -1;
+    if (lz4_decompress(*data + COMP_HDR, *len - COMP_HDR, s->unpacked, COMP_MAX_RAW) != raw_len) goto bad;
+    *data = s->unpacked;
+    *len = raw_len;
+    return 0;
+bad:
+    errno = EPROTO;
+    return -1;
+}
+
+int session_append(struct session *s, const unsigned char *data, int len) {
+    if (s->fec) fec_remember(s, s->expected_seq, data, len);
+    if (s->stripe) return stripe_append(s, data, len);
+    if (s->delta) return delta_append(s, data, len);
+    if (s->lz4 && lz4_append(s, &data, &len) < 0) return -1;
+    if (s->bundle) {
+        if (bundle_write(s->bundle, data, len) < 0) return -1;
+        s->written += len;
+        s->expected_seq++;
+        if ((uint64_t)s->written >= s->size) return session_finish(s);
+        return 0;
+    }
+    if (s->verify || s->fold_fd >= 0) session_hash(s, data, len);
+    if (writer_append(s->out, data, len) < 0) return -1;
+    s->dirty = 1;
+    s->written += len;
+    s->expected_seq++;
+    if ((uint64_t)s->written >= s->size) return session_finish(s);
+    return 0;
+}
+
+// Make the reorder ring big enough to park seq, doubling it from REORDER_SLOTS.
+// Everything parked lies within the old ring's span above expected_seq, so the
+// entries move to their new slots without colliding.
+int ooo_reserve(struct session *s, uint64_t seq) {
+    size_t n = s->nooo ? s->nooo : REORDER_SLOTS;
+    while (seq >= s->expected_seq + n) n *= 2;
+    if (n == s->nooo) return 0;
+    struct ooo_pkt *ring = calloc(n, sizeof(*ring));
+    if (!ring) return -1;
+    for (size_t i = 0; i < s->nooo; ++i)
+        if (s->ooo[i].data) ring[s->ooo[i].seq % n] = s->ooo[i];
+    free(s->ooo);
+    s->ooo = ring;
+    s->nooo = n;
+    return 0;
+}
+
+// Write seq if it is next in line (then everything buffered behind it), or park it.
+int session_deliver(struct session *s, uint64_t seq, const unsigned char *data, int len) {
+    if (seq == s->expected_seq) {
+        if (session_append(s, data, len) < 0) return -1;
+        struct ooo_pkt *p;
+        while (session_live(s) && s->nooo && (p = &s->ooo[s->expected_seq % s->nooo])->data &&
+               p->seq == s->expected_seq) {
+            int rc = session_append(s, p->data, p->len);
+            free(p->data);
+            p->data = NULL;
+            if (rc < 0) return -1;
+        }
+    } else if (seq > s->expected_seq && seq < s->expected_seq + REORDER_MAX) {
+        if (ooo_reserve(s, seq) < 0) return -1;
+        struct ooo_pkt *p = &s->ooo[seq % s->nooo];
+        if (!p->data) {
+            p->data = malloc(len > 0 ? len : 1);
+            if (!p->data) return -1;
+            memcpy(p->data, data, len);
+            p->len = len;
+            p->seq = seq;
+        }
+        if (seq > s->ooo_max) s->ooo_max = seq;
+    }
+    return 0;
+}
+
+// Payload of seq if this session still has it, delivered or waiting in order
+const unsigned char *session_payload(struct session *s, uint64_t seq, int *len) {
+    if (seq < s->expected_seq) {
+        struct fec_entry *e = s->fec_cache ? &s->fec_cache[seq % FEC_CACHE] : NULL;
+        if (!e || e->seq != seq) return NULL;
+        *len = e->len;
+        return e->data;
+    }
+    if (!s->nooo) return NULL;
+    struct ooo_pkt *p = &s->ooo[seq % s->nooo];
+    if (!p->data || p->seq != seq) return NULL;
+    *len = p->len;
+    return p->data;
+}
+
+// Rebuild the one payload of a parity block that never arrived: XOR the parity
+// with every payload that did. Returns the recovered seq, 0 if nothing was done.
+uint64_t fec_recover(struct session *s, uint64_t first, const unsigned char *payload, int datalen) {
+    if (!session_live(s) || datalen < FEC_HDR) return 0;
+    uint16_t k;
+    uint32_t len_xor;
+    memcpy(&k, payload, 2);
+    memcpy(&len_xor, payload + 2, 4);
+    k = ntohs(k);
+    len_xor = ntohl(len_xor);
+    int parity_len = datalen - FEC_HDR;
+    if (k == 0 || k > FEC_CACHE / 2 || first + k <= s->expected_seq) return 0;
+
+    uint64_t missing = 0;
+    for (uint64_t seq = first; seq < first + k; ++seq) {
+        int len;
+        if (session_payload(s, seq, &len)) continue;
+        if (missing || seq < s->expected_seq) return 0;
+        missing = seq;
+    }
+    if (!missing) return 0;
+
+    unsigned char *buf = malloc(parity_len > 0 ? parity_len : 1);
+    if (!buf) return 0;
+    memcpy(buf, payload + FEC_HDR, parity_len);
+    for (uint64_t seq = first; seq < first + k; ++seq) {
+        int len;
+        const unsigned char *p = seq == missing ? NULL : session_payload(s, seq, &len);
+        if (!p) continue;
+        if (len > parity_len) {
+            free(buf);
+            return 0;
+        }
+        xor_into(buf, p, len);
+        len_xor ^= len;
+    }
+    uint64_t rc = 0;
+    if ((int)len_xor <= parity_len) {
+        if (session_deliver(s, missing, buf, len_xor) < 0) {
+            perror("write");
+            session_close(s);
+        } else {
+            rc = missing;
+        }
+    }
+    free(buf);
+    return rc;
+}
+
+// Open or finished session for this client address; finished ones stay around
+// to re-ACK retransmits of the last window.
+struct session *find_session(struct worker *w, const struct sockaddr_in *addr) {
+    for (int i = 0; i < MAX_SESSIONS; ++i) {
+        struct session *s = w->sessions[i];
+        if (s && (session_live(s) || s->finished) && s->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+            s->addr.sin_port == addr->sin_port)
+            return s;
+    }
+    return NULL;
+}
+
+// A free slot, or failing that one whose transfer has already finished
+struct session *alloc_session(struct worker *w) {
+    struct session *done = NULL;
+    for (int i = 0; i < MAX_SESSIONS; ++i) {
+        struct session *s = w->sessions[i];
+        if (!s) {
+            s = w->sessions[i] = calloc(1, sizeof(*s));
+            if (s) {
+                s->sockfd = w->sockfd;
+                s->fwd_fd = -1;
+                s->base_fd = -1;
+                s->fold_fd = -1;
+            }
+            return s;
+        }
+        if (!session_live(s) && !s->finished) return s;
+        if (!session_live(s) && !done) done = s;
+    }
+    return done;
+}
+
+void handle_meta(struct worker *w, const struct sockaddr_in *cliaddr, const unsigned char *pkt, int datalen) {
+    const unsigned char *m = pkt + PKT_PREFIX;
+    if (datalen < META_FIXED) return;
+    uint64_t id, size;
+    memcpy(&id, m, 8);
+    memcpy(&size, m + 8, 8);
+    id = be64toh(id);
+    size = be64toh(size);
+    int flags = m[16];
+
+    // Chain: the servers still to come after this one, nearest first
+    int fixed = META_FIXED, nhops = 0;
+    const unsigned char *hops = NULL;
+    if (flags & META_CHAIN) {
+        if (datalen < META_FIXED + 1) return;
+        nhops = m[META_FIXED];
+        hops = m + META_FIXED + 1;
+        fixed += 1 + nhops * HOP_SIZE;
+        if (datalen < fixed) return;
+    }
+
+    char outfile_rel[1024] = {0};
+    int rel_len = datalen - fixed;
+    memcpy(outfile_rel, m + fixed, rel_len < 1023 ? rel_len : 1023);
+    char path[2048];
+    if ((size_t)snprintf(path, sizeof(path), "%s/%s", root_folder, outfile_rel) >= sizeof(path)) {
+        fprintf(stderr, "Path too long\n");
+        return;
+    }
+
+    struct session *s = find_session(w, cliaddr);
+    // A retransmitted META for the running transfer only needs its reply again,
+    // which inside a chain has to come from further down
+    if (s && (session_live(s) || s->fwd_fd >= 0) && strcmp(path, s->path) == 0 && !(flags & META_FRESH && s->start > 0)) {
+        if (s->fwd_fd >= 0) forward_meta(s, pkt, datalen);
+        else send_meta_reply(s);
+        return;
+    }
+    if (s) session_close(s);
+
+    // A restarted client (new port, same transfer id) takes its session over
+    // when it hashes to the same worker; otherwise it waits out the idle close.
+    for (int i = 0; i < MAX_SESSIONS && !s; ++i) {
+        struct session *old = w->sessions[i];
+        if (old && session_live(old) && old->id == id && strcmp(old->path, path) == 0) {
+            session_close(old);
+            s = old;
+        }
+    }
+
+    if (path_acquire(path) < 0) {
+        fprintf(stderr, "File is in progress by another client\n");
+        return;
+    }
+    if (!s) s = alloc_session(w);
+    if (!s) {
+        fprintf(stderr, "Too many sessions on worker %d\n", w->id);
+        path_release(path);
+        return;
+    }
+
+    char path_copy[2048];
+    strncpy(path_copy, path, sizeof(path_copy));
+    path_copy[sizeof(path_copy) - 1] = '\0';
+    if (!(flags & META_BUNDLE) && make_dirs(dirname(path_copy)) < 0) perror("mkdir");
+
+    session_close(s);
+    session_reset(s);
+    strcpy(s->path, path);
+    snprintf(s->part_path, sizeof(s->part_path), "%s.%016llx.part", path, (unsigned long long)id);
+    snprintf(s->fold_path, sizeof(s->fold_path), "%s.%016llx.fold", path, (unsigned long long)id);
+    s->id = id;
+    s->size = size;
+    s->stripe = (flags & META_STRIPE) && !(flags & META_BUNDLE);
+    s->fec = (flags & META_FEC) != 0;
+    s->delta = (flags & META_DELTA) && !s->stripe && !(flags & META_BUNDLE) && nhops == 0;
+    if (s->delta) load_base(s);
+    s->lz4 = (flags & META_LZ4) && !s->stripe && !s->delta;
+    // Stripes, deltas and directories always start over: only the client knows
+    // which extents a stripe held, and a delta or bundle stream cannot be
+    // entered halfway
+    file_hash_init(&s->hash);
+    if (!(flags & (META_FRESH | META_STRIPE | META_BUNDLE)) && !s->delta) find_resume_point(s);
+    else s->start = s->tail_len = s->tail_crc = 0;
+    // Only a whole file written in order here can be checked against the
+    // client's hash: not a stripe, a directory or a chain passing it on
+    s->verify = (flags & META_HASH) && !s->stripe && !(flags & META_BUNDLE) && nhops == 0;
+    s->written = s->start;
+
+    s->tree = (flags & META_BUNDLE) != 0;
+    if (s->tree) s->bundle = bundle_open(path, id);
+    else s->out = writer_open(s->part_path, direct, s->start, s->stripe ? -1 : (off_t)size);
+    if (!session_live(s)) {
+        perror("open");
+        path_release(path);
+        return;
+    }
+    // Any file written in order keeps its folds, chain hops included, so the
+    // next attempt can resume it whether or not that one checks the hash
+    if (!s->tree && !s->stripe && !s->delta) {
+        s->fold_fd = open(s->fold_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (s->fold_fd >= 0 && ftruncate(s->fold_fd, s->start / FILE_HASH_LEAF * 8) < 0) {
+            close(s->fold_fd);
+            s->fold_fd = -1;
+        }
+    } else if (!s->tree) {
+        unlink(s->fold_path);
+    }
+    snprintf(s->client, sizeof(s->client), "%s:%d", inet_ntoa(cliaddr->sin_addr), ntohs(cliaddr->sin_port));
+    s->addr = *cliaddr;
+    s->last_rx_ms = now_ms();
+    if (s->start > 0)
+        fprintf(stderr, "Resuming %s at byte %lld\n", s->path, (long long)s->start);
+    if (!s->stripe && (uint64_t)s->written >= s->size && session_finish(s) < 0) perror("rename");
+
+    if (nhops > 0) {
+        s->fwd_fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (s->fwd_fd < 0) {
+            perror("socket");
+            return;
+        }
+        memset(&s->next, 0, sizeof(s->next));
+        s->next.sin_family = AF_INET;
+        memcpy(&s->next.sin_addr, hops, 4);
+        memcpy(&s->next.sin_port, hops + 4, 2);
+        forward_meta(s, pkt, datalen);
+    } else {
+        send_meta_reply(s);
+        if (s->sigs && !s->signing) sign_finish(s);
+    }
+}
+
+// The client's hash of the whole file: move the part file into place if it
+// matches the one taken here as the bytes were written, delete it if not.
+// A repeated FIN gets the same verdict again.
+void handle_fin(struct worker *w, const struct sockaddr_in *cliaddr, const unsigned char *pkt, int datalen) {
+    struct session *s = find_session(w, cliaddr);
+    int verdict = FIN_UNKNOWN;
+    uint64_t mine = 0;
+    if (s && s->verify && s->finished && datalen >= 8) {
+        uint64_t theirs;
+        memcpy(&theirs, pkt + PKT_PREFIX, 8);
+        theirs = be64toh(theirs);
+        mine = s->digest;
+        if (s->held) {
+            s->held = 0;
+            if (theirs != mine) {
+                fprintf(stderr, "Hash mismatch for %s from %s: client %016llx, server %016llx\n", s->path, s->client,
+                        (unsigned long long)theirs, (unsigned long long)mine);
+                if (unlink(s->part_path) < 0) perror("unlink");
+                unlink(s->fold_path);
+                s->verdict = FIN_MISMATCH;
+            } else if (rename(s->part_path, s->path) < 0) {
+                perror("rename");
+                s->verdict = FIN_ERROR;
+            } else {
+                unlink(s->fold_path);
+                s->verdict = FIN_OK;
+            }
+            path_release(s->path);
+        }
+        verdict = s->verdict;
+    }
+    if (should_drop(droppc)) {
+        log_pkt(TRACE_DROP_ACK, "DROP ACK", cliaddr, 0);
+        return;
+    }
+
+    unsigned char reply[HEADER_SIZE + FIN_REPLY + TRAILER_SIZE];
+    uint64_t net = htobe64(mine);
+    pkt_put_header(reply, TYPE_FIN, 0, FIN_REPLY);
+    reply[HEADER_SIZE] = verdict;
+    memcpy(reply + HEADER_SIZE + 1, &net, 8);
+    pkt_seal(reply, HEADER_SIZE + FIN_REPLY);
+    sendto(w->sockfd, reply, sizeof(reply), 0, (const struct sockaddr *)cliaddr, sizeof(*cliaddr));
+    log_pkt(TRACE_ACK, "ACK", cliaddr, 0);
+}
+
+// Delayed ACKs, idle flushes and idle closes; returns ms until the next is due.
+long long worker_timers(struct worker *w) {
+    long long now = now_ms(), wait = -1;
+    for (int i = 0; i < MAX_SESSIONS; ++i) {
+        struct session *s = w->sessions[i];
+        if (!s || (!session_live(s) && s->fwd_fd < 0 && !s->held)) continue;
+        // Waiting on our own sign thread is not the client going quiet
+        if (s->signing) {
+            if (__atomic_load_n(&s->sign_done, __ATOMIC_ACQUIRE)) sign_finish(s);
+            else s->last_rx_ms = now;
+            if (!session_live(s)) continue;
+        }
+        if (s->ack_due_ms && now >= s->ack_due_ms) send_ack(s);
+        if (s->out && s->dirty && now - s->last_rx_ms >= IDLE_FLUSH_MS) {
+            if (writer_flush(s->out) < 0) perror("write");
+            s->dirty = 0;
+        }
+        if (now - s->last_rx_ms >= SESSION_IDLE_SEC * 1000LL) {
+            session_close(s);
+            session_reset(s);
+            continue;
+        }
+        long long due = s->ack_due_ms ? s->ack_due_ms - now : IDLE_FLUSH_MS;
+        if (s->signing && due > SIGN_POLL_MS) due = SIGN_POLL_MS;
+        if (due < 0) due = 0;
+        if (wait < 0 || due < wait) wait = due;
+    }
+    return wait;
+}
 
-    FILE *fout = NULL;
-    int expected_seq = 1;
+void *worker_loop(void *arg) {
+    struct worker *w = arg;
+    drop_seed = time(NULL) ^ (w->id * 2654435761u);
     char buffer[MAX_PACKET_SIZE];
-    char active_path[2048];
-    char active_client[64] = "";
+    struct sockaddr_in cliaddr;
+
+    while (!stop) {
+        // Disk writes happen behind the writer; the loop only wakes up for a
+        // delayed ACK, to push a partial buffer out when the sender goes quiet,
+        // and to end idle sessions. The 1 s cap lets a stop request through.
+        long long wait = worker_timers(w);
+        if (wait < 0 || wait > 1000) wait = 1000;
+        struct timeval tv = { .tv_sec = wait / 1000, .tv_usec = (wait % 1000) * 1000 };
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(w->sockfd, &readfds);
+        int maxfd = w->sockfd;
+        for (int i = 0; i < MAX_SESSIONS; ++i) {
+            struct session *s = w->sessions[i];
+            if (!s || s->fwd_fd < 0) continue;
+            FD_SET(s->fwd_fd, &readfds);
+            if (s->fwd_fd > maxfd) maxfd = s->fwd_fd;
+        }
+        if (select(maxfd + 1, &readfds, NULL, NULL, &tv) <= 0) continue;
+        for (int i = 0; i < MAX_SESSIONS; ++i) {
+            struct session *s = w->sessions[i];
+            if (s && s->fwd_fd >= 0 && FD_ISSET(s->fwd_fd, &readfds)) relay_downstream(s);
+        }
+        if (!FD_ISSET(w->sockfd, &readfds)) continue;
 
-    while (1) {
         socklen_t len = sizeof(cliaddr);
-        ssize_t recv_len = recvfrom(sockfd, buffer, MAX_PACKET_SIZE, 0, (struct sockaddr *)&cliaddr, &len);
-        if (recv_len < HEADER_SIZE + CRUZID_LEN + 1) continue;
+        ssize_t recv_len = recvfrom(w->sockfd, buffer, MAX_PACKET_SIZE, 0, (struct sockaddr *)&cliaddr, &len);
+        if (recv_len < PKT_PREFIX + TRAILER_SIZE) continue;
+        __atomic_add_fetch(&w->packets, 1, __ATOMIC_RELAXED);
 
-        unsigned char type = buffer[0];
-        int seq, datalen;
-        memcpy(&seq, buffer + 1, 4);
-        memcpy(&datalen, buffer + 5, 4);
-        seq = ntohl(seq);
-        datalen = ntohl(datalen);
+        unsigned char type = PKT_TYPE(buffer[0]);
+        uint64_t seq = pkt_seq((unsigned char *)buffer);
+        int datalen = pkt_len((unsigned char *)buffer);
 
         if (should_drop(droppc)) {
-            printf("%s, %d, %s, %d, DROP %s, %d\n", rfc3339_time(), port, inet_ntoa(cliaddr.sin_addr), ntohs(cliaddr.sin_port), (type == TYPE_DATA ? "DATA" : "META"), seq);
+            if (type == TYPE_DATA) log_pkt(TRACE_DROP_DATA, "DROP DATA", &cliaddr, seq);
+            else if (type == TYPE_PARITY) log_pkt(TRACE_DROP_PARITY, "DROP PARITY", &cliaddr, seq);
+            else if (type == TYPE_SIG) log_pkt(TRACE_DROP_SIG, "DROP SIG", &cliaddr, seq);
+            else if (type == TYPE_PROBE) log_pkt(TRACE_DROP_PROBE, "DROP PROBE", &cliaddr, seq);
+            else log_pkt(TRACE_DROP_META, "DROP META", &cliaddr, seq);
             continue;
         }
 
-        unsigned char received_chk = buffer[recv_len - 1];
-        unsigned char computed_chk = checksum((unsigned char *)buffer, recv_len - 1);
-        if (received_chk != computed_chk) continue;
-
-        char client_id[64];
-        snprintf(client_id, sizeof(client_id), "%s:%d", inet_ntoa(cliaddr.sin_addr), ntohs(cliaddr.sin_port));
+        if (!pkt_valid((unsigned char *)buffer, recv_len)) continue;
+        if (datalen < 0 || datalen > recv_len - PKT_PREFIX - TRAILER_SIZE) continue;
 
+        const unsigned char *payload = (unsigned char *)buffer + PKT_PREFIX;
         if (type == TYPE_META && seq == 0) {
-            if (fout != NULL && strcmp(active_client, client_id) != 0) {
-                fprintf(stderr, "File is in progress by another client\n");
+            handle_meta(w, &cliaddr, (unsigned char *)buffer, datalen);
+        } else if (type == TYPE_FIN) {
+            handle_fin(w, &cliaddr, (unsigned char *)buffer, datalen);
+        } else if (type == TYPE_PROBE) {
+            // Path MTU probe from a client given mss auto: say how much arrived
+            unsigned char reply[PKT_PROBE_REPLY];
+            pkt_put_probe_reply(reply, seq, recv_len);
+            sendto(w->sockfd, reply, sizeof(reply), 0, (struct sockaddr *)&cliaddr, len);
+        } else if (type == TYPE_SIG) {
+            // The client asks again for a signature packet it did not get
+            struct session *s = find_session(w, &cliaddr);
+            if (s && s->sigs && !s->signing) send_signatures(s, seq);
+        } else if (type == TYPE_DATA || type == TYPE_PARITY) {
+            struct session *s = find_session(w, &cliaddr);
+            if (!s) continue;
+            s->last_rx_ms = now_ms();
+            // Chain: pass the packet on untouched before writing it here
+            if (s->fwd_fd >= 0)
+                sendto(s->fwd_fd, buffer, recv_len, 0, (struct sockaddr *)&s->next, sizeof(s->next));
+            if (type == TYPE_PARITY) {
+                uint64_t rebuilt = fec_recover(s, seq, payload, datalen);
+                if (!rebuilt) continue;
+                log_pkt(TRACE_FEC, "FEC", &cliaddr, rebuilt);
+            } else if (session_live(s) && session_deliver(s, seq, payload, datalen) < 0) {
+                perror("write");
+                session_close(s);
                 continue;
             }
+            // ACKs from the end of the chain drive this server's ACKs
+            if (s->fwd_fd >= 0) continue;
+            // The final ACK goes out at once, after the fsync policy has run, and so
+            // does one for a rebuilt packet so the client never resends it
+            if (s->finished || type == TYPE_PARITY || ++s->unacked >= ack_every) send_ack(s);
+            else if (!s->ack_due_ms) s->ack_due_ms = s->last_rx_ms + ACK_DELAY_MS;
+        }
+    }
 
-            char outfile_rel[1024] = {0};
-            memcpy(outfile_rel, buffer + HEADER_SIZE + CRUZID_LEN, datalen);
-            if ((size_t)snprintf(active_path, sizeof(active_path), "%s/%s", root_folder, outfile_rel) >= sizeof(active_path)) {
-                fprintf(stderr, "Path too long\n");
-                continue;
-            }
+    for (int i = 0; i < MAX_SESSIONS; ++i)
+        if (w->sessions[i]) session_close(w->sessions[i]);
+    return NULL;
+}
+
+// Pick the worker socket from the source address and port so all of a client's
+// datagrams reach the worker holding its session. Assumes a 20-byte IPv4
+// header; without the filter the kernel's 4-tuple hash keeps flows in place too.
+int attach_steering(int sockfd, int nworkers) {
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_NET_OFF + 12 },  // source address
+        { BPF_MISC | BPF_TAX, 0, 0, 0 },
+        { BPF_LD | BPF_H | BPF_ABS, 0, 0, SKF_NET_OFF + 20 },  // source port
+        { BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0 },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (unsigned)nworkers },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+    return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+int open_worker_socket() {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        perror("socket");
+        return -1;
+    }
+    int one = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("setsockopt");
+        close(sockfd);
+        return -1;
+    }
+    // A large window arrives as a burst well past the default receive buffer
+    int rcvbuf = RCVBUF_SIZE;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0) perror("setsockopt");
+
+    struct sockaddr_in servaddr;
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = INADDR_ANY;
+    servaddr.sin_port = htons(port);
+
+    if (bind(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+        perror("bind");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
 
-            char path_copy[2048];
-            strncpy(path_copy, active_path, sizeof(path_copy));
-            path_copy[sizeof(path_copy) - 1] = '\0';
-            char mkdir_cmd[2048];
-            snprintf(mkdir_cmd, sizeof(mkdir_cmd), "mkdir -p %s", dirname(path_copy));
-            system(mkdir_cmd);
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d] [-f none|data|full] [-a ack_every] [-n workers] [-s] [-T trace] <port> <droppc> <root_folder>\n", prog);
+}
 
-            fout = fopen(active_path, "wb");
-            if (!fout) {
-                perror("fopen");
+int main(int argc, char *argv[]) {
+    int nworkers = 1, show_stats = 0;
+    const char *trace_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "df:a:n:sT:")) != -1) {
+        switch (opt) {
+        case 'd':
+            direct = 1;
+            break;
+        case 'f':
+            policy = parse_fsync_policy(optarg);
+            if (policy < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'a':
+            ack_every = atoi(optarg);
+            if (ack_every < 1) {
+                usage(argv[0]);
                 return 1;
             }
-            strncpy(active_client, client_id, sizeof(active_client));
-            expected_seq = 1;
-        } else if (type == TYPE_DATA && seq == expected_seq && fout != NULL) {
-            fwrite(buffer + HEADER_SIZE + CRUZID_LEN, 1, datalen, fout);
-            fflush(fout);
-            expected_seq++;
+            break;
+        case 'n':
+            nworkers = atoi(optarg);
+            if (nworkers < 1 || nworkers > MAX_WORKERS) {
+                fprintf(stderr, "Worker count must be between 1 and %d\n", MAX_WORKERS);
+                return 1;
+            }
+            break;
+        case 's':
+            show_stats = 1;
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
         }
+    }
+    if (argc - optind != 3) {
+        usage(argv[0]);
+        return 1;
+    }
 
-        if (should_drop(droppc)) {
-            printf("%s, %d, %s, %d, DROP ACK, %d\n", rfc3339_time(), port, inet_ntoa(cliaddr.sin_addr), ntohs(cliaddr.sin_port), seq);
-            continue;
-        }
+    port = atoi(argv[optind]);
+    droppc = atoi(argv[optind + 1]);
+    root_folder = argv[optind + 2];
+    if (trace_path && trace_open(trace_path, TRACE_LAB4_SERVER, port) < 0) {
+        perror("open trace");
+        return 1;
+    }
+
+    // Stop cleanly so a partial file keeps everything that was received
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    static struct worker workers[MAX_WORKERS];
+    for (int i = 0; i < nworkers; ++i) {
+        workers[i].id = i;
+        workers[i].sockfd = open_worker_socket();
+        if (workers[i].sockfd < 0) return 1;
+    }
+    if (nworkers > 1 && attach_steering(workers[0].sockfd, nworkers) < 0)
+        perror("SO_ATTACH_REUSEPORT_CBPF");
+
+    printf("Server listening on port %d...\n", port);
 
-        char ack[10] = {0};
-        ack[0] = TYPE_META;
-        int net_seq = htonl(seq);
-        int dummy = htonl(0);
-        memcpy(ack + 1, &net_seq, 4);
-        memcpy(ack + 5, &dummy, 4);
-        ack[9] = checksum((unsigned char *)ack, 9);
-        sendto(sockfd, ack, 10, 0, (struct sockaddr *)&cliaddr, len);
+    // One worker per core, wrapping around when there are more workers than cores
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < nworkers; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+        if (nworkers > 1 && ncpu > 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(i % ncpu, &set);
+            pthread_setaffinity_np(workers[i].thread, sizeof(set), &set);
+        }
+    }
 
-        printf("%s, %d, %s, %d, ACK, %d\n", rfc3339_time(), port, inet_ntoa(cliaddr.sin_addr), ntohs(cliaddr.sin_port), seq);
+    // Packets per second in total and per worker, for lines with traffic
+    unsigned long long last[MAX_WORKERS] = {0};
+    while (!stop) {
+        sleep(1);
+        if (!show_stats) continue;
+        unsigned long long total = 0;
+        char line[1024];
+        int n = 0;
+        line[0] = '\0';
+        for (int i = 0; i < nworkers; ++i) {
+            unsigned long long cur = __atomic_load_n(&workers[i].packets, __ATOMIC_RELAXED);
+            total += cur - last[i];
+            if (n < (int)sizeof(line)) n += snprintf(line + n, sizeof(line) - n, ", %llu", cur - last[i]);
+            last[i] = cur;
+        }
+        if (total) fprintf(stderr, "%s, STATS, %d, %llu%s\n", rfc3339_time(), nworkers, total, line);
     }
 
-    if (fout) fclose(fout);
-    close(sockfd);
+    for (int i = 0; i < nworkers; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        close(workers[i].sockfd);
+    }
     return 0;
 }
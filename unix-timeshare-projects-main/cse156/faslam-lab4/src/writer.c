@@ -0,0 +1,389 @@
+// writer.c — coalescing writer thread with a minimal raw io_uring backend
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "writer.h"
+
+#define DIRECT_ALIGN 4096
+
+struct wbuf {
+    unsigned char *data;
+    size_t len;
+    off_t off;
+};
+
+struct uring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_sz, cq_sz, sqes_sz;
+};
+
+struct writer {
+    int fd;         // O_DIRECT when requested and supported
+    int tail_fd;    // buffered descriptor for unaligned pieces
+    off_t end;
+    off_t high;     // furthest byte written before the last seek
+    off_t prealloc; // -1 for sparse files
+    struct wbuf bufs[WRITER_NBUFS];
+    struct wbuf *cur;
+    struct wbuf *freelist[WRITER_NBUFS];
+    int nfree;
+    struct wbuf *queue[WRITER_NBUFS];
+    int qhead, qlen;
+    int closing;
+    int busy;       // the thread is writing a batch
+    int error;
+    int have_ring;
+    int ring_ok;    // some io_uring write has succeeded, so the kernel has IORING_OP_WRITE
+    struct uring ring;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static int uring_setup(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) return -1;
+    r->sq_ring = r->cq_ring = MAP_FAILED;
+    r->sqes = MAP_FAILED;
+
+    r->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        if (r->cq_sz > r->sq_sz) r->sq_sz = r->cq_sz;
+        r->cq_sz = r->sq_sz;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) goto fail;
+    r->cq_ring = single ? r->sq_ring
+                        : mmap(NULL, r->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED) goto fail;
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) goto fail;
+
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    if (r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_sz);
+    if (r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_sz);
+    if (r->sq_ring != MAP_FAILED) munmap(r->sq_ring, r->sq_sz);
+    close(r->fd);
+    return -1;
+}
+
+static void uring_teardown(struct uring *r) {
+    munmap(r->sqes, r->sqes_sz);
+    if (r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_sz);
+    munmap(r->sq_ring, r->sq_sz);
+    close(r->fd);
+}
+
+static int pwrite_full(int fd, const unsigned char *data, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        data += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+static int buf_fd(struct writer *w, const struct wbuf *b) {
+    if ((b->off % DIRECT_ALIGN) || (b->len % DIRECT_ALIGN)) return w->tail_fd;
+    return w->fd;
+}
+
+// Submit the whole batch with one io_uring_enter and reap every completion.
+// The writes are linked, so they reach the file in order: a server killed
+// mid-batch leaves a prefix of it, never a hole below the end of the file.
+static int uring_write_batch(struct writer *w, struct wbuf **batch, int n) {
+    struct uring *r = &w->ring;
+    unsigned tail = *r->sq_tail;
+    for (int i = 0; i < n; ++i) {
+        unsigned idx = tail & *r->sq_mask;
+        struct io_uring_sqe *sqe = &r->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = buf_fd(w, batch[i]);
+        sqe->addr = (uintptr_t)batch[i]->data;
+        sqe->len = batch[i]->len;
+        sqe->off = batch[i]->off;
+        sqe->user_data = i;
+        if (i < n - 1) sqe->flags = IOSQE_IO_LINK;
+        r->sq_array[idx] = idx;
+        tail++;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    int submitted = 0;
+    while (submitted < n) {
+        int ret = syscall(__NR_io_uring_enter, r->fd, n - submitted, 0, 0, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        submitted += ret;
+    }
+
+    int res[WRITER_NBUFS];
+    int err = 0, done = 0;
+    unsigned head = *r->cq_head;
+    while (done < n) {
+        if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            if (syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+                return errno;
+            continue;
+        }
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        res[cqe->user_data] = cqe->res;
+        if (cqe->res >= 0) w->ring_ok = 1;
+        head++;
+        done++;
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // A short write breaks the link and cancels the writes after it: finish
+    // it and write those here, still in order
+    for (int i = 0; i < n && !err; ++i) {
+        struct wbuf *b = batch[i];
+        int got = res[i] == -ECANCELED && i > 0 ? 0 : res[i];
+        if (got < 0) err = -got;
+        else if ((size_t)got < b->len) err = pwrite_full(w->tail_fd, b->data + got, b->len - got, b->off + got);
+    }
+    return err;
+}
+
+static int write_batch(struct writer *w, struct wbuf **batch, int n) {
+    off_t want = batch[n - 1]->off + batch[n - 1]->len;
+    if (w->prealloc >= 0 && want > w->prealloc) {
+        off_t grow = want - w->prealloc;
+        if (grow < WRITER_PREALLOC_STEP) grow = WRITER_PREALLOC_STEP;
+        if (fallocate(w->tail_fd, FALLOC_FL_KEEP_SIZE, w->prealloc, grow) == 0) w->prealloc += grow;
+    }
+
+    if (w->have_ring) {
+        int err = uring_write_batch(w, batch, n);
+        // io_uring_setup() works on kernels older than IORING_OP_WRITE (5.6),
+        // which then fail every write: use pwrite from here on and write this
+        // batch again
+        if (w->ring_ok || (err != EINVAL && err != EOPNOTSUPP)) return err;
+        uring_teardown(&w->ring);
+        w->have_ring = 0;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        int err = pwrite_full(buf_fd(w, batch[i]), batch[i]->data, batch[i]->len, batch[i]->off);
+        if (err) return err;
+    }
+    return 0;
+}
+
+static void *writer_thread(void *arg) {
+    struct writer *w = arg;
+    struct wbuf *batch[WRITER_NBUFS];
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->qlen == 0 && !w->closing) pthread_cond_wait(&w->cond, &w->lock);
+        if (w->qlen == 0) break;
+
+        int n = 0;
+        while (w->qlen > 0) {
+            batch[n++] = w->queue[w->qhead];
+            w->qhead = (w->qhead + 1) % WRITER_NBUFS;
+            w->qlen--;
+        }
+        w->busy = 1;
+        pthread_mutex_unlock(&w->lock);
+        int err = write_batch(w, batch, n);
+        pthread_mutex_lock(&w->lock);
+        w->busy = 0;
+
+        if (err && !w->error) w->error = err;
+        for (int i = 0; i < n; ++i) w->freelist[w->nfree++] = batch[i];
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+struct writer *writer_open(const char *path, int direct, off_t start, off_t size) {
+    struct writer *w = calloc(1, sizeof(*w));
+    if (!w) return NULL;
+
+    w->fd = w->tail_fd = -1;
+    if (direct) {
+        w->fd = open(path, O_WRONLY | O_CREAT | O_DIRECT, 0644);
+        if (w->fd < 0 && errno != EINVAL) goto fail;
+    }
+    if (w->fd < 0) {
+        w->fd = open(path, O_WRONLY | O_CREAT, 0644);
+        if (w->fd < 0) goto fail;
+        w->tail_fd = w->fd;
+    } else {
+        w->tail_fd = open(path, O_WRONLY);
+        if (w->tail_fd < 0) goto fail;
+    }
+
+    if (ftruncate(w->tail_fd, start) < 0) goto fail;
+    w->end = start;
+    w->prealloc = size < 0 ? -1 : start;
+    if (size > start && fallocate(w->tail_fd, FALLOC_FL_KEEP_SIZE, start, size - start) == 0)
+        w->prealloc = size;
+
+    for (int i = 0; i < WRITER_NBUFS; ++i) {
+        void *p;
+        if (posix_memalign(&p, DIRECT_ALIGN, WRITER_BUF_SIZE) != 0) goto fail;
+        w->bufs[i].data = p;
+        w->freelist[w->nfree++] = &w->bufs[i];
+    }
+    w->cur = w->freelist[--w->nfree];
+    w->cur->len = 0;
+    w->cur->off = start;
+
+    w->have_ring = uring_setup(&w->ring, WRITER_NBUFS) == 0;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if (pthread_create(&w->thread, NULL, writer_thread, w) != 0) {
+        if (w->have_ring) uring_teardown(&w->ring);
+        goto fail;
+    }
+    return w;
+
+fail:
+    for (int i = 0; i < WRITER_NBUFS; ++i) free(w->bufs[i].data);
+    if (w->tail_fd >= 0 && w->tail_fd != w->fd) close(w->tail_fd);
+    if (w->fd >= 0) close(w->fd);
+    free(w);
+    return NULL;
+}
+
+// Hand the full current buffer to the writer thread and pick up a free one.
+static int rotate(struct writer *w) {
+    pthread_mutex_lock(&w->lock);
+    w->queue[(w->qhead + w->qlen) % WRITER_NBUFS] = w->cur;
+    w->qlen++;
+    pthread_cond_broadcast(&w->cond);
+    while (w->nfree == 0 && !w->error) pthread_cond_wait(&w->cond, &w->lock);
+    int err = w->error;
+    if (!err) {
+        w->cur = w->freelist[--w->nfree];
+        w->cur->len = 0;
+        w->cur->off = w->end;
+    }
+    pthread_mutex_unlock(&w->lock);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int writer_append(struct writer *w, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len > 0) {
+        size_t n = WRITER_BUF_SIZE - w->cur->len;
+        if (n > len) n = len;
+        memcpy(w->cur->data + w->cur->len, p, n);
+        w->cur->len += n;
+        w->end += n;
+        p += n;
+        len -= n;
+        if (w->cur->len == WRITER_BUF_SIZE && rotate(w) < 0) return -1;
+    }
+    return 0;
+}
+
+int writer_seek(struct writer *w, off_t off) {
+    if (w->end > w->high) w->high = w->end;
+    if (w->cur->len > 0 && rotate(w) < 0) return -1;
+    w->end = off;
+    w->cur->off = off;
+    return 0;
+}
+
+// The partial buffer stays in place and is written again once it fills up.
+// It goes after the full buffers ahead of it have landed, so the file never
+// has a hole below its end.
+int writer_flush(struct writer *w) {
+    if (w->cur->len == 0) return 0;
+    pthread_mutex_lock(&w->lock);
+    while ((w->qlen > 0 || w->busy) && !w->error) pthread_cond_wait(&w->cond, &w->lock);
+    int err = w->error;
+    pthread_mutex_unlock(&w->lock);
+    if (!err) err = pwrite_full(w->tail_fd, w->cur->data, w->cur->len, w->cur->off);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int writer_close(struct writer *w, enum fsync_policy policy) {
+    pthread_mutex_lock(&w->lock);
+    w->closing = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+
+    int err = w->error;
+    if (!err) err = pwrite_full(w->tail_fd, w->cur->data, w->cur->len, w->cur->off);
+    // Release whatever fallocate reserved past the real end of file
+    if (w->end > w->high) w->high = w->end;
+    if (!err && ftruncate(w->tail_fd, w->high) < 0) err = errno;
+    if (!err && policy == FSYNC_DATA && fdatasync(w->fd) < 0) err = errno;
+    if (!err && policy == FSYNC_FULL && fsync(w->fd) < 0) err = errno;
+
+    if (w->have_ring) uring_teardown(&w->ring);
+    if (w->tail_fd != w->fd) close(w->tail_fd);
+    close(w->fd);
+    for (int i = 0; i < WRITER_NBUFS; ++i) free(w->bufs[i].data);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    free(w);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int parse_fsync_policy(const char *s) {
+    if (strcmp(s, "none") == 0) return FSYNC_NONE;
+    if (strcmp(s, "data") == 0) return FSYNC_DATA;
+    if (strcmp(s, "full") == 0) return FSYNC_FULL;
+    return -1;
+}
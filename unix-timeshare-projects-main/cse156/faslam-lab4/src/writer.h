@@ -0,0 +1,44 @@
+// writer.h — asynchronous, coalescing file writer for the lab4 server
+//
+// The receive loop hands in-order payloads to writer_append(), which only
+// copies them into a large aligned buffer. Full buffers are written by a
+// background thread in batches through io_uring (plain pwrite when io_uring
+// is unavailable), so the loop never waits on the disk before sending ACKs.
+// Buffers reach the file strictly in order, so a server killed mid-write
+// leaves a prefix of what was appended: resuming from the file size is safe.
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <sys/types.h>
+
+#define WRITER_BUF_SIZE (1 << 20)
+#define WRITER_NBUFS 8
+#define WRITER_PREALLOC_STEP (64 << 20)
+
+enum fsync_policy { FSYNC_NONE, FSYNC_DATA, FSYNC_FULL };
+
+struct writer;
+
+// Open path and continue writing at byte start, dropping anything after it.
+// direct != 0 writes full buffers with O_DIRECT; a positive size reserves the
+// whole file up front, zero reserves space in WRITER_PREALLOC_STEP steps and a
+// negative size reserves nothing, for sparse files written with writer_seek().
+struct writer *writer_open(const char *path, int direct, off_t start, off_t size);
+
+// Queue len bytes at the current end of the file; returns -1 on a write error.
+int writer_append(struct writer *w, const void *data, size_t len);
+
+// Continue appending at byte off; the data queued so far still goes where it was.
+int writer_seek(struct writer *w, off_t off);
+
+// Push the partially filled buffer to the file without waiting for it to fill.
+int writer_flush(struct writer *w);
+
+// Drain everything, apply the fsync policy and free the writer.
+int writer_close(struct writer *w, enum fsync_policy policy);
+
+// Parse "none" / "data" / "full"; returns -1 for anything else.
+int parse_fsync_policy(const char *s);
+
+#endif
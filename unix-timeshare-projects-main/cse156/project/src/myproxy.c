@@ -18,12 +18,39 @@
    #define MAX_HOST 256
    #define MAX_LOG_LINE 2048
    #define MAX_FORBIDDEN 1000
+   #define MAX_ORIGINS 1024           // origins whose health is tracked
+   #define BREAKER_THRESHOLD 5        // consecutive failures that open the breaker
+   #define BREAKER_COOLDOWN_MS 5000   // open this long before a probe is let through
+   #define BREAKER_MAX_COOLDOWN_MS 60000
+   #define NEG_CACHE_MS 2000          // a DNS or connect failure is answered from memory this long
    
    char *forbidden_sites[MAX_FORBIDDEN];
    int forbidden_count = 0;
    FILE *log_file;
+   FILE *breaker_file;
    pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
    
+   enum { CLOSED, OPEN, HALF_OPEN };
+   static const char *state_name[] = { "closed", "open", "half-open" };
+   
+   // Health of one host:port. While the breaker is open every request fails at
+   // once; after the cooldown one probe request goes through and its outcome
+   // closes the breaker or opens it again for twice as long.
+   struct origin {
+       char key[MAX_HOST + 8];
+       int state;
+       int failures;                  // in a row
+       int probing;                   // half-open and the probe is in flight
+       long long open_until_ms;
+       long long cooldown_ms;
+       long long neg_until_ms;        // negative cache of the last DNS or connect failure
+       int neg_status;
+       long requests, failed, short_circuited;
+   };
+   
+   struct origin origins[MAX_ORIGINS];
+   pthread_mutex_t origin_mutex = PTHREAD_MUTEX_INITIALIZER;
+   
    char *rfc3339_time() {
        static char buf[64];
        struct timespec ts;
@@ -35,6 +62,95 @@
        return buf;
    }
    
+   long long now_ms() {
+       struct timespec ts;
+       clock_gettime(CLOCK_MONOTONIC, &ts);
+       return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+   }
+   
+   // Slot for key, claimed if it is new; NULL once the table is full
+   struct origin *origin_find(const char *key) {
+       unsigned long h = 5381;
+       for (const char *c = key; *c; c++) h = h * 33 + (unsigned char)*c;
+       for (int i = 0; i < MAX_ORIGINS; i++) {
+           struct origin *o = &origins[(h + i) % MAX_ORIGINS];
+           if (o->key[0] == '\0') {
+               snprintf(o->key, sizeof(o->key), "%s", key);
+               o->cooldown_ms = BREAKER_COOLDOWN_MS;
+               return o;
+           }
+           if (strcmp(o->key, key) == 0) return o;
+       }
+       return NULL;
+   }
+   
+   // One line per breaker transition, next to the access log
+   void log_breaker(const struct origin *o, int from) {
+       pthread_mutex_lock(&log_mutex);
+       fprintf(breaker_file, "%s %s %s->%s failures %d requests %ld failed %ld short-circuited %ld\n", rfc3339_time(),
+               o->key, state_name[from], state_name[o->state], o->failures, o->requests, o->failed, o->short_circuited);
+       fflush(breaker_file);
+       pthread_mutex_unlock(&log_mutex);
+   }
+   
+   // 0 when a request to key may go ahead (possibly as the half-open probe), or
+   // the status to fail it with right away
+   int origin_admit(const char *key) {
+       pthread_mutex_lock(&origin_mutex);
+       struct origin *o = origin_find(key);
+       int status = 0;
+       if (o) {
+           long long now = now_ms();
+           o->requests++;
+           if (o->neg_until_ms > now) {
+               status = o->neg_status;
+           } else if (o->state == OPEN && o->open_until_ms <= now) {
+               o->state = HALF_OPEN;
+               o->probing = 1;
+               log_breaker(o, OPEN);
+           } else if (o->state == OPEN || (o->state == HALF_OPEN && o->probing)) {
+               status = o->neg_status;
+           }
+           if (status) o->short_circuited++;
+       }
+       pthread_mutex_unlock(&origin_mutex);
+       return status;
+   }
+   
+   // Outcome of an admitted request: status 0 once the origin completed the TLS
+   // handshake, else the error it got. cache puts the failure in the negative
+   // cache, as DNS and connect failures are.
+   void origin_report(const char *key, int status, int cache) {
+       pthread_mutex_lock(&origin_mutex);
+       struct origin *o = origin_find(key);
+       if (o) {
+           int from = o->state;
+           if (status == 0) {
+               o->failures = 0;
+               o->probing = 0;
+               o->cooldown_ms = BREAKER_COOLDOWN_MS;
+               o->state = CLOSED;
+           } else {
+               long long now = now_ms();
+               o->failures++;
+               o->failed++;
+               o->neg_status = status;
+               if (cache) o->neg_until_ms = now + NEG_CACHE_MS;
+               if (from == HALF_OPEN) {
+                   o->probing = 0;
+                   o->cooldown_ms *= 2;
+                   if (o->cooldown_ms > BREAKER_MAX_COOLDOWN_MS) o->cooldown_ms = BREAKER_MAX_COOLDOWN_MS;
+               }
+               if (from == HALF_OPEN || (from == CLOSED && o->failures >= BREAKER_THRESHOLD)) {
+                   o->state = OPEN;
+                   o->open_until_ms = now + o->cooldown_ms;
+               }
+           }
+           if (o->state != from) log_breaker(o, from);
+       }
+       pthread_mutex_unlock(&origin_mutex);
+   }
+   
    int is_forbidden(const char *host) {
        for (int i = 0; i < forbidden_count; i++) {
            if (strstr(host, forbidden_sites[i])) return 1;
@@ -126,8 +242,19 @@
            return NULL;
        }
    
+       // Origins known to be failing are answered without a lookup or connect
+       char origin[MAX_HOST + 8];
+       snprintf(origin, sizeof(origin), "%.*s:%d", MAX_HOST - 1, hostname, port);
+       int fast = origin_admit(origin);
+       if (fast) {
+           send_http_error(client_fd, fast, fast == 504 ? "Gateway Timeout" : "Bad Gateway", client_ip, buffer);
+           close(client_fd);
+           return NULL;
+       }
+   
        struct hostent *he = gethostbyname(hostname);
        if (!he) {
+           origin_report(origin, 502, 1);
            send_http_error(client_fd, 502, "Bad Gateway", client_ip, buffer);
            close(client_fd);
            return NULL;
@@ -142,6 +269,7 @@
    
        int conn_res = connect(server_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
        if (conn_res < 0 && errno != EINPROGRESS) {
+           origin_report(origin, 504, 1);
            send_http_error(client_fd, 504, "Gateway Timeout", client_ip, buffer);
            close(server_fd);
            close(client_fd);
@@ -157,6 +285,7 @@
    
        int sel_res = select(server_fd + 1, NULL, &wfds, NULL, &tv);
        if (sel_res <= 0) {
+           origin_report(origin, 504, 1);
            send_http_error(client_fd, 504, "Gateway Timeout", client_ip, buffer);
            close(server_fd);
            close(client_fd);
@@ -167,6 +296,7 @@
        socklen_t len_opt = sizeof(so_error);
        getsockopt(server_fd, SOL_SOCKET, SO_ERROR, &so_error, &len_opt);
        if (so_error != 0) {
+           origin_report(origin, 504, 1);
            send_http_error(client_fd, 504, "Gateway Timeout", client_ip, buffer);
            close(server_fd);
            close(client_fd);
@@ -181,10 +311,12 @@
        SSL *ssl = SSL_new(ctx);
        SSL_set_fd(ssl, server_fd);
        if (SSL_connect(ssl) != 1) {
+           origin_report(origin, 502, 0);
            send_http_error(client_fd, 502, "Bad Gateway", client_ip, buffer);
            SSL_free(ssl); SSL_CTX_free(ctx); close(server_fd); close(client_fd);
            return NULL;
        }
+       origin_report(origin, 0, 0);
    
        char modified[MAX_REQ];
        snprintf(modified, sizeof(modified), "%s %s%s %s\r\n", method, url, path, version);
@@ -229,6 +361,10 @@
        load_forbidden(argv[4]);
        log_file = fopen(argv[6], "a");
        if (!log_file) { perror("log_file"); exit(1); }
+       char breaker_path[1024];
+       snprintf(breaker_path, sizeof(breaker_path), "%s.breaker", argv[6]);
+       breaker_file = fopen(breaker_path, "a");
+       if (!breaker_file) { perror("breaker log"); exit(1); }
    
        int sockfd = socket(AF_INET, SOCK_STREAM, 0);
        int opt = 1;
@@ -0,0 +1,122 @@
+#!/bin/bash
+# bench.sh — lab3 / lab4 transfers through the impairment relay, swept over mss × winsz × profile
+#
+# usage: ./bench.sh   (after make; the lists below can be overridden from the environment)
+# Prints goodput, retransmission ratio and completion time tables. Every run gets a
+# fresh server and relay with the same seed, so a profile drops the same packets
+# each time the same traffic passes through it. "x" marks a run that timed out,
+# failed or left a file that differs from the input.
+
+SIZE=${SIZE:-1000000}
+MSS_LIST=${MSS_LIST:-"512 1400"}
+WINSZ_LIST=${WINSZ_LIST:-"8 64"}
+CLIENTS=${CLIENTS:-"lab3 lab4"}
+SEED=${SEED:-1}
+RUN_TIMEOUT=${RUN_TIMEOUT:-60}
+PORT=${PORT:-19400}
+LAB3=${LAB3:-../faslam-lab3/bin}
+LAB4=${LAB4:-../faslam-lab4/bin}
+IMPAIR=${IMPAIR:-bin/impair}
+# the lab3 server writes into its working directory, so it runs from the output root
+LAB3=$(cd "$LAB3" && pwd)
+LAB4=$(cd "$LAB4" && pwd)
+
+# name:relay options
+PROFILES=${PROFILES:-"clean: loss2:-l_2 burst:-g_2,25,75 wan:-d_10_-j_3_-r_2 dup:-u_5 slow:-R_20_-q_64"}
+
+WORK=$(mktemp -d)
+trap 'kill $(jobs -p) 2>/dev/null; rm -rf "$WORK"' EXIT
+head -c "$SIZE" /dev/urandom > "$WORK/in.bin"
+RESULTS="$WORK/results"
+
+# run <client> <profile> <relay options> <mss> <winsz>: appends one result line
+run() {
+    local client=$1 profile=$2 opts=$3 mss=$4 winsz=$5
+    local root="$WORK/root" relay=$((PORT + 1))
+    rm -rf "$root"
+    mkdir -p "$root"
+    if [ "$client" = lab3 ]; then
+        (cd "$root" && exec "$LAB3/myserver" "$PORT" 0) > /dev/null 2>&1 &
+    else
+        "$LAB4/myserver" "$PORT" 0 "$root" > /dev/null 2>&1 &
+    fi
+    local srv=$!
+    "$IMPAIR" -s "$SEED" $opts "$relay" 127.0.0.1 "$PORT" > /dev/null 2> "$WORK/relay" &
+    local rly=$!
+    sleep 0.2
+
+    local t0=$(date +%s.%N) rc
+    if [ "$client" = lab3 ]; then
+        timeout "$RUN_TIMEOUT" "$LAB3/myclient" 127.0.0.1 "$relay" "$mss" "$winsz" "$WORK/in.bin" out.bin > "$WORK/log" 2>&1
+        rc=$?
+    else
+        echo "127.0.0.1 $relay" > "$WORK/servaddr.conf"
+        timeout "$RUN_TIMEOUT" "$LAB4/myclient" 1 "$WORK/servaddr.conf" "$mss" "$winsz" "$WORK/in.bin" out.bin > "$WORK/log" 2>&1
+        rc=$?
+    fi
+    local t1=$(date +%s.%N)
+    # lab4 renames the file into place once its writer has drained
+    for _ in $(seq 30); do
+        [ -f "$root/out.bin" ] && break
+        sleep 0.1
+    done
+    kill $srv $rly 2>/dev/null
+    wait $srv $rly 2>/dev/null
+    PORT=$((PORT + 2))
+
+    if [ $rc -ne 0 ] || ! cmp -s "$WORK/in.bin" "$root/out.bin"; then
+        echo "$client $profile $mss $winsz x x x" >> "$RESULTS"
+        return
+    fi
+    local ratio
+    if [ "$client" = lab3 ]; then
+        ratio=$(awk -F', ' '$2 == "DATA" { sent++; if (!seen[$3]++) uniq++ } END { printf "%.1f", sent ? 100 * (sent - uniq) / sent : 0 }' "$WORK/log")
+    else
+        ratio=$(sed -n 's/.*(\([0-9.]*\)%).*/\1/p' "$WORK/log" | head -1)
+    fi
+    awk -v c="$client" -v p="$profile" -v m="$mss" -v w="$winsz" -v r="$ratio" -v t0="$t0" -v t1="$t1" -v s="$SIZE" \
+        'BEGIN { t = t1 - t0; printf "%s %s %s %s %.1f %s %.2f\n", c, p, m, w, s * 8 / t / 1e6, r, t }' >> "$RESULTS"
+}
+
+for client in $CLIENTS; do
+    for entry in $PROFILES; do
+        profile=${entry%%:*}
+        opts=${entry#*:}
+        for mss in $MSS_LIST; do
+            for winsz in $WINSZ_LIST; do
+                run "$client" "$profile" "${opts//_/ }" "$mss" "$winsz"
+            done
+        done
+    done
+done
+
+# table <column> <title>: one row per client/profile, one column per mss × winsz
+table() {
+    echo
+    echo "$2"
+    awk -v col="$1" -v mss="$MSS_LIST" -v win="$WINSZ_LIST" '
+        BEGIN {
+            nm = split(mss, m, " ")
+            nw = split(win, w, " ")
+            printf "%-14s", "client/profile"
+            for (i = 1; i <= nm; i++) for (j = 1; j <= nw; j++) printf " | %10s", "m" m[i] " w" w[j]
+            printf "\n"
+        }
+        {
+            row = $1 "/" $2
+            if (!(row in seen)) { seen[row] = 1; rows[++n] = row }
+            v[row, $3, $4] = $col
+        }
+        END {
+            for (r = 1; r <= n; r++) {
+                printf "%-14s", rows[r]
+                for (i = 1; i <= nm; i++) for (j = 1; j <= nw; j++) printf " | %10s", v[rows[r], m[i], w[j]]
+                printf "\n"
+            }
+        }' "$RESULTS"
+}
+
+echo "$SIZE bytes per transfer, relay seed $SEED"
+table 5 "Goodput (Mbit/s)"
+table 6 "Retransmissions (% of DATA packets sent)"
+table 7 "Completion time (s)"
@@ -0,0 +1,429 @@
+// impair.c — deterministic UDP impairment relay to put in front of a lab server
+//
+// Clients send to the relay's port instead of the server's. Every client
+// address gets its own upstream socket, so the server sees one peer per client
+// and its replies find their way back. Each direction is a separate link with
+// its own PRNG stream, Gilbert-Elliott loss state, rate-limited queue and delay
+// line: the same seed and the same traffic always give the same decisions.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "packet.h"
+
+#define MAX_PACKET_SIZE 65536
+#define MAX_FLOWS 64
+#define REORDER_MS 10        // extra hold for a reordered packet unless given
+#define QUEUE_KB 256         // backlog a rate-limited link holds before tail drop
+#define IP_UDP_HEADER 28     // counted against -M along with the datagram
+
+enum { UP, DOWN };
+static const char *dir_name[] = { "up", "down" };
+
+// Loss, delay and rate of one direction; percentages are 0-100
+struct profile {
+    double loss;        // loss in the good state, the only state without -g
+    double p_bad;       // chance per packet to move good -> bad
+    double p_good;      // chance per packet to move bad -> good
+    double loss_bad;    // loss in the bad state
+    double delay_ms, jitter_ms;
+    double reorder, reorder_ms;
+    double dup;
+    double rate_mbps;   // 0 leaves the link unlimited
+    long queue_bytes;
+    int mtu;            // 0, or larger IP packets vanish without an ICMP error
+    double mtu_after_ms;
+};
+
+struct link {
+    uint64_t rng;
+    int bad;
+    long long busy_ns;  // when the link has sent its current backlog
+    long packets, lost, overflow, dups, reordered, toobig;
+};
+
+struct flow {
+    struct sockaddr_in client;
+    int fd;             // connected to the server
+    unsigned gen;       // bumped on reuse so queued replies for the old client are dropped
+    long long last_ns;
+};
+
+struct pending {
+    long long due_ns;
+    long order;         // FIFO among packets due at the same time
+    int flow;
+    unsigned gen;
+    int dir;
+    int len;
+    unsigned char *data;
+};
+
+static struct pending *heap;
+static int heap_len, heap_cap;
+static long heap_order;
+static struct flow flows[MAX_FLOWS];
+static int nflows;
+static struct link links[2];
+static volatile sig_atomic_t stop;
+static int verbose;
+static long long start_ns;
+
+long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+char *rfc3339_time() {
+    static char buf[64];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    struct tm *tm = gmtime(&ts.tv_sec);
+    strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", tm);
+    int ms = ts.tv_nsec / 1000000;
+    snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), ".%03dZ", ms);
+    return buf;
+}
+
+uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// xorshift64*, uniform in [0, 100) to compare against percentages
+double roll(struct link *l) {
+    l->rng ^= l->rng >> 12;
+    l->rng ^= l->rng << 25;
+    l->rng ^= l->rng >> 27;
+    return (double)((l->rng * 0x2545F4914F6CDD1DULL) >> 11) / (double)(1ULL << 53) * 100;
+}
+
+// Sequence number of a lab packet, for the log only
+uint64_t packet_seq(const unsigned char *data, int len) {
+    return len >= PKT_HEADER ? pkt_seq(data) : 0;
+}
+
+void heap_push(struct pending p) {
+    if (heap_len == heap_cap) {
+        heap_cap = heap_cap ? heap_cap * 2 : 1024;
+        heap = realloc(heap, heap_cap * sizeof(*heap));
+        if (!heap) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    p.order = heap_order++;
+    int i = heap_len++;
+    while (i > 0) {
+        int up = (i - 1) / 2;
+        if (heap[up].due_ns < p.due_ns || (heap[up].due_ns == p.due_ns && heap[up].order < p.order)) break;
+        heap[i] = heap[up];
+        i = up;
+    }
+    heap[i] = p;
+}
+
+struct pending heap_pop(void) {
+    struct pending top = heap[0];
+    struct pending last = heap[--heap_len];
+    int i = 0;
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= heap_len) break;
+        if (c + 1 < heap_len && (heap[c + 1].due_ns < heap[c].due_ns ||
+                                 (heap[c + 1].due_ns == heap[c].due_ns && heap[c + 1].order < heap[c].order)))
+            c++;
+        if (last.due_ns < heap[c].due_ns || (last.due_ns == heap[c].due_ns && last.order < heap[c].order)) break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = last;
+    return top;
+}
+
+void log_event(const char *event, int dir, const unsigned char *data, int len) {
+    if (verbose) printf("%s, %s, %s, %llu\n", rfc3339_time(), event, dir_name[dir],
+                        (unsigned long long)packet_seq(data, len));
+}
+
+// Run one packet through a link: loss, queue, delay, jitter, reorder, duplicate
+void impair(const struct profile *pr, int dir, int flow, const unsigned char *data, int len) {
+    struct link *l = &links[dir];
+    long long now = now_ns();
+    l->packets++;
+
+    // A path MTU black hole, from -M's start time on
+    if (pr->mtu > 0 && len + IP_UDP_HEADER > pr->mtu && now - start_ns >= pr->mtu_after_ms * 1e6) {
+        l->toobig++;
+        log_event("TOOBIG", dir, data, len);
+        return;
+    }
+
+    if (pr->p_bad > 0 || l->bad) {
+        if (l->bad) l->bad = roll(l) >= pr->p_good;
+        else l->bad = roll(l) < pr->p_bad;
+    }
+    if (roll(l) < (l->bad ? pr->loss_bad : pr->loss)) {
+        l->lost++;
+        log_event("DROP", dir, data, len);
+        return;
+    }
+
+    long long sent = now;
+    if (pr->rate_mbps > 0) {
+        long long start = l->busy_ns > now ? l->busy_ns : now;
+        if ((start - now) * pr->rate_mbps / 8000 > pr->queue_bytes) {
+            l->overflow++;
+            log_event("OVERFLOW", dir, data, len);
+            return;
+        }
+        l->busy_ns = start + (long long)(len * 8000 / pr->rate_mbps);
+        sent = l->busy_ns;
+    }
+
+    int copies = 1;
+    if (pr->dup > 0 && roll(l) < pr->dup) {
+        copies = 2;
+        l->dups++;
+        log_event("DUP", dir, data, len);
+    }
+    for (int c = 0; c < copies; ++c) {
+        double delay = pr->delay_ms;
+        if (pr->jitter_ms > 0) delay += (roll(l) / 50 - 1) * pr->jitter_ms;
+        if (pr->reorder > 0 && roll(l) < pr->reorder) {
+            delay += pr->reorder_ms;
+            l->reordered++;
+            log_event("REORDER", dir, data, len);
+        }
+        if (delay < 0) delay = 0;
+
+        struct pending p = { .due_ns = sent + (long long)(delay * 1e6), .flow = flow, .gen = flows[flow].gen,
+                             .dir = dir, .len = len, .data = malloc(len > 0 ? len : 1) };
+        if (!p.data) {
+            perror("malloc");
+            exit(1);
+        }
+        memcpy(p.data, data, len);
+        heap_push(p);
+    }
+}
+
+// Upstream socket for this client, reusing the least recently active one when full
+int flow_for(const struct sockaddr_in *client, const struct sockaddr_in *server) {
+    int lru = 0;
+    for (int i = 0; i < nflows; ++i) {
+        if (flows[i].client.sin_addr.s_addr == client->sin_addr.s_addr && flows[i].client.sin_port == client->sin_port)
+            return i;
+        if (flows[i].last_ns < flows[lru].last_ns) lru = i;
+    }
+    int i = nflows < MAX_FLOWS ? nflows++ : lru;
+    if (flows[i].fd > 0) close(flows[i].fd);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0 || connect(fd, (const struct sockaddr *)server, sizeof(*server)) < 0) {
+        perror("upstream socket");
+        exit(1);
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    flows[i].client = *client;
+    flows[i].fd = fd;
+    flows[i].gen++;
+    return i;
+}
+
+void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-s seed] [-l loss%%] [-g p_bad%%,p_good%%[,loss_bad%%]] [-d delay_ms] [-j jitter_ms]\n"
+                    "       [-r reorder%%[,hold_ms]] [-u dup%%] [-R mbps] [-q queue_kb] [-M mtu[,after_ms]] [-D up|down|both] [-v]\n"
+                    "       <listen_port> <server_ip> <server_port>\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    struct profile pr = { .loss_bad = 100, .reorder_ms = REORDER_MS, .queue_bytes = QUEUE_KB * 1024L };
+    uint64_t seed = 1;
+    int dirs = 3;  // bit 0 up, bit 1 down
+    int opt;
+    while ((opt = getopt(argc, argv, "s:l:g:d:j:r:u:R:q:M:D:v")) != -1) {
+        int ok = 1;
+        switch (opt) {
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'l':
+            pr.loss = atof(optarg);
+            break;
+        case 'g': {
+            double p, r, h = pr.loss_bad;
+            ok = sscanf(optarg, "%lf,%lf,%lf", &p, &r, &h) >= 2;
+            pr.p_bad = p;
+            pr.p_good = r;
+            pr.loss_bad = h;
+            break;
+        }
+        case 'd':
+            pr.delay_ms = atof(optarg);
+            break;
+        case 'j':
+            pr.jitter_ms = atof(optarg);
+            break;
+        case 'r':
+            ok = sscanf(optarg, "%lf,%lf", &pr.reorder, &pr.reorder_ms) >= 1;
+            break;
+        case 'u':
+            pr.dup = atof(optarg);
+            break;
+        case 'R':
+            pr.rate_mbps = atof(optarg);
+            break;
+        case 'q':
+            pr.queue_bytes = atol(optarg) * 1024L;
+            break;
+        case 'M':
+            ok = sscanf(optarg, "%d,%lf", &pr.mtu, &pr.mtu_after_ms) >= 1 && pr.mtu > IP_UDP_HEADER;
+            break;
+        case 'D':
+            dirs = strcmp(optarg, "up") == 0 ? 1 : strcmp(optarg, "down") == 0 ? 2 : strcmp(optarg, "both") == 0 ? 3 : 0;
+            ok = dirs != 0;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            ok = 0;
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 3) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int port = atoi(argv[optind]);
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(atoi(argv[optind + 2]));
+    if (inet_pton(AF_INET, argv[optind + 1], &server.sin_addr) != 1) {
+        fprintf(stderr, "Invalid server address %s\n", argv[optind + 1]);
+        return 1;
+    }
+
+    // One profile per direction; a direction left out of -D passes untouched
+    struct profile clean = { .queue_bytes = pr.queue_bytes };
+    start_ns = now_ns();
+    const struct profile *prof[2] = { dirs & 1 ? &pr : &clean, dirs & 2 ? &pr : &clean };
+    uint64_t x = seed;
+    links[UP].rng = splitmix64(&x) | 1;
+    links[DOWN].rng = splitmix64(&x) | 1;
+
+    int lfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (lfd < 0) {
+        perror("socket");
+        return 1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        return 1;
+    }
+    fcntl(lfd, F_SETFL, O_NONBLOCK);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf("Relay listening on port %d for %s:%d, seed %llu\n", port, argv[optind + 1], ntohs(server.sin_port),
+           (unsigned long long)seed);
+    fflush(stdout);
+
+    unsigned char buf[MAX_PACKET_SIZE];
+    struct pollfd pfd[MAX_FLOWS + 1];
+    while (!stop) {
+        long long now = now_ns();
+        while (heap_len > 0 && heap[0].due_ns <= now) {
+            struct pending p = heap_pop();
+            struct flow *f = &flows[p.flow];
+            if (p.gen == f->gen) {
+                if (p.dir == UP) send(f->fd, p.data, p.len, 0);
+                else sendto(lfd, p.data, p.len, 0, (struct sockaddr *)&f->client, sizeof(f->client));
+            }
+            free(p.data);
+        }
+
+        int npolled = nflows;
+        pfd[0].fd = lfd;
+        pfd[0].events = POLLIN;
+        for (int i = 0; i < nflows; ++i) {
+            pfd[i + 1].fd = flows[i].fd;
+            pfd[i + 1].events = POLLIN;
+        }
+        struct timespec ts = { 1, 0 };
+        if (heap_len > 0) {
+            long long wait = heap[0].due_ns - now;
+            ts.tv_sec = wait / 1000000000LL;
+            ts.tv_nsec = wait % 1000000000LL;
+        }
+        if (ppoll(pfd, nflows + 1, &ts, NULL) < 0) {
+            if (errno == EINTR) continue;
+            perror("ppoll");
+            return 1;
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            struct sockaddr_in client;
+            socklen_t len = sizeof(client);
+            ssize_t n;
+            while ((n = recvfrom(lfd, buf, sizeof(buf), 0, (struct sockaddr *)&client, &len)) >= 0) {
+                int f = flow_for(&client, &server);
+                flows[f].last_ns = now_ns();
+                impair(prof[UP], UP, f, buf, n);
+                len = sizeof(client);
+            }
+        }
+        // Flows created or reused above are polled from the next pass on
+        for (int i = 0; i < npolled; ++i) {
+            if (pfd[i + 1].fd != flows[i].fd || !(pfd[i + 1].revents & POLLIN)) continue;
+            ssize_t n;
+            while ((n = recv(flows[i].fd, buf, sizeof(buf), 0)) >= 0) {
+                flows[i].last_ns = now_ns();
+                impair(prof[DOWN], DOWN, i, buf, n);
+            }
+        }
+    }
+
+    for (int d = UP; d <= DOWN; ++d) {
+        struct link *l = &links[d];
+        fprintf(stderr, "%s: %ld packets, %ld lost (%.2f%%), %ld queue drops, %ld duplicated, %ld reordered, %ld too big\n",
+                dir_name[d], l->packets, l->lost, l->packets ? 100.0 * l->lost / l->packets : 0.0,
+                l->overflow, l->dups, l->reordered, l->toobig);
+    }
+    return 0;
+}